@@ -1,10 +1,22 @@
 // @author Nikolay Malkovsky 2022--...
 
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <functional>
 #include <vector>
 #include <limits>
+#include <memory>
 #include <cstdint>
+#include <cstring>
 #include <string>
 #include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "tree_memory_accountant.h"
 
 namespace beam_search {
 
@@ -14,18 +26,46 @@ using LabelType = uint16_t;
 const IndexType kNoIndex = std::numeric_limits<IndexType>::max();
 const LabelType kNoLabel = std::numeric_limits<LabelType>::max();
 
+/**
+ * Opt-in: Resolve throws on stale handles. Only the check is configured, the layout of the entries and handles is the
+ * same either way, still the macro should be defined consistently in the whole program.
+ */
+#ifndef BEAM_SEARCH_CHECK_HANDLES
+#define BEAM_SEARCH_CHECK_HANDLES 0
+#endif
+
+/**
+ * Entry index that can be safely kept across frames. Ring slots are reused once the ring wraps, the handle
+ * additionally stores the ring generation of the slot at creation time, so an aliased slot is detected instead of
+ * silently referring to a new entry.
+ */
+struct EntryHandle {
+  IndexType index = kNoIndex;
+  IndexType generation = 0;
+};
+
+/**
+ * Events reported to the entry callback of the tree
+ */
+enum class EntryEvent {
+  // All references to the entry are deleted, it is no longer a part of any hypothesis
+  kReleased,
+  // The entry is moved to the detached shared prefix
+  kDetached
+};
+
 template<class BeamEntry>
 class CircularArrayCTCBeamEntryInternal {
  public:
   CircularArrayCTCBeamEntryInternal() = default;
   CircularArrayCTCBeamEntryInternal(LabelType label, IndexType parent, BeamEntry &&entry) : label_(label),
-                                                                                            entry_(std::move(entry)),
-                                                                                            parent_(parent) {}
+                                                                                            parent_(parent),
+                                                                                            entry_(std::move(entry)) {}
 
   template<class... Args>
   CircularArrayCTCBeamEntryInternal(LabelType label, IndexType parent, Args &&... args) : label_(label),
                                                                                           parent_(parent), entry_(
-      std::forward(args)...) {}
+      std::forward<Args>(args)...) {}
 
   /**
    * Returns mutable reference to an origin BeamEntry
@@ -33,6 +73,8 @@ class CircularArrayCTCBeamEntryInternal {
    */
   BeamEntry &GetEntry() { return entry_; }
 
+  const BeamEntry &GetEntry() const { return entry_; }
+
   /**
    * Adds a reference to an entry
    */
@@ -71,6 +113,32 @@ class CircularArrayCTCBeamEntryInternal {
     return active_;
   }
 
+  /**
+   * Returns false if the entry was reserved and its BeamEntry is not constructed yet, see
+   * CircularArrayCTCBeamSearchTree::ReserveChild
+   */
+  bool IsMaterialized() const { return materialized_; }
+
+  /**
+   * Marks that the BeamEntry of the reserved entry is constructed
+   */
+  void MarkMaterialized() { materialized_ = true; }
+
+  /**
+   * Reinitializes the slot for a new entry without touching the BeamEntry left by its previous owner
+   */
+  void Reserve(LabelType label, IndexType parent) {
+    reference_count_ = 1;
+    active_ = true;
+    materialized_ = false;
+    first_child_ = kNoIndex;
+    sibling_ = kNoIndex;
+    label_ = label;
+    parent_ = parent;
+    depth_ = 0;
+    jump_ = kNoIndex;
+  }
+
   /**
    * Number of references to an entry
    * @return
@@ -102,13 +170,48 @@ class CircularArrayCTCBeamEntryInternal {
   /**
    * Returns an index of a parent entry
    */
-  IndexType GetParent() { return parent_; }
+  IndexType GetParent() const { return parent_; }
+
+  /**
+   * Restores the parent cut off by MakeRoot
+   */
+  void SetParent(IndexType value) { parent_ = value; }
 
   /**
    * Returns a label corresponding to this entry
    */
   LabelType GetLabel() const { return label_; }
 
+  /**
+   * Returns the number of labels from the initial root to this entry, detached shared prefix included
+   */
+  IndexType GetDepth() const { return depth_; }
+
+  /**
+   * Sets the depth, should be assigned once at entry creation
+   */
+  void SetDepth(IndexType value) { depth_ = value; }
+
+  /**
+   * Returns an index of an ancestor used to skip several levels at once during ancestor and LCA queries
+   */
+  IndexType GetJump() const { return jump_; }
+
+  /**
+   * Sets the jump pointer, should be assigned once at entry creation
+   */
+  void SetJump(IndexType value) { jump_ = value; }
+
+  /**
+   * Returns the ring generation in which the entry was created
+   */
+  IndexType GetGeneration() const { return generation_; }
+
+  /**
+   * Sets the ring generation, should be assigned once at entry creation
+   */
+  void SetGeneration(IndexType value) { generation_ = value; }
+
   /**
    * Cut off the history of the entry
    */
@@ -128,6 +231,8 @@ class CircularArrayCTCBeamEntryInternal {
   // is an LCA of all the others active entries and the entry has only child.
   CounterType reference_count_ = 1;
   bool active_ = true;
+  // False between ReserveChild and MaterializeEntry, the BeamEntry is a stale one of the previous slot owner
+  bool materialized_ = true;
   /*
    * Children map members.
    *
@@ -140,6 +245,10 @@ class CircularArrayCTCBeamEntryInternal {
   LabelType label_;
 
   IndexType parent_;
+  // Depth is assigned at creation so hypothesis lengths never require walking the tree
+  IndexType depth_ = 0;
+  IndexType jump_ = kNoIndex;
+  IndexType generation_ = 0;
 
   BeamEntry entry_;
 };
@@ -155,6 +264,18 @@ class DetachedSharedPrefixBeamEntry {
   const BeamEntry entry_;
 };
 
+/**
+ * Immutable part of the detached shared prefix. Forked trees share the segments committed before the fork, each tree
+ * keeps appending detached entries to its own tail.
+ */
+template<class BeamEntry>
+struct DetachedSharedPrefixSegment {
+  std::shared_ptr<const DetachedSharedPrefixSegment> previous;
+  std::vector<DetachedSharedPrefixBeamEntry<BeamEntry>> entries;
+  // Memory of the entries is charged once for all the trees sharing the segment
+  MemoryCharge memory_charge;
+};
+
 /**
  * Implementation of a beam search tree data structure. It consists of a prefix tree with custom allocator designed
  * specifically for beam search.
@@ -164,12 +285,19 @@ class DetachedSharedPrefixBeamEntry {
  * all it's predecessors are also deleted.
  *
  * To make the best out of this implementation it is not recommended to use pointers as BeamEntry as that would
- * delegate memory management to a general allocator.
+ * delegate memory management to a general allocator. Trivially copyable BeamEntry types are preferred as well: the
+ * ring is then copied by contiguous runs of raw memory instead of entry by entry.
  * @tparam BeamEntry structure to track non-topologic beam search information
  */
 template<class BeamEntry>
 class CircularArrayCTCBeamSearchTree {
  public:
+  /**
+   * True if ring entries are copied with memcpy, i.e. BeamEntry is trivially copyable
+   */
+  static constexpr bool kTriviallyCopyableEntries =
+      std::is_trivially_copyable<CircularArrayCTCBeamEntryInternal<BeamEntry>>::value;
+
   /**
    * Initializes beam search tree.
    * @param capacity maximum number of elements for tree to store. Attempting the allocation of entry
@@ -182,8 +310,25 @@ class CircularArrayCTCBeamSearchTree {
     }
     capacity_ = capacity_padded;
     entries_.resize(capacity_);
+    UpdateMemoryCharge();
   }
 
+  /**
+   * Memory of the ring of a tree with the given capacity, the detached shared prefix grows on top of it
+   */
+  static size_t EstimateMemory(IndexType capacity) {
+    size_t capacity_padded = 1;
+    while (capacity_padded < capacity) {
+      capacity_padded <<= 1;
+    }
+    return capacity_padded * sizeof(CircularArrayCTCBeamEntryInternal<BeamEntry>);
+  }
+
+  /**
+   * Memory charged by the tree to TreeMemoryAccountant: the ring and the detached shared prefix not shared with forks
+   */
+  size_t GetMemoryUsage() const { return memory_charge_.Get(); }
+
   /**
    * Initializes beam search tree and returns the index of a root entry
    * @param entry BeamEntry to assign to root
@@ -192,8 +337,9 @@ class CircularArrayCTCBeamSearchTree {
   template<class... Args>
   IndexType InitializeTree(Args&&... args) {
     entries_[right_] = CircularArrayCTCBeamEntryInternal<BeamEntry>(kNoLabel, kNoIndex);
+    entries_[right_].SetGeneration(generation_);
     ++size_;
-    ++right_;
+    right_ = (right_ + 1) & (capacity_ - 1);
     return 0;
   }
 
@@ -207,22 +353,27 @@ class CircularArrayCTCBeamSearchTree {
     left_ = 0;
     right_ = 0;
     size_ = 0;
-    entries_.clear();
+    // Entries keep their allocation, handles to the old tree become stale
+    ++generation_;
     detached_shared_prefix_.clear();
+    shared_prefix_.reset();
+    ClearUndo();
     return InitializeTree(args...);
   }
 
   std::vector<CircularArrayCTCBeamEntryInternal<BeamEntry>> Backtrace(IndexType entry_index) {
     std::vector<CircularArrayCTCBeamEntryInternal<BeamEntry>> result;
+    result.reserve(entries_[entry_index].GetDepth() - entries_[left_].GetDepth() + 1 + GetDetachedSize());
     while (!entries_[entry_index].IsRoot()) {
       result.push_back(entries_[entry_index]);
       entry_index = entries_[entry_index].GetParent();
     }
-    for (auto entry_iter = detached_shared_prefix_.rbegin();
-         entry_iter != detached_shared_prefix_.rend(); ++entry_iter) {
-      result.push_back(*entry_iter);
-    }
-    return std::vector<CircularArrayCTCBeamEntryInternal<BeamEntry>>(result.rbegin(), result.rend());
+    result.push_back(entries_[entry_index]);
+    ForEachDetachedEntryReversed([&result](const DetachedSharedPrefixBeamEntry<BeamEntry> &entry) {
+      result.emplace_back(entry.label_, kNoIndex, BeamEntry(entry.entry_));
+    });
+    std::reverse(result.begin(), result.end());
+    return result;
   }
 
   std::vector<LabelType> BacktraceString(IndexType entry_index) {
@@ -236,41 +387,156 @@ class CircularArrayCTCBeamSearchTree {
     if (entries_[entry_index].GetLabel() != kNoLabel) {
       result.push_back(entries_[entry_index].GetLabel());
     }
-    for (auto entry_iter = detached_shared_prefix_.rbegin();
-         entry_iter != detached_shared_prefix_.rend(); ++entry_iter) {
-      if (entry_iter->label_ != kNoLabel) {
-        result.push_back(entry_iter->label_);
+    ForEachDetachedEntryReversed([&result](const DetachedSharedPrefixBeamEntry<BeamEntry> &entry) {
+      if (entry.label_ != kNoLabel) {
+        result.push_back(entry.label_);
       }
-    }
+    });
     return std::vector<LabelType>(result.rbegin(), result.rend());
   }
 
+  /**
+   * Backtraces several entries at once, the result is the same as calling BacktraceString for each of them.
+   *
+   * Parents always precede children in the ring, so instead of independent pointer chases the ring is swept once
+   * backwards from the furthest requested entry to the root. Every entry keeps the list of hypotheses passing through
+   * it, its label is written into each of them at the position given by its depth and the list is moved to the parent.
+   * The work is linear in the swept part of the ring plus the total output length.
+   * @param entry_indices entries to backtrace
+   * @return label sequences in the order of entry_indices
+   */
+  std::vector<std::vector<LabelType>> BacktraceAll(const std::vector<IndexType> &entry_indices) {
+    std::vector<LabelType> prefix;
+    ForEachDetachedEntryReversed([&prefix](const DetachedSharedPrefixBeamEntry<BeamEntry> &entry) {
+      if (entry.label_ != kNoLabel) {
+        prefix.push_back(entry.label_);
+      }
+    });
+    std::reverse(prefix.begin(), prefix.end());
+    auto root_depth = entries_[left_].GetDepth();
+    std::vector<std::vector<LabelType>> result(entry_indices.size());
+    sweep_heads_.resize(capacity_, kNoIndex);
+    sweep_next_.resize(entry_indices.size());
+    IndexType max_offset = 0;
+    for (IndexType i = 0; i < entry_indices.size(); ++i) {
+      auto index = entry_indices[i];
+      result[i] = prefix;
+      result[i].resize(prefix.size() + entries_[index].GetDepth() - root_depth + 1);
+      sweep_next_[i] = sweep_heads_[index];
+      sweep_heads_[index] = i;
+      max_offset = std::max(max_offset, (index - left_) & (capacity_ - 1));
+    }
+    bool has_no_label = false;
+    for (IndexType offset = max_offset + 1; offset-- > 0;) {
+      auto index = (left_ + offset) & (capacity_ - 1);
+      if (sweep_heads_[index] == kNoIndex) {
+        continue;
+      }
+      const auto &entry = entries_[index];
+      auto position = prefix.size() + entry.GetDepth() - root_depth;
+      has_no_label |= entry.GetLabel() == kNoLabel;
+      for (auto i = sweep_heads_[index]; i != kNoIndex;) {
+        auto next = sweep_next_[i];
+        result[i][position] = entry.GetLabel();
+        if (offset > 0) {
+          sweep_next_[i] = sweep_heads_[entry.GetParent()];
+          sweep_heads_[entry.GetParent()] = i;
+        }
+        i = next;
+      }
+      sweep_heads_[index] = kNoIndex;
+    }
+    if (has_no_label) {
+      for (auto &labels: result) {
+        labels.erase(std::remove(labels.begin() + prefix.size(), labels.end(), kNoLabel), labels.end());
+      }
+    }
+    return result;
+  }
+
+  /**
+   * Creates an independent copy of the tree, e.g. to continue decoding of the same stream with another configuration.
+   * Entry indices and handles of this tree remain valid in the copy. Only the live part of the ring is copied, the
+   * detached shared prefix is committed to an immutable segment shared by both trees. Committed entries can not be
+   * reattached, so the undo log of this tree is cleared, the copy starts with undo disabled and without the entry
+   * callback.
+   * @return copy of the tree
+   */
+  CircularArrayCTCBeamSearchTree Fork() {
+    ClearUndo();
+    if (!detached_shared_prefix_.empty()) {
+      auto segment = std::make_shared<DetachedSharedPrefixSegment<BeamEntry>>();
+      segment->previous = std::move(shared_prefix_);
+      segment->entries = std::move(detached_shared_prefix_);
+      segment->memory_charge.Set(segment->entries.capacity() * sizeof(DetachedSharedPrefixBeamEntry<BeamEntry>));
+      detached_shared_prefix_.clear();
+      shared_prefix_ = std::move(segment);
+      UpdateMemoryCharge();
+    }
+    CircularArrayCTCBeamSearchTree result(capacity_);
+    result.left_ = left_;
+    result.right_ = right_;
+    result.size_ = size_;
+    result.generation_ = generation_;
+    result.shared_prefix_ = shared_prefix_;
+    // The live part is at most two contiguous runs split by the end of the ring
+    auto first_run = std::min(size_, capacity_ - left_);
+    CopyEntries(entries_.data() + left_, first_run, result.entries_.data() + left_);
+    CopyEntries(entries_.data(), size_ - first_run, result.entries_.data());
+    return result;
+  }
+
   /**
    * Tell the beam search tree that the entry is no longer in use by beam search. The entry will remain until
    * all its predecessors are also deleted or it is requested by GetChild
    * @param index index of the entry to be deleted
    */
   void DeleteEntry(IndexType index) {
+    Journal(UndoAction::kSetActive, index, entries_[index].IsActive());
     entries_[index].MarkInactive();
+    Journal(UndoAction::kDeleteReference, index);
     entries_[index].DeleteEntryReference();
     while (entries_[index].ReferenceCount() == 0) {
+      if (entry_callback_ && entries_[index].IsMaterialized()) {
+        entry_callback_(EntryEvent::kReleased, index, entries_[index].GetEntry());
+      }
       index = entries_[index].GetParent();
       if (index == kNoIndex) {
         break;
       }
+      Journal(UndoAction::kDeleteReference, index);
       entries_[index].DeleteEntryReference();
     }
     /**
-     * Root/LCA should be left in the tree
+     * Root/LCA should be left in the tree, once everything is deleted the tree is empty until Reset
      */
-    while (entries_[left_].ReferenceCount() <= 1 and !entries_[left_].IsActive()) {
+    auto detached_capacity = detached_shared_prefix_.capacity();
+    while (size_ > 0 and entries_[left_].ReferenceCount() <= 1 and !entries_[left_].IsActive()) {
       // This is the case for shared prefix entry
-      if (entries_[left_].ReferenceCount() == 1) {
+      bool detached = entries_[left_].ReferenceCount() == 1;
+      if (detached && entries_[left_].IsMaterialized()) {
+        if (entry_callback_) {
+          entry_callback_(EntryEvent::kDetached, left_, entries_[left_].GetEntry());
+        }
         detached_shared_prefix_.emplace_back(entries_[left_].GetLabel(), entries_[left_].GetEntry());
+      } else if (detached) {
+        // The slot of a reserved entry holds the stale BeamEntry of the previous owner, the prefix gets the default one
+        detached_shared_prefix_.emplace_back(entries_[left_].GetLabel(), BeamEntry());
+      }
+      Journal(UndoAction::kAdvance, left_, detached);
+      if (!undo_frames_.empty()) {
+        ++undo_frames_.back().advances;
+        ++undo_advances_;
       }
       left_ = (left_ + 1) & (capacity_ - 1);
       --size_;
     }
+    if (detached_shared_prefix_.capacity() != detached_capacity) {
+      UpdateMemoryCharge();
+    }
+    if (!entries_[left_].IsRoot()) {
+      Journal(UndoAction::kMakeRoot, left_, entries_[left_].GetParent());
+    }
     entries_[left_].MakeRoot();
   }
 
@@ -283,40 +549,637 @@ class CircularArrayCTCBeamSearchTree {
    * @return Index of the child if successfully found or created, kNoIndex otherwise
    */
   IndexType GetChild(IndexType parent, LabelType label, bool *created) {
+    auto child = ReserveChild(parent, label, created);
+    if (child != kNoIndex && *created) {
+      MaterializeEntry(child);
+    }
+    return child;
+  }
+
+  /**
+   * Finds an existing child of the parent with the label, the child is neither revived nor created
+   * @return index of the child or kNoIndex if the parent has no such child
+   */
+  IndexType FindChild(IndexType parent, LabelType label) const {
     for (auto cur = entries_[parent].GetFirstChild(); cur != kNoIndex; cur = entries_[cur].GetSibling()) {
       if (entries_[cur].GetLabel() == label) {
-        *created = false;
-        entries_[cur].MarkActive();
         return cur;
       }
     }
+    return kNoIndex;
+  }
+
+  /**
+   * First phase of the two-phase creation: same as GetChild, but a created child only gets its place in the topology,
+   * its BeamEntry is not constructed and holds whatever the slot held before. Most of the children of a frame are
+   * pruned right away, only the survivors are given a BeamEntry by MaterializeEntry, the pruned ones are deleted as
+   * usual. The payload of the candidates is expected to be kept outside the tree until the pruning.
+   *
+   * An existing child that was reserved and never materialized, e.g. pruned and requested again, is reported as
+   * created as well, GetChild and GetChildren materialize such children with the default BeamEntry, so does the
+   * detached shared prefix. The entry callback is not notified about the entries that were never materialized.
+   * @param created store true if the BeamEntry of the child is to be materialized, false otherwise
+   * @return Index of the child if successfully found or created, kNoIndex otherwise
+   */
+  IndexType ReserveChild(IndexType parent, LabelType label, bool *created) {
+    auto child = FindChild(parent, label);
+    if (child != kNoIndex) {
+      *created = !entries_[child].IsMaterialized();
+      ReviveEntry(child);
+      return child;
+    }
     *created = true;
     if (size_ > 0 and right_ == left_) {
       return kNoIndex;
     }
+    return CreateChild(parent, label, false);
+  }
+
+  /**
+   * Second phase of the two-phase creation: constructs the BeamEntry of the entry from the arguments. Like changes
+   * made through GetEntry, materialization is not recorded by the undo log.
+   * @param index index of the entry returned by ReserveChild
+   * @return the constructed BeamEntry
+   */
+  template<class... Args>
+  BeamEntry &MaterializeEntry(IndexType index, Args &&... args) {
+    auto &entry = entries_[index];
+    entry.GetEntry() = BeamEntry(std::forward<Args>(args)...);
+    entry.MarkMaterialized();
+    return entry.GetEntry();
+  }
+
+  /**
+   * Returns false if the entry was reserved by ReserveChild and is not materialized yet
+   */
+  bool IsMaterialized(IndexType index) const { return entries_[index].IsMaterialized(); }
+
+  /**
+   * Batched version of GetChild, the result is the same as calling GetChild for every (parent, label) pair in order.
+   *
+   * Requests are grouped by parent, so the children list of every parent is scanned once for the whole group, and
+   * the missing children are appended to the ring in one pass with a single capacity check when all of them fit.
+   * @param parents parents of the requested children
+   * @param labels labels of the requested children
+   * @param count number of requests
+   * @param children output array of size count, child indices or kNoIndex if the capacity was reached
+   * @param created output array of size count, true if the child was created (or materialized) by the request
+   */
+  void GetChildren(const IndexType *parents, const LabelType *labels, IndexType count, IndexType *children,
+                   bool *created) {
+    batch_order_.resize(count);
+    for (IndexType i = 0; i < count; ++i) {
+      batch_order_[i] = i;
+    }
+    std::sort(batch_order_.begin(), batch_order_.end(), [parents, labels](IndexType lhs, IndexType rhs) {
+      return std::make_tuple(parents[lhs], labels[lhs], lhs) < std::make_tuple(parents[rhs], labels[rhs], rhs);
+    });
+
+    // Existing children lookup, missing children are marked with kNoIndex and remembered by their first request
+    batch_missing_.clear();
+    batch_materialized_.clear();
+    for (IndexType group_begin = 0, group_end; group_begin < count; group_begin = group_end) {
+      auto parent = parents[batch_order_[group_begin]];
+      for (group_end = group_begin; group_end < count && parents[batch_order_[group_end]] == parent; ++group_end) {}
+
+      batch_siblings_.clear();
+      for (auto cur = entries_[parent].GetFirstChild(); cur != kNoIndex; cur = entries_[cur].GetSibling()) {
+        batch_siblings_.emplace_back(entries_[cur].GetLabel(), cur);
+      }
+      std::sort(batch_siblings_.begin(), batch_siblings_.end());
+      auto sibling = batch_siblings_.begin();
+      for (auto i = group_begin; i < group_end; ++i) {
+        auto request = batch_order_[i];
+        if (i > group_begin && labels[request] == labels[batch_order_[i - 1]]) {
+          children[request] = children[batch_order_[i - 1]];
+          continue;
+        }
+        while (sibling != batch_siblings_.end() && sibling->first < labels[request]) {
+          ++sibling;
+        }
+        if (sibling != batch_siblings_.end() && sibling->first == labels[request]) {
+          children[request] = sibling->second;
+          ReviveEntry(sibling->second);
+          if (!entries_[sibling->second].IsMaterialized()) {
+            MaterializeEntry(sibling->second);
+            batch_materialized_.push_back(request);
+          }
+        } else {
+          children[request] = kNoIndex;
+          batch_missing_.push_back(request);
+        }
+      }
+    }
+
+    // Creation in request order, so that the ring layout matches the sequential calls
+    std::sort(batch_missing_.begin(), batch_missing_.end());
+    auto available = capacity_ - size_;
+    for (IndexType i = 0; i < batch_missing_.size() && i < available; ++i) {
+      auto request = batch_missing_[i];
+      children[request] = CreateChild(parents[request], labels[request]);
+    }
+
+    // Duplicates take the result of their first occurrence, which is the only one reporting creation
+    for (IndexType i = 0; i < count; ++i) {
+      auto request = batch_order_[i];
+      bool duplicate = i > 0 && parents[request] == parents[batch_order_[i - 1]] &&
+          labels[request] == labels[batch_order_[i - 1]];
+      if (duplicate) {
+        children[request] = children[batch_order_[i - 1]];
+      }
+      created[request] = children[request] == kNoIndex;
+    }
+    for (auto request: batch_missing_) {
+      created[request] = true;
+    }
+    for (auto request: batch_materialized_) {
+      created[request] = true;
+    }
+  }
+
+  /**
+   * Sets the callback notified from DeleteEntry about released and detached entries, e.g. to free external resources
+   * owned by BeamEntry once no hypothesis refers to them. Released entries are reported from the deleted entry up to
+   * the root, detached ones in the order of depth. A released entry can still be returned by GetChild later. Callbacks
+   * are not reverted by Rewind. Entries reserved by ReserveChild and never materialized are not reported.
+   * @param callback function of the event, the entry index and its BeamEntry, empty function disables notifications
+   */
+  void SetEntryCallback(std::function<void(EntryEvent, IndexType, BeamEntry &)> callback) {
+    entry_callback_ = std::move(callback);
+  }
+
+  /**
+   * Returns mutable reference to the BeamEntry of the entry
+   * @param index index of the entry
+   */
+  BeamEntry &GetEntry(IndexType index) { return entries_[index].GetEntry(); }
+
+  const BeamEntry &GetEntry(IndexType index) const { return entries_[index].GetEntry(); }
+
+  /**
+   * Same as GetEntry, but the current BeamEntry is saved to the undo log first, so the modification is reverted by
+   * Rewind. Without the undo log it is equivalent to GetEntry.
+   * @param index index of the entry
+   */
+  BeamEntry &ModifyEntry(IndexType index) {
+    if (!undo_frames_.empty()) {
+      auto &frame = undo_frames_.back();
+      frame.records.push_back({UndoAction::kModify, index, static_cast<IndexType>(frame.entries.size())});
+      frame.entries.push_back(entries_[index]);
+    }
+    return entries_[index].GetEntry();
+  }
+
+  /**
+   * Enables the undo log keeping the changes made during the last frames, e.g. to re-decode the last chunk when the
+   * acoustic model revises it. The log records the topology changes only (created entries, reference count and
+   * activity changes, reclaimed entries), BeamEntry modifications are recorded through ModifyEntry. Rewinding a frame
+   * takes time proportional to the number of changes made during it. 0 disables the log.
+   * @param frames maximum number of frames that can be rewound
+   */
+  void EnableUndo(IndexType frames) {
+    undo_max_frames_ = frames;
+    ClearUndo();
+  }
+
+  /**
+   * Starts a new frame of the undo log, the oldest frame is forgotten if the log is full. Changes made before the
+   * first call are not recorded.
+   */
+  void BeginFrame() {
+    if (undo_max_frames_ == 0) {
+      return;
+    }
+    UndoFrame frame;
+    if (undo_frames_.size() == undo_max_frames_) {
+      // Buffers of the forgotten frame are reused
+      frame = std::move(undo_frames_.front());
+      undo_frames_.pop_front();
+      undo_advances_ -= frame.advances;
+      frame.records.clear();
+      frame.entries.clear();
+    }
+    frame.left = left_;
+    frame.advances = 0;
+    undo_frames_.push_back(std::move(frame));
+  }
+
+  /**
+   * Number of frames that can currently be rewound, the current frame included
+   */
+  IndexType GetUndoFrames() const { return static_cast<IndexType>(undo_frames_.size()); }
+
+  /**
+   * Reverts the last frames, the current one included, restoring the tree to the state at the beginning of the
+   * earliest reverted frame. Entry indices and handles valid at that moment remain valid, handles of the entries created
+   * in the reverted frames become stale even if their slots are reused later.
+   * @param frames number of frames to revert, should not exceed GetUndoFrames()
+   */
+  void Rewind(IndexType frames) {
+    if (frames > undo_frames_.size()) {
+      throw std::out_of_range("Attempted to rewind more frames than recorded");
+    }
+    for (; frames > 0; --frames) {
+      auto &frame = undo_frames_.back();
+      for (auto record = frame.records.rbegin(); record != frame.records.rend(); ++record) {
+        Undo(*record, frame);
+      }
+      undo_advances_ -= frame.advances;
+      undo_frames_.pop_back();
+    }
+  }
+
+  /**
+   * Returns the label of the entry
+   * @param index index of the entry
+   */
+  LabelType GetLabel(IndexType index) const { return entries_[index].GetLabel(); }
+
+  /**
+   * Returns the parent of the entry or kNoIndex for the root
+   * @param index index of the entry
+   */
+  IndexType GetParent(IndexType index) const { return entries_[index].GetParent(); }
+
+  /**
+   * Returns the length of the hypothesis ending in the entry, i.e. the number of labels BacktraceString would return
+   * @param index index of the entry
+   */
+  IndexType GetDepth(IndexType index) const { return entries_[index].GetDepth(); }
+
+  /**
+   * Finds the ancestor of the entry with the given depth, O(log depth).
+   * @param index index of the entry
+   * @param depth depth of the ancestor
+   * @return index of the ancestor or kNoIndex if the depth exceeds the entry depth or the ancestor is already detached
+   */
+  IndexType GetAncestor(IndexType index, IndexType depth) const {
+    if (depth > entries_[index].GetDepth() || depth < entries_[left_].GetDepth()) {
+      return kNoIndex;
+    }
+    while (entries_[index].GetDepth() > depth) {
+      auto jump = entries_[index].GetJump();
+      if (IsValidJump(index, jump) && entries_[jump].GetDepth() >= depth) {
+        index = jump;
+      } else {
+        index = entries_[index].GetParent();
+      }
+    }
+    return index;
+  }
+
+  /**
+   * Finds the lowest common ancestor of two entries, O(log depth). Both entries are expected to be in the tree, i.e.
+   * not deleted or at least not reclaimed.
+   * @return index of the LCA, the root is the LCA if the entries share only the detached prefix
+   */
+  IndexType GetLCA(IndexType first, IndexType second) const {
+    if (entries_[first].GetDepth() > entries_[second].GetDepth()) {
+      first = GetAncestor(first, entries_[second].GetDepth());
+    } else {
+      second = GetAncestor(second, entries_[first].GetDepth());
+    }
+    // Entries of the same depth have jump targets of the same depth, so the jumps are taken simultaneously
+    while (first != second) {
+      auto first_jump = entries_[first].GetJump();
+      auto second_jump = entries_[second].GetJump();
+      if (first_jump != second_jump && IsValidJump(first, first_jump) && IsValidJump(second, second_jump)) {
+        first = first_jump;
+        second = second_jump;
+      } else {
+        first = entries_[first].GetParent();
+        second = entries_[second].GetParent();
+      }
+    }
+    return first;
+  }
+
+  /**
+   * Returns the length of the longest common prefix of two hypotheses, O(log depth)
+   */
+  IndexType GetCommonPrefixLength(IndexType first, IndexType second) const {
+    return entries_[GetLCA(first, second)].GetDepth();
+  }
+
+  /**
+   * Creates a handle of the entry that can be kept across frames
+   * @param index index of the entry
+   */
+  EntryHandle GetHandle(IndexType index) const {
+    EntryHandle handle;
+    handle.index = index;
+    handle.generation = entries_[index].GetGeneration();
+    return handle;
+  }
+
+  /**
+   * Checks that the handle still refers to the entry it was created for. Deleted entries remain valid until they are
+   * reclaimed.
+   */
+  bool IsValid(const EntryHandle &handle) const {
+    if (handle.index == kNoIndex || handle.index >= capacity_ || ((handle.index - left_) & (capacity_ - 1)) >= size_) {
+      return false;
+    }
+    return entries_[handle.index].GetGeneration() == handle.generation;
+  }
+
+  /**
+   * Returns the index of the entry referred by the handle. With BEAM_SEARCH_CHECK_HANDLES throws if the handle is
+   * stale, otherwise the check is elided.
+   */
+  IndexType Resolve(const EntryHandle &handle) const {
+#if BEAM_SEARCH_CHECK_HANDLES
+    if (!IsValid(handle)) {
+      throw std::runtime_error("Stale entry handle");
+    }
+#endif
+    return handle.index;
+  }
+
+  /**
+   * Gets the current size of the tree without shared prefix. LCA of the current branches is included in the tree as root
+   * @return size of the tree
+   */
+  const IndexType GetSize() const { return size_; }
+
+  /**
+   * Maximum number of entries in the tree, i.e. the requested capacity rounded up to a power of two. Entry indices are
+   * always less than the capacity.
+   */
+  IndexType GetCapacity() const { return capacity_; }
+
+ private:
+  /**
+   * Depth of the jump target for an entry of the given depth. Jumps follow Myers' skew-binary scheme: the jump length
+   * is the smallest term of the greedy decomposition of the depth into numbers of the form 2^k - 1, this gives
+   * O(log depth) ancestor and LCA queries with a single pointer per entry.
+   */
+  static IndexType JumpDepth(IndexType depth) {
+    uint64_t term = 1;
+    while (term * 2 + 1 <= depth) {
+      term = term * 2 + 1;
+    }
+    uint64_t rest = depth;
+    uint64_t last_term = 0;
+    while (rest > 0) {
+      while (term > rest) {
+        term >>= 1;
+      }
+      rest -= term;
+      last_term = term;
+    }
+    return depth - static_cast<IndexType>(last_term);
+  }
+
+  /**
+   * Jump pointer for a new child of the parent, it is either the parent itself or the jump of the parent's jump.
+   * Targets above the root are already detached and are not stored.
+   */
+  IndexType GetChildJump(IndexType parent) const {
+    auto jump_depth = JumpDepth(entries_[parent].GetDepth() + 1);
+    if (jump_depth == entries_[parent].GetDepth()) {
+      return parent;
+    }
+    if (jump_depth < entries_[left_].GetDepth()) {
+      return kNoIndex;
+    }
+    return entries_[entries_[parent].GetJump()].GetJump();
+  }
+
+  /**
+   * Appends a new child of the parent to the ring, capacity should be checked beforehand
+   * @param materialize construct the default BeamEntry, otherwise the child is only reserved
+   */
+  IndexType CreateChild(IndexType parent, LabelType label, bool materialize = true) {
     auto result = right_;
-    entries_[right_] = CircularArrayCTCBeamEntryInternal<BeamEntry>(label, parent);
+    if (!undo_frames_.empty()) {
+      JournalCreate(result);
+    }
+    if (materialize) {
+      entries_[right_] = CircularArrayCTCBeamEntryInternal<BeamEntry>(label, parent);
+    } else {
+      entries_[right_].Reserve(label, parent);
+    }
     entries_[right_].SetSibling(entries_[parent].GetFirstChild());
+    entries_[right_].SetDepth(entries_[parent].GetDepth() + 1);
+    entries_[right_].SetJump(GetChildJump(parent));
+    entries_[right_].SetGeneration(generation_);
     entries_[parent].SetFirstChild(right_);
     entries_[parent].AddEntryReference();
     right_ = (right_ + 1) & (capacity_ - 1);
+    if (right_ == 0) {
+      ++generation_;
+    }
     size_++;
     return result;
   }
 
   /**
-   * Gets the current size of the tree without shared prefix. LCA of the current branches is included in the tree as root
-   * @return size of the tree
+   * Marks the existing child returned by GetChild as active. A deleted child has dropped its own reference and, if
+   * it had no live descendants, the reference to its parent as well, so the references are restored up to the first
+   * entry that is still referenced.
    */
-  const IndexType GetSize() const { return size_; }
+  void ReviveEntry(IndexType index) {
+    if (entries_[index].IsActive()) {
+      return;
+    }
+    Journal(UndoAction::kSetActive, index, false);
+    entries_[index].MarkActive();
+    while (index != kNoIndex) {
+      bool referenced = entries_[index].ReferenceCount() > 0;
+      Journal(UndoAction::kAddReference, index);
+      entries_[index].AddEntryReference();
+      if (referenced) {
+        break;
+      }
+      index = entries_[index].GetParent();
+    }
+  }
+
+  /**
+   * Copies consecutive ring entries, a single memcpy for trivially copyable entries
+   */
+  static void CopyEntries(const CircularArrayCTCBeamEntryInternal<BeamEntry> *from, IndexType count,
+                          CircularArrayCTCBeamEntryInternal<BeamEntry> *to) {
+    if constexpr (kTriviallyCopyableEntries) {
+      if (count > 0) {
+        std::memcpy(static_cast<void *>(to), from, count * sizeof(*from));
+      }
+    } else {
+      std::copy(from, from + count, to);
+    }
+  }
+
+  /**
+   * Number of entries in the detached shared prefix, the shared segments included
+   */
+  size_t GetDetachedSize() const {
+    auto result = detached_shared_prefix_.size();
+    for (auto segment = shared_prefix_.get(); segment != nullptr; segment = segment->previous.get()) {
+      result += segment->entries.size();
+    }
+    return result;
+  }
+
+  void UpdateMemoryCharge() {
+    memory_charge_.Set(entries_.capacity() * sizeof(CircularArrayCTCBeamEntryInternal<BeamEntry>) +
+                       detached_shared_prefix_.capacity() * sizeof(DetachedSharedPrefixBeamEntry<BeamEntry>));
+  }
+
+  /**
+   * Visits detached shared prefix entries starting from the most recently detached one
+   */
+  template<class Function>
+  void ForEachDetachedEntryReversed(Function function) const {
+    for (auto entry_iter = detached_shared_prefix_.rbegin(); entry_iter != detached_shared_prefix_.rend();
+         ++entry_iter) {
+      function(*entry_iter);
+    }
+    for (auto segment = shared_prefix_.get(); segment != nullptr; segment = segment->previous.get()) {
+      for (auto entry_iter = segment->entries.rbegin(); entry_iter != segment->entries.rend(); ++entry_iter) {
+        function(*entry_iter);
+      }
+    }
+  }
+
+  /**
+   * Jump target becomes invalid once it is detached. Ancestors precede descendants in the ring and a reclaimed slot
+   * can only be reused after the entry itself was created, so the target is valid iff it precedes the entry.
+   */
+  bool IsValidJump(IndexType index, IndexType jump) const {
+    return jump != kNoIndex && ((jump - left_) & (capacity_ - 1)) < ((index - left_) & (capacity_ - 1));
+  }
+
+  enum class UndoAction : uint8_t {
+    // index is the created entry, value is the position of the overwritten slot contents or kNoIndex
+    kCreate,
+    // value is the previous activity flag
+    kSetActive,
+    kDeleteReference,
+    kAddReference,
+    // index is the reclaimed entry, value is true if it was moved to the detached shared prefix
+    kAdvance,
+    // value is the parent cut off
+    kMakeRoot,
+    // value is the position of the saved entry
+    kModify
+  };
+
+  struct UndoRecord {
+    UndoAction action;
+    IndexType index;
+    IndexType value;
+  };
+
+  struct UndoFrame {
+    std::vector<UndoRecord> records;
+    // Saved copies of overwritten and modified entries referenced by records
+    std::vector<CircularArrayCTCBeamEntryInternal<BeamEntry>> entries;
+    // left_ at the beginning of the frame and the number of entries reclaimed during the frame
+    IndexType left = 0;
+    IndexType advances = 0;
+  };
+
+  void Journal(UndoAction action, IndexType index, IndexType value = 0) {
+    if (!undo_frames_.empty()) {
+      undo_frames_.back().records.push_back({action, index, value});
+    }
+  }
+
+  /**
+   * Records creation of an entry in the slot. Slot contents are only needed if the slot was reclaimed within the log,
+   * since rewinding makes the reclaimed entry live again. Otherwise the slot was already free at the log start.
+   */
+  void JournalCreate(IndexType slot) {
+    auto &frame = undo_frames_.back();
+    auto window_left = undo_frames_.front().left;
+    bool reclaimed = undo_advances_ >= capacity_ ||
+        ((slot - window_left) & (capacity_ - 1)) < ((left_ - window_left) & (capacity_ - 1));
+    if (reclaimed) {
+      frame.records.push_back({UndoAction::kCreate, slot, static_cast<IndexType>(frame.entries.size())});
+      frame.entries.push_back(entries_[slot]);
+    } else {
+      frame.records.push_back({UndoAction::kCreate, slot, kNoIndex});
+    }
+  }
+
+  void Undo(const UndoRecord &record, UndoFrame &frame) {
+    auto &entry = entries_[record.index];
+    switch (record.action) {
+      case UndoAction::kCreate: {
+        // Children are prepended and reverted in reverse order, so the entry is the head of the parent's list
+        auto parent = entry.GetParent();
+        entries_[parent].SetFirstChild(entry.GetSibling());
+        entries_[parent].DeleteEntryReference();
+        if (record.value != kNoIndex) {
+          entry = std::move(frame.entries[record.value]);
+        }
+        // Generations only grow, the slot created again must not match the handles of the rewound entry
+        ++generation_;
+        right_ = record.index;
+        --size_;
+        break;
+      }
+      case UndoAction::kSetActive:
+        if (record.value) {
+          entry.MarkActive();
+        } else {
+          entry.MarkInactive();
+        }
+        break;
+      case UndoAction::kDeleteReference:
+        entry.AddEntryReference();
+        break;
+      case UndoAction::kAddReference:
+        entry.DeleteEntryReference();
+        break;
+      case UndoAction::kAdvance:
+        if (record.value) {
+          detached_shared_prefix_.pop_back();
+        }
+        left_ = record.index;
+        ++size_;
+        break;
+      case UndoAction::kMakeRoot:
+        entry.SetParent(record.value);
+        break;
+      case UndoAction::kModify:
+        entry.GetEntry() = std::move(frame.entries[record.value].GetEntry());
+        break;
+    }
+  }
+
+  void ClearUndo() {
+    undo_frames_.clear();
+    undo_advances_ = 0;
+  }
 
- private:
   IndexType left_ = 0;
   IndexType right_ = 0;
   IndexType size_ = 0;
   IndexType capacity_;
+  // Incremented every time the ring wraps and on reset, entries remember the generation they were created in
+  IndexType generation_ = 0;
   std::vector<CircularArrayCTCBeamEntryInternal<BeamEntry>> entries_;
+  // Detached entries since the last fork, the earlier ones are in the shared segments
   std::vector<DetachedSharedPrefixBeamEntry<BeamEntry>> detached_shared_prefix_;
+  std::shared_ptr<const DetachedSharedPrefixSegment<BeamEntry>> shared_prefix_;
+  // Scratch lists of BacktraceAll: per-entry heads and per-hypothesis links
+  std::vector<IndexType> sweep_heads_;
+  std::vector<IndexType> sweep_next_;
+  // Scratch buffers of GetChildren
+  std::vector<IndexType> batch_order_;
+  std::vector<IndexType> batch_missing_;
+  std::vector<IndexType> batch_materialized_;
+  std::vector<std::pair<LabelType, IndexType>> batch_siblings_;
+  // Undo log, one frame per BeginFrame call, the total number of entries reclaimed within the log is kept to detect
+  // reuse of the slots reclaimed within it
+  IndexType undo_max_frames_ = 0;
+  std::deque<UndoFrame> undo_frames_;
+  IndexType undo_advances_ = 0;
+  std::function<void(EntryEvent, IndexType, BeamEntry &)> entry_callback_;
+  MemoryCharge memory_charge_;
+  TreeCounter tree_counter_;
 };
 
 } // beam_search
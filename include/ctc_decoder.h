@@ -0,0 +1,811 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "beam_search_tree.h"
+#include "nbest.h"
+
+namespace beam_search {
+
+const float kLogZero = -std::numeric_limits<float>::infinity();
+
+/**
+ * log(exp(lhs) + exp(rhs)) without overflow
+ */
+inline float LogAddExp(float lhs, float rhs) {
+  if (lhs < rhs) {
+    std::swap(lhs, rhs);
+  }
+  if (rhs == kLogZero) {
+    return lhs;
+  }
+  return lhs + std::log1p(std::exp(rhs - lhs));
+}
+
+/**
+ * Maximum of the values, size should be positive. The values are scanned by 8 independent lanes without branches, so
+ * the loop compiles into vector max instructions and runs at memory bandwidth.
+ */
+inline float MaxValue(const float *values, size_t size) {
+  constexpr size_t kLanes = 8;
+  float best = values[0];
+  size_t position = 0;
+  if (size >= kLanes) {
+    float lanes[kLanes];
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      lanes[lane] = values[lane];
+    }
+    for (position = kLanes; position + kLanes <= size; position += kLanes) {
+      for (size_t lane = 0; lane < kLanes; ++lane) {
+        // The operand order matches the semantics of the vector max instruction
+        lanes[lane] = values[position + lane] > lanes[lane] ? values[position + lane] : lanes[lane];
+      }
+    }
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+      best = std::max(best, lanes[lane]);
+    }
+  }
+  for (; position < size; ++position) {
+    best = std::max(best, values[position]);
+  }
+  return best;
+}
+
+/**
+ * Index of the maximum value, the first one on ties. The position is found by a short scan of the row which is
+ * already in cache after MaxValue.
+ * @param values array to scan
+ * @param size number of values, should be positive
+ */
+inline LabelType ArgMax(const float *values, LabelType size) {
+  auto best = MaxValue(values, size);
+  LabelType result = 0;
+  while (result + 1 < size && values[result] != best) {
+    ++result;
+  }
+  return result;
+}
+
+/**
+ * Difference between the largest and the second largest values, infinity for a single value
+ * @param values array to scan
+ * @param size number of values, should be positive
+ * @param first output index of the largest value
+ */
+inline float TopTwoMargin(const float *values, LabelType size, LabelType *first) {
+  *first = ArgMax(values, size);
+  auto second = -std::numeric_limits<float>::infinity();
+  if (*first > 0) {
+    second = MaxValue(values, *first);
+  }
+  if (*first + 1 < size) {
+    second = std::max(second, MaxValue(values + *first + 1, size - *first - 1));
+  }
+  return values[*first] - second;
+}
+
+struct DeadlineOptions {
+  // Time budget of a chunk, zero disables the deadline mode
+  std::chrono::nanoseconds chunk_budget{0};
+  // Limits of the degradation, the blank fast path is forced when even these are too expensive
+  IndexType min_beam_size = 1;
+  IndexType min_top_k = 1;
+  // Time source, steady clock if empty
+  std::function<std::chrono::nanoseconds()> clock;
+};
+
+/**
+ * Label level language model: log-probability of the label after the LM state and the next state, 0 is the initial
+ * state. Called when a prefix is created, must be safe to call concurrently if shared by several decoders.
+ */
+using LabelScorer = std::function<float(IndexType state, LabelType label, IndexType *next_state)>;
+
+struct CTCDecoderOptions {
+  IndexType beam_size = 8;
+  // Number of the most probable labels of a frame considered for expansion, 0 for all labels
+  IndexType top_k = 0;
+  // Candidates scoring below the best one by more than the threshold are pruned
+  float beam_threshold = std::numeric_limits<float>::infinity();
+  // Frames with blank log-probability above the threshold only extend hypotheses with blank and repeats
+  float blank_skip_threshold = std::numeric_limits<float>::infinity();
+  LabelType blank = 0;
+  // Frames where the top-1 label log-probability exceeds the top-2 one by more than the margin are decoded greedily:
+  // hypotheses are only extended with the top-1 label and collapse to the best one, 0 disables the hybrid mode
+  float hybrid_margin = 0.0f;
+  // Shallow fusion: hypotheses are ranked by the CTC score plus lm_weight times the LM score of the labels plus
+  // insertion_bonus per label
+  float lm_weight = 0.0f;
+  float insertion_bonus = 0.0f;
+  IndexType tree_capacity = 4096;
+  DeadlineOptions deadline;
+};
+
+struct ChunkStats {
+  IndexType frames = 0;
+  // Frames decoded with reduced beam size or top-k or with the forced blank fast path
+  IndexType degraded_frames = 0;
+  // Smallest limits used within the chunk
+  IndexType min_beam_size = 0;
+  IndexType min_top_k = 0;
+  // Confident frames decoded greedily in the hybrid mode
+  IndexType greedy_frames = 0;
+  // Candidates lost because the tree capacity was reached
+  IndexType dropped_candidates = 0;
+  // Labels whose posteriors were fused by ProcessEnsembleChunk
+  size_t fused_labels = 0;
+  std::chrono::nanoseconds elapsed{0};
+
+  bool IsDegraded() const { return degraded_frames > 0 || dropped_candidates > 0; }
+};
+
+/**
+ * LM query of a created prefix deferred by CTCPrefixBeamSearchDecoder::ExpandFrame
+ */
+struct LMQuery {
+  // Staged candidate of the prefix in the frame
+  IndexType index;
+  // LM state of the parent and the appended label
+  IndexType state;
+  LabelType label;
+};
+
+struct CTCHypothesis {
+  std::vector<LabelType> labels;
+  float score;
+};
+
+/**
+ * Prefix scores of a hypothesis in CTC prefix beam search: probabilities of the prefix with the alignment ending in
+ * blank and in its last label. Scores of the next frame are accumulated separately, the frame stamp tells whether the
+ * accumulators were already initialized in the current frame.
+ */
+struct CTCBeamEntry {
+  float blank = kLogZero;
+  float label = kLogZero;
+  float next_blank = kLogZero;
+  float next_label = kLogZero;
+  IndexType frame = kNoIndex;
+  // Unweighted LM score of the prefix and the LM state after it
+  float lm = 0.0f;
+  IndexType lm_state = 0;
+
+  float GetScore() const { return LogAddExp(blank, label); }
+};
+
+/**
+ * Admission of a new decoding stream by the budgets of TreeMemoryAccountant. The options are kept if the tree fits
+ * the soft budget, beam size and tree capacity are halved if the smaller tree fits the hard budget, otherwise the
+ * stream should be rejected and the options are not changed.
+ */
+inline Admission AdmitStream(CTCDecoderOptions *options) {
+  using Tree = CircularArrayCTCBeamSearchTree<CTCBeamEntry>;
+  auto downgraded = *options;
+  downgraded.beam_size = std::max<IndexType>(options->beam_size / 2, 1);
+  downgraded.tree_capacity = std::max<IndexType>(options->tree_capacity / 2, 1);
+  auto admission = TreeMemoryAccountant::Global().Admit(Tree::EstimateMemory(options->tree_capacity),
+                                                        Tree::EstimateMemory(downgraded.tree_capacity));
+  if (admission == Admission::kDowngraded) {
+    *options = downgraded;
+  }
+  return admission;
+}
+
+/**
+ * Labels selected for expansion in the frames of a chunk. The selection only depends on the posteriors and the
+ * top_k, hybrid_margin and blank options, so it is computed once and shared by the decoders that differ otherwise.
+ */
+struct ChunkSelection {
+  // Non-blank labels of frame t are labels[offsets[t], offsets[t + 1])
+  std::vector<LabelType> labels;
+  std::vector<IndexType> offsets;
+  // Frames decoded greedily in the hybrid mode
+  std::vector<bool> greedy;
+};
+
+/**
+ * Streaming CTC prefix beam search over CircularArrayCTCBeamSearchTree. Posteriors are fed by chunks of frames with
+ * log-probabilities stored row by row, hypotheses can be requested at any moment.
+ *
+ * Every frame each hypothesis is extended with blank, its last label repeat and the top-k labels of the frame, the
+ * best beam_size candidates survive and the rest are deleted from the tree. Top-k selection is shared by all the
+ * hypotheses of the frame. Prefixes that are not in the tree yet are scored in a flat staging array and only the
+ * survivors are inserted, so the majority of the candidates never creates and deletes tree entries.
+ *
+ * In the hybrid mode confident frames are decoded greedily, the beam only expands over the uncertain regions and
+ * collapses back to a single hypothesis on the next confident frame.
+ *
+ * In deadline mode the decoder measures the cost of a frame per expanded (hypothesis, label) pair and before every
+ * frame chooses beam size and top-k that fit the time left for the chunk divided by the remaining frames. When even
+ * the minimal limits do not fit, frames with blank as the most probable label take the blank fast path. Degradation
+ * is reported in the chunk statistics.
+ *
+ * With a LabelScorer the hypotheses are ranked with shallow fusion. LM scores are computed once per tree entry when
+ * the prefix is created and kept unweighted in the entry, the weights only enter the ranking.
+ */
+class CTCPrefixBeamSearchDecoder {
+ public:
+  /**
+   * @param vocabulary_size number of labels in a frame, blank included
+   * @param options decoding options
+   */
+  CTCPrefixBeamSearchDecoder(LabelType vocabulary_size, const CTCDecoderOptions &options = CTCDecoderOptions())
+      : vocabulary_size_(vocabulary_size), options_(options), tree_(options.tree_capacity) {
+    if (options.blank >= vocabulary_size) {
+      throw std::invalid_argument("Blank label is out of vocabulary");
+    }
+    if (options.beam_size == 0) {
+      throw std::invalid_argument("Beam size should be positive");
+    }
+    Reset();
+  }
+
+  /**
+   * Sets the label language model used with lm_weight, should be set before decoding of an utterance
+   */
+  void SetLabelScorer(LabelScorer scorer) { scorer_ = std::move(scorer); }
+
+  /**
+   * Starts decoding of a new utterance
+   */
+  void Reset() {
+    auto root = tree_.Reset();
+    auto &entry = tree_.GetEntry(root);
+    entry = CTCBeamEntry();
+    entry.blank = 0.0f;
+    beams_.assign(1, root);
+    frame_ = 0;
+  }
+
+  /**
+   * Decodes a chunk of frames
+   * @param log_probs frames x vocabulary_size matrix of label log-probabilities stored row by row
+   * @param frames number of frames in the chunk
+   * @return statistics of the chunk
+   */
+  ChunkStats ProcessChunk(const float *log_probs, IndexType frames) {
+    ChunkStats stats;
+    stats.frames = frames;
+    auto full_top_k = GetFullTopK();
+    stats.min_beam_size = options_.beam_size;
+    stats.min_top_k = full_top_k;
+    bool deadline = options_.deadline.chunk_budget.count() > 0;
+    auto start = deadline ? Now() : std::chrono::nanoseconds(0);
+    for (IndexType t = 0; t < frames; ++t) {
+      const float *frame = log_probs + static_cast<size_t>(t) * vocabulary_size_;
+      if (IsGreedyFrame(frame)) {
+        ProcessFrame(frame, 1, 1, nullptr, 0, false, &stats);
+        ++stats.greedy_frames;
+        continue;
+      }
+      if (!deadline) {
+        ProcessFrame(frame, options_.beam_size, full_top_k, nullptr, 0, false, &stats);
+        continue;
+      }
+      auto frame_start = Now();
+      auto remaining = options_.deadline.chunk_budget - (frame_start - start);
+      auto allowance = static_cast<double>(remaining.count()) / (frames - t);
+      IndexType beam_size = options_.beam_size;
+      IndexType top_k = full_top_k;
+      bool force_fast_path = false;
+      if (unit_cost_ > 0.0) {
+        auto work = std::max(allowance / unit_cost_, 0.0);
+        if (static_cast<double>(beam_size) * top_k > work) {
+          beam_size = Clamp(work / top_k, options_.deadline.min_beam_size, beam_size);
+        }
+        if (static_cast<double>(beam_size) * top_k > work) {
+          top_k = Clamp(work / beam_size, options_.deadline.min_top_k, top_k);
+        }
+        force_fast_path = static_cast<double>(beam_size) * top_k > work;
+      }
+      auto work = ProcessFrame(frame, beam_size, top_k, nullptr, 0, force_fast_path, &stats);
+      auto cost = static_cast<double>((Now() - frame_start).count()) / std::max<IndexType>(work, 1);
+      unit_cost_ = unit_cost_ > 0.0 ? 0.8 * unit_cost_ + 0.2 * cost : cost;
+
+      if (beam_size < options_.beam_size || top_k < full_top_k || force_fast_path) {
+        ++stats.degraded_frames;
+      }
+      stats.min_beam_size = std::min(stats.min_beam_size, beam_size);
+      stats.min_top_k = std::min(stats.min_top_k, top_k);
+    }
+    if (deadline) {
+      stats.elapsed = Now() - start;
+    }
+    return stats;
+  }
+
+  /**
+   * Computes the labels of the chunk frames expanded by ProcessChunk
+   */
+  void SelectChunk(const float *log_probs, IndexType frames, ChunkSelection *selection) {
+    selection->labels.clear();
+    selection->offsets.assign(1, 0);
+    selection->greedy.resize(frames);
+    auto full_top_k = GetFullTopK();
+    for (IndexType t = 0; t < frames; ++t) {
+      const float *frame = log_probs + static_cast<size_t>(t) * vocabulary_size_;
+      selection->greedy[t] = IsGreedyFrame(frame);
+      SelectLabels(frame, selection->greedy[t] ? 1 : full_top_k);
+      selection->labels.insert(selection->labels.end(), labels_.begin(), labels_.end());
+      selection->offsets.push_back(static_cast<IndexType>(selection->labels.size()));
+    }
+  }
+
+  /**
+   * Decodes a chunk of frames with the labels selected by SelectChunk of a decoder with the same top_k, hybrid_margin
+   * and blank options. The result is the same as of ProcessChunk, the deadline mode is not used.
+   */
+  ChunkStats ProcessChunk(const float *log_probs, IndexType frames, const ChunkSelection &selection) {
+    ChunkStats stats;
+    stats.frames = frames;
+    stats.min_beam_size = options_.beam_size;
+    stats.min_top_k = GetFullTopK();
+    for (IndexType t = 0; t < frames; ++t) {
+      const float *frame = log_probs + static_cast<size_t>(t) * vocabulary_size_;
+      const auto *labels = selection.labels.data() + selection.offsets[t];
+      auto count = selection.offsets[t + 1] - selection.offsets[t];
+      if (selection.greedy[t]) {
+        ProcessFrame(frame, 1, 1, labels, count, false, &stats);
+        ++stats.greedy_frames;
+      } else {
+        ProcessFrame(frame, options_.beam_size, stats.min_top_k, labels, count, false, &stats);
+      }
+    }
+    return stats;
+  }
+
+  /**
+   * Decodes a chunk of frames of a model ensemble fusing the posteriors lazily. The fused log-probability of a label
+   * is the weighted sum of its log-probabilities in the models, it is computed only for blank, the last labels of the
+   * hypotheses and the union of the top_k labels of every model, the frame labels are then selected among the fused
+   * ones. With top_k = 0 all the labels are fused and the result is the same as of ProcessChunk on the fused matrix.
+   * The deadline mode is not used.
+   * @param streams pointers to the frames x vocabulary_size log-probability matrices of the models
+   * @param weights weights of the models
+   * @param models number of models
+   * @param frames number of frames in the chunk
+   * @return statistics of the chunk
+   */
+  ChunkStats ProcessEnsembleChunk(const float *const *streams, const float *weights, IndexType models,
+                                  IndexType frames) {
+    if (models == 0) {
+      throw std::invalid_argument("At least one model is required");
+    }
+    ChunkStats stats;
+    stats.frames = frames;
+    auto full_top_k = GetFullTopK();
+    stats.min_beam_size = options_.beam_size;
+    stats.min_top_k = full_top_k;
+    fused_.resize(vocabulary_size_);
+    label_marks_.resize(vocabulary_size_, false);
+    for (IndexType t = 0; t < frames; ++t) {
+      auto offset = static_cast<size_t>(t) * vocabulary_size_;
+      fused_labels_.clear();
+      MarkFused(options_.blank);
+      for (auto beam: beams_) {
+        if (tree_.GetLabel(beam) != kNoLabel) {
+          MarkFused(tree_.GetLabel(beam));
+        }
+      }
+      for (IndexType model = 0; model < models; ++model) {
+        SelectLabels(streams[model] + offset, full_top_k);
+        for (auto label: labels_) {
+          MarkFused(label);
+        }
+      }
+      for (auto label: fused_labels_) {
+        float value = 0.0f;
+        for (IndexType model = 0; model < models; ++model) {
+          value += weights[model] * streams[model][offset + label];
+        }
+        fused_[label] = value;
+        label_marks_[label] = false;
+      }
+      stats.fused_labels += fused_labels_.size();
+
+      // Hybrid decision and top-k selection among the fused labels
+      auto order = [this](LabelType lhs, LabelType rhs) {
+        return fused_[lhs] > fused_[rhs] || (fused_[lhs] == fused_[rhs] && lhs < rhs);
+      };
+      auto size = fused_labels_.size();
+      bool greedy = false;
+      if (options_.hybrid_margin > 0.0f && size > 1) {
+        std::partial_sort(fused_labels_.begin(), fused_labels_.begin() + 2, fused_labels_.end(), order);
+        greedy = fused_[fused_labels_[0]] - fused_[fused_labels_[1]] > options_.hybrid_margin;
+      }
+      auto top_k = std::min<size_t>(greedy ? 1 : full_top_k, size);
+      std::nth_element(fused_labels_.begin(), fused_labels_.begin() + top_k - 1, fused_labels_.end(), order);
+      fused_labels_.resize(top_k);
+      fused_labels_.erase(std::remove(fused_labels_.begin(), fused_labels_.end(), options_.blank),
+                          fused_labels_.end());
+      std::sort(fused_labels_.begin(), fused_labels_.end());
+      ProcessFrame(fused_.data(), greedy ? 1 : options_.beam_size, top_k, fused_labels_.data(), fused_labels_.size(),
+                   false, &stats);
+      if (greedy) {
+        ++stats.greedy_frames;
+      }
+    }
+    return stats;
+  }
+
+  /**
+   * First phase of two phase frame decoding, used to batch the LM queries of several decoders: the hypotheses are
+   * extended with the frame and the LM queries of the created prefixes are appended to queries instead of calling the
+   * scorer. The caller answers them with SetLMScore and calls SelectFrame. The deadline mode is not used.
+   * @param frame label log-probabilities of the frame
+   * @param queries output LM queries
+   * @param stats statistics of the chunk
+   */
+  void ExpandFrame(const float *frame, std::vector<LMQuery> *queries, ChunkStats *stats) {
+    bool greedy = IsGreedyFrame(frame);
+    pending_beam_size_ = greedy ? 1 : options_.beam_size;
+    if (greedy) {
+      ++stats->greedy_frames;
+    }
+    if (!Expand(frame, greedy ? 1 : GetFullTopK(), nullptr, 0, false, queries, stats)) {
+      pending_beam_size_ = 0;
+    }
+  }
+
+  /**
+   * Sets the LM score of a query of ExpandFrame
+   * @param query the query
+   * @param score log-probability of the label after the state
+   * @param next_state LM state after the label
+   */
+  void SetLMScore(const LMQuery &query, float score, IndexType next_state) {
+    auto &candidate = candidates_[query.index];
+    candidate.lm = tree_.GetEntry(candidate.parent).lm + score;
+    candidate.lm_state = next_state;
+  }
+
+  /**
+   * Second phase of two phase frame decoding, selects the hypotheses of the frame
+   */
+  void SelectFrame() {
+    if (pending_beam_size_ > 0) {
+      Select(pending_beam_size_);
+      pending_beam_size_ = 0;
+    }
+  }
+
+  /**
+   * Returns the best hypothesis decoded so far
+   */
+  CTCHypothesis GetBest() {
+    auto best = beams_[0];
+    for (auto beam: beams_) {
+      if (GetRankScore(beam) > GetRankScore(best)) {
+        best = beam;
+      }
+    }
+    return {tree_.BacktraceString(best), GetRankScore(best)};
+  }
+
+  /**
+   * Returns up to n best hypotheses decoded so far sorted by length normalized score
+   */
+  std::vector<CTCHypothesis> GetNBest(IndexType n, const FinalScoringOptions &options = FinalScoringOptions()) {
+    std::vector<float> scores;
+    for (auto beam: beams_) {
+      scores.push_back(GetRankScore(beam));
+    }
+    auto nbest = SelectNBest(tree_, beams_, scores, n, options);
+    std::vector<IndexType> indices;
+    for (const auto &entry: nbest) {
+      indices.push_back(entry.index);
+    }
+    auto labels = tree_.BacktraceAll(indices);
+    std::vector<CTCHypothesis> result;
+    for (size_t i = 0; i < nbest.size(); ++i) {
+      result.push_back({std::move(labels[i]), nbest[i].score});
+    }
+    return result;
+  }
+
+  /**
+   * Tree entries of the current hypotheses
+   */
+  const std::vector<IndexType> &GetBeams() const { return beams_; }
+
+  const CircularArrayCTCBeamSearchTree<CTCBeamEntry> &GetTree() const { return tree_; }
+
+  const CTCDecoderOptions &GetOptions() const { return options_; }
+
+  LabelType GetVocabularySize() const { return vocabulary_size_; }
+
+ private:
+  IndexType GetFullTopK() const {
+    return options_.top_k == 0 ? vocabulary_size_ : std::min<IndexType>(options_.top_k, vocabulary_size_);
+  }
+
+  bool IsGreedyFrame(const float *frame) const {
+    LabelType top;
+    return options_.hybrid_margin > 0.0f && TopTwoMargin(frame, vocabulary_size_, &top) > options_.hybrid_margin;
+  }
+
+  /**
+   * Score used for ranking: CTC score with the weighted LM score and the insertion bonus
+   */
+  float GetRankScore(IndexType index) const {
+    const auto &entry = tree_.GetEntry(index);
+    return entry.GetScore() + options_.lm_weight * entry.lm + options_.insertion_bonus * tree_.GetDepth(index);
+  }
+
+  static IndexType Clamp(double value, IndexType low, IndexType high) {
+    return static_cast<IndexType>(std::max<double>(low, std::min<double>(high, std::floor(value))));
+  }
+
+  std::chrono::nanoseconds Now() const {
+    if (options_.deadline.clock) {
+      return options_.deadline.clock();
+    }
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch());
+  }
+
+  /**
+   * Adds the label to the fused labels of the frame once
+   */
+  void MarkFused(LabelType label) {
+    if (!label_marks_[label]) {
+      label_marks_[label] = true;
+      fused_labels_.push_back(label);
+    }
+  }
+
+  /**
+   * Candidate of a frame. Prefixes already in the tree accumulate their scores in the tree entry, a new prefix gets a
+   * single extension in a frame, so it is staged with its final scores and inserted only if it survives.
+   */
+  struct Candidate {
+    // Tree entry of the prefix, kNoIndex for a staged prefix until it is inserted
+    IndexType index;
+    // Staged prefix: parent entry and the appended label
+    IndexType parent;
+    LabelType label;
+    // CTC score of the prefix, the label score of the staged prefix is final after Expand
+    float score;
+    // Unweighted LM score and the LM state of the staged prefix
+    float lm;
+    IndexType lm_state;
+    bool selected;
+  };
+
+  /**
+   * Adds the score to the next frame accumulators of the entry, the candidate is registered on the first touch
+   */
+  void Accumulate(IndexType index, float blank, float label) {
+    auto &entry = tree_.GetEntry(index);
+    if (entry.frame != frame_) {
+      entry.frame = frame_;
+      entry.next_blank = kLogZero;
+      entry.next_label = kLogZero;
+      candidates_.push_back({index, kNoIndex, kNoLabel, kLogZero, 0.0f, 0, false});
+    }
+    entry.next_blank = LogAddExp(entry.next_blank, blank);
+    entry.next_label = LogAddExp(entry.next_label, label);
+  }
+
+  /**
+   * Decodes a single frame
+   * @param labels non-blank labels to expand or nullptr to select top_k labels of the frame
+   * @param count number of labels
+   * @return number of expanded (hypothesis, label) pairs
+   */
+  IndexType ProcessFrame(const float *frame, IndexType beam_size, IndexType top_k, const LabelType *labels,
+                         size_t count, bool force_fast_path, ChunkStats *stats) {
+    if (!Expand(frame, top_k, labels, count, force_fast_path, nullptr, stats)) {
+      return static_cast<IndexType>(beams_.size());
+    }
+    return Select(beam_size);
+  }
+
+  /**
+   * Extends the hypotheses with the frame, the candidates are left for Select
+   * @param queries output LM queries of the created prefixes or nullptr to score them right away
+   * @return false if the frame took the blank fast path and is already decoded
+   */
+  bool Expand(const float *frame, IndexType top_k, const LabelType *labels, size_t count, bool force_fast_path,
+              std::vector<LMQuery> *queries, ChunkStats *stats) {
+    auto blank = options_.blank;
+    bool fast_path = frame[blank] > options_.blank_skip_threshold;
+    if (force_fast_path && !fast_path) {
+      fast_path = std::max_element(frame, frame + vocabulary_size_) == frame + blank;
+    }
+    if (fast_path) {
+      // Only blank and repeats, the set of hypotheses does not change
+      for (auto beam: beams_) {
+        auto &entry = tree_.GetEntry(beam);
+        auto last = tree_.GetLabel(beam);
+        auto label = last == kNoLabel ? kLogZero : entry.label + frame[last];
+        entry.blank = entry.GetScore() + frame[blank];
+        entry.label = label;
+      }
+      ++frame_;
+      return false;
+    }
+
+    if (labels == nullptr) {
+      SelectLabels(frame, top_k);
+      labels = labels_.data();
+      count = labels_.size();
+    }
+    candidates_.clear();
+    pending_stats_ = stats;
+    expanded_ = static_cast<IndexType>(beams_.size() * (count + 1));
+    // Hypotheses are registered first, so they take the first beams_.size() candidates and an existing child found
+    // below that is not one of them is an entry pruned in an earlier frame
+    for (auto beam: beams_) {
+      const auto &entry = tree_.GetEntry(beam);
+      auto last = tree_.GetLabel(beam);
+      Accumulate(beam, entry.GetScore() + frame[blank], last == kNoLabel ? kLogZero : entry.label + frame[last]);
+    }
+    for (auto beam: beams_) {
+      const auto &entry = tree_.GetEntry(beam);
+      auto score = entry.GetScore();
+      auto last = tree_.GetLabel(beam);
+      for (size_t i = 0; i < count; ++i) {
+        auto label = labels[i];
+        // Repeated label is only a new label after a blank
+        auto extension = (label == last ? entry.blank : score) + frame[label];
+        auto child = tree_.FindChild(beam, label);
+        if (child != kNoIndex) {
+          Accumulate(child, kLogZero, extension);
+          continue;
+        }
+        Candidate candidate{kNoIndex, beam, label, extension, 0.0f, 0, false};
+        if (queries != nullptr) {
+          queries->push_back({static_cast<IndexType>(candidates_.size()), entry.lm_state, label});
+        } else if (scorer_) {
+          candidate.lm = entry.lm + scorer_(entry.lm_state, label, &candidate.lm_state);
+        }
+        candidates_.push_back(candidate);
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Selects the survivors among the candidates of Expand: staged survivors are inserted into the tree, pruned
+   * entries of the tree are revived or deleted as needed
+   * @return number of expanded (hypothesis, label) pairs
+   */
+  IndexType Select(IndexType beam_size) {
+    auto best_score = kLogZero;
+    ranking_.clear();
+    for (IndexType position = 0; position < candidates_.size(); ++position) {
+      auto &candidate = candidates_[position];
+      float rank;
+      if (candidate.index != kNoIndex) {
+        auto &entry = tree_.GetEntry(candidate.index);
+        entry.blank = entry.next_blank;
+        entry.label = entry.next_label;
+        candidate.score = entry.GetScore();
+        rank = GetRankScore(candidate.index);
+      } else {
+        // Same as GetRankScore of the entry the candidate would become
+        rank = candidate.score + options_.lm_weight * candidate.lm +
+            options_.insertion_bonus * (tree_.GetDepth(candidate.parent) + 1);
+      }
+      best_score = std::max(best_score, rank);
+      ranking_.emplace_back(rank, position);
+    }
+    // Ties are broken by the registration order, which does not depend on the tree layout
+    auto better = [](const std::pair<float, IndexType> &lhs, const std::pair<float, IndexType> &rhs) {
+      return lhs.first > rhs.first || (lhs.first == rhs.first && lhs.second < rhs.second);
+    };
+    auto survivors = std::min<size_t>(beam_size, ranking_.size());
+    std::nth_element(ranking_.begin(), ranking_.begin() + survivors - 1, ranking_.end(), better);
+    std::sort(ranking_.begin(), ranking_.begin() + survivors, better);
+    auto pruned = [this, best_score](const std::pair<float, IndexType> &ranked) {
+      return candidates_[ranked.second].score == kLogZero || ranked.first < best_score - options_.beam_threshold;
+    };
+    while (survivors > 1 && pruned(ranking_[survivors - 1])) {
+      --survivors;
+    }
+
+    // Survivors are inserted before the pruned hypotheses are deleted, so their parents stay in the tree
+    next_beams_.clear();
+    bool created;
+    for (size_t i = 0; i < ranking_.size() && next_beams_.size() < survivors; ++i) {
+      if (i == survivors) {
+        // Staged survivors were dropped by the full tree, their places are taken by the next candidates
+        std::sort(ranking_.begin() + survivors, ranking_.end(), better);
+      }
+      if (i >= survivors && !next_beams_.empty() && pruned(ranking_[i])) {
+        break;
+      }
+      auto &candidate = candidates_[ranking_[i].second];
+      if (candidate.index == kNoIndex) {
+        candidate.index = tree_.ReserveChild(candidate.parent, candidate.label, &created);
+        if (candidate.index == kNoIndex) {
+          ++pending_stats_->dropped_candidates;
+          continue;
+        }
+        CTCBeamEntry entry;
+        entry.label = candidate.score;
+        entry.next_label = candidate.score;
+        entry.frame = frame_;
+        entry.lm = candidate.lm;
+        entry.lm_state = candidate.lm_state;
+        tree_.MaterializeEntry(candidate.index, entry);
+      } else if (ranking_[i].second >= beams_.size()) {
+        tree_.GetChild(tree_.GetParent(candidate.index), tree_.GetLabel(candidate.index), &created);
+      }
+      candidate.selected = true;
+      next_beams_.push_back(candidate.index);
+    }
+    for (IndexType position = 0; position < beams_.size(); ++position) {
+      if (!candidates_[position].selected) {
+        tree_.DeleteEntry(candidates_[position].index);
+      }
+    }
+    beams_.swap(next_beams_);
+    ++frame_;
+    return expanded_;
+  }
+
+  /**
+   * Non-blank labels among top_k most probable labels of the frame
+   */
+  void SelectLabels(const float *frame, IndexType top_k) {
+    labels_.clear();
+    if (top_k >= vocabulary_size_) {
+      for (LabelType label = 0; label < vocabulary_size_; ++label) {
+        if (label != options_.blank) {
+          labels_.push_back(label);
+        }
+      }
+      return;
+    }
+    order_.resize(vocabulary_size_);
+    for (LabelType label = 0; label < vocabulary_size_; ++label) {
+      order_[label] = label;
+    }
+    std::nth_element(order_.begin(), order_.begin() + top_k - 1, order_.end(),
+                     [frame](LabelType lhs, LabelType rhs) {
+                       return frame[lhs] > frame[rhs] || (frame[lhs] == frame[rhs] && lhs < rhs);
+                     });
+    for (IndexType i = 0; i < top_k; ++i) {
+      if (order_[i] != options_.blank) {
+        labels_.push_back(order_[i]);
+      }
+    }
+  }
+
+  LabelType vocabulary_size_;
+  CTCDecoderOptions options_;
+  CircularArrayCTCBeamSearchTree<CTCBeamEntry> tree_;
+  LabelScorer scorer_;
+  std::vector<IndexType> beams_;
+  // Number of frames decoded since the reset, used as the stamp of the accumulators
+  IndexType frame_ = 0;
+  // Number of expanded (hypothesis, label) pairs of the frame and the beam size of the pending SelectFrame
+  IndexType expanded_ = 0;
+  IndexType pending_beam_size_ = 0;
+  // Moving average of the frame time per expanded (hypothesis, label) pair, nanoseconds
+  double unit_cost_ = 0.0;
+  // Statistics of the chunk of the pending Select
+  ChunkStats *pending_stats_ = nullptr;
+  // Scratch buffers: candidates of the frame, their rank scores with the positions and the selected hypotheses
+  std::vector<Candidate> candidates_;
+  std::vector<std::pair<float, IndexType>> ranking_;
+  std::vector<IndexType> next_beams_;
+  std::vector<LabelType> labels_;
+  std::vector<LabelType> order_;
+  // Ensemble fusion: fused log-probabilities, valid only for the labels fused in the frame
+  std::vector<float> fused_;
+  std::vector<bool> label_marks_;
+  std::vector<LabelType> fused_labels_;
+};
+
+} // beam_search
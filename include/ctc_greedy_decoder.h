@@ -0,0 +1,89 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <stdexcept>
+#include <vector>
+
+#include "ctc_decoder.h"
+
+namespace beam_search {
+
+/**
+ * Greedy CTC decoding: the most probable label of every frame, repeats and blanks collapsed. Shares the interface
+ * with CTCPrefixBeamSearchDecoder but does not use the tree, the cost is a single vectorized pass over the posteriors.
+ * The score is the log-probability of the best alignment.
+ */
+class CTCGreedyDecoder {
+ public:
+  /**
+   * @param vocabulary_size number of labels in a frame, blank included
+   * @param options decoding options, only blank is used
+   */
+  CTCGreedyDecoder(LabelType vocabulary_size, const CTCDecoderOptions &options = CTCDecoderOptions())
+      : vocabulary_size_(vocabulary_size), options_(options) {
+    if (options.blank >= vocabulary_size) {
+      throw std::invalid_argument("Blank label is out of vocabulary");
+    }
+  }
+
+  /**
+   * Starts decoding of a new utterance
+   */
+  void Reset() {
+    labels_.clear();
+    last_ = options_.blank;
+    score_ = 0.0f;
+  }
+
+  /**
+   * Decodes a chunk of frames
+   * @param log_probs frames x vocabulary_size matrix of label log-probabilities stored row by row
+   * @param frames number of frames in the chunk
+   * @return statistics of the chunk
+   */
+  ChunkStats ProcessChunk(const float *log_probs, IndexType frames) {
+    for (IndexType t = 0; t < frames; ++t) {
+      const float *frame = log_probs + static_cast<size_t>(t) * vocabulary_size_;
+      auto label = ArgMax(frame, vocabulary_size_);
+      score_ += frame[label];
+      if (label != options_.blank && label != last_) {
+        labels_.push_back(label);
+      }
+      last_ = label;
+    }
+    ChunkStats stats;
+    stats.frames = frames;
+    stats.min_beam_size = 1;
+    stats.min_top_k = 1;
+    return stats;
+  }
+
+  /**
+   * Returns the hypothesis decoded so far
+   */
+  CTCHypothesis GetBest() const { return {labels_, score_}; }
+
+  /**
+   * Returns the only hypothesis if n is positive, the final scoring options are accepted for compatibility with
+   * CTCPrefixBeamSearchDecoder::GetNBest and ignored
+   */
+  std::vector<CTCHypothesis> GetNBest(IndexType n, const FinalScoringOptions & = FinalScoringOptions()) const {
+    if (n == 0) {
+      return {};
+    }
+    return {GetBest()};
+  }
+
+  const CTCDecoderOptions &GetOptions() const { return options_; }
+
+ private:
+  LabelType vocabulary_size_;
+  CTCDecoderOptions options_;
+  std::vector<LabelType> labels_;
+  // Label of the previous frame, blank at the start
+  LabelType last_ = options_.blank;
+  float score_ = 0.0f;
+};
+
+} // beam_search
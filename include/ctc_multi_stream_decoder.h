@@ -0,0 +1,207 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+#include "ctc_decoder.h"
+
+namespace beam_search {
+
+/**
+ * Frame synchronous decoding of chunks of independent decoders in two phases: all the decoders extend their hypotheses
+ * with a frame first, then the LM queries of the created prefixes of all the decoders are sorted by the LM state and
+ * answered once per distinct (state, label) pair, so the queries of the same LM context are adjacent and duplicates
+ * across decoders are scored once, finally every decoder selects its hypotheses. The decoders may differ in the
+ * vocabulary, the options and the chunk length, a decoder leaves the batch after the last frame of its chunk. The
+ * result of every decoder is the same as of its own ProcessChunk without the deadline mode.
+ */
+class CTCDecoderBatch {
+ public:
+  /**
+   * @param scorer label language model shared by the decoders, the own scorers of the decoders are used without it
+   */
+  explicit CTCDecoderBatch(const LabelScorer &scorer = LabelScorer()) : scorer_(scorer) {}
+
+  /**
+   * Decodes a chunk of every decoder
+   * @param decoders decoders of the batch
+   * @param log_probs pointers to frames[i] x vocabulary size matrices of label log-probabilities of the decoders
+   * @param frames chunk lengths of the decoders
+   * @param size number of decoders
+   * @param stats output statistics of the chunk for every decoder
+   */
+  void ProcessChunks(CTCPrefixBeamSearchDecoder *const *decoders, const float *const *log_probs,
+                     const IndexType *frames, size_t size, ChunkStats *stats) {
+    queries_.resize(size);
+    IndexType max_frames = 0;
+    for (size_t i = 0; i < size; ++i) {
+      const auto &options = decoders[i]->GetOptions();
+      auto vocabulary_size = decoders[i]->GetVocabularySize();
+      stats[i] = ChunkStats();
+      stats[i].frames = frames[i];
+      stats[i].min_beam_size = options.beam_size;
+      stats[i].min_top_k = options.top_k == 0 ? vocabulary_size : std::min<IndexType>(options.top_k, vocabulary_size);
+      max_frames = std::max(max_frames, frames[i]);
+    }
+    for (IndexType t = 0; t < max_frames; ++t) {
+      for (size_t i = 0; i < size; ++i) {
+        if (t < frames[i]) {
+          auto offset = static_cast<size_t>(t) * decoders[i]->GetVocabularySize();
+          queries_[i].clear();
+          decoders[i]->ExpandFrame(log_probs[i] + offset, scorer_ ? &queries_[i] : nullptr, &stats[i]);
+        }
+      }
+      if (scorer_) {
+        AnswerQueries(decoders, frames, size, t);
+      }
+      for (size_t i = 0; i < size; ++i) {
+        if (t < frames[i]) {
+          decoders[i]->SelectFrame();
+        }
+      }
+    }
+  }
+
+  /**
+   * Number of LM queries of the created prefixes and number of scorer calls since the construction
+   */
+  size_t GetLMQueries() const { return lm_queries_; }
+
+  size_t GetLMCalls() const { return lm_calls_; }
+
+ private:
+  /**
+   * Scores the LM queries of the decoders of frame t once per distinct (state, label) pair in the order of the states
+   */
+  void AnswerQueries(CTCPrefixBeamSearchDecoder *const *decoders, const IndexType *frames, size_t size, IndexType t) {
+    batch_.clear();
+    for (size_t i = 0; i < size; ++i) {
+      if (t >= frames[i]) {
+        continue;
+      }
+      for (IndexType query = 0; query < queries_[i].size(); ++query) {
+        batch_.emplace_back(queries_[i][query].state, queries_[i][query].label, static_cast<IndexType>(i), query);
+      }
+    }
+    std::sort(batch_.begin(), batch_.end());
+    lm_queries_ += batch_.size();
+    float score = 0.0f;
+    IndexType next_state = 0;
+    for (size_t j = 0; j < batch_.size(); ++j) {
+      IndexType state, i, query;
+      LabelType label;
+      std::tie(state, label, i, query) = batch_[j];
+      if (j == 0 || state != std::get<0>(batch_[j - 1]) || label != std::get<1>(batch_[j - 1])) {
+        score = scorer_(state, label, &next_state);
+        ++lm_calls_;
+      }
+      decoders[i]->SetLMScore(queries_[i][query], score, next_state);
+    }
+  }
+
+  LabelScorer scorer_;
+  // LM queries of the current frame by decoder
+  std::vector<std::vector<LMQuery>> queries_;
+  // LM state, label, decoder and the query index of the decoder
+  std::vector<std::tuple<IndexType, LabelType, IndexType, IndexType>> batch_;
+  size_t lm_queries_ = 0;
+  size_t lm_calls_ = 0;
+};
+
+/**
+ * Frame synchronous decoding of several streams (channels or speakers of a meeting) with shared static resources.
+ *
+ * Every stream has its own CTCPrefixBeamSearchDecoder and tree, the options and the label scorer (LM and whatever
+ * lexicon or biasing tables it uses) are shared read-only. The chunks of the streams are decoded together by
+ * CTCDecoderBatch, so the LM queries of all the streams are answered once per distinct (state, label) pair. The result
+ * of every stream is the same as of a separate decoder.
+ */
+class CTCMultiStreamDecoder {
+ public:
+  /**
+   * @param vocabulary_size number of labels in a frame, blank included
+   * @param options decoding options shared by the streams, the deadline mode is not supported
+   * @param streams number of streams
+   * @param scorer label language model shared by the streams
+   */
+  CTCMultiStreamDecoder(LabelType vocabulary_size, const CTCDecoderOptions &options, IndexType streams,
+                        const LabelScorer &scorer = LabelScorer())
+      : batch_(scorer), stats_(streams) {
+    if (streams == 0) {
+      throw std::invalid_argument("At least one stream is required");
+    }
+    if (options.deadline.chunk_budget.count() > 0) {
+      throw std::invalid_argument("Deadline mode is not supported by the multi-stream decoder");
+    }
+    decoders_.reserve(streams);
+    for (IndexType stream = 0; stream < streams; ++stream) {
+      decoders_.emplace_back(vocabulary_size, options);
+    }
+    for (auto &decoder: decoders_) {
+      pointers_.push_back(&decoder);
+    }
+  }
+
+  /**
+   * Starts decoding of a new utterance in the stream
+   */
+  void Reset(IndexType stream) { decoders_[stream].Reset(); }
+
+  /**
+   * Starts decoding of new utterances in all the streams
+   */
+  void Reset() {
+    for (auto &decoder: decoders_) {
+      decoder.Reset();
+    }
+  }
+
+  /**
+   * Decodes a chunk of frames of every stream
+   * @param log_probs pointers to frames x vocabulary_size matrices of label log-probabilities of the streams
+   * @param frames number of frames in the chunk
+   * @return statistics of the chunk for every stream
+   */
+  const std::vector<ChunkStats> &ProcessChunk(const float *const *log_probs, IndexType frames) {
+    frames_.assign(decoders_.size(), frames);
+    batch_.ProcessChunks(pointers_.data(), log_probs, frames_.data(), decoders_.size(), stats_.data());
+    return stats_;
+  }
+
+  /**
+   * Returns the best hypothesis of the stream
+   */
+  CTCHypothesis GetBest(IndexType stream) { return decoders_[stream].GetBest(); }
+
+  /**
+   * Returns up to n best hypotheses of the stream, see CTCPrefixBeamSearchDecoder::GetNBest
+   */
+  std::vector<CTCHypothesis> GetNBest(IndexType stream, IndexType n,
+                                      const FinalScoringOptions &options = FinalScoringOptions()) {
+    return decoders_[stream].GetNBest(n, options);
+  }
+
+  const CTCPrefixBeamSearchDecoder &GetDecoder(IndexType stream) const { return decoders_[stream]; }
+
+  IndexType GetStreams() const { return static_cast<IndexType>(decoders_.size()); }
+
+  /**
+   * Number of LM queries of the created prefixes and number of scorer calls since the construction
+   */
+  size_t GetLMQueries() const { return batch_.GetLMQueries(); }
+
+  size_t GetLMCalls() const { return batch_.GetLMCalls(); }
+
+ private:
+  CTCDecoderBatch batch_;
+  std::vector<CTCPrefixBeamSearchDecoder> decoders_;
+  std::vector<CTCPrefixBeamSearchDecoder *> pointers_;
+  std::vector<IndexType> frames_;
+  std::vector<ChunkStats> stats_;
+};
+
+} // beam_search
@@ -0,0 +1,214 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "beam_search_tree.h"
+#include "ctc_decoder.h"
+
+namespace beam_search {
+
+/**
+ * CTC prefix probability of a tree entry, i.e. the log-probability that the label sequence starts with the prefix
+ */
+struct CTCPrefixScore {
+  float score = kLogZero;
+};
+
+/**
+ * CTC prefix scorer for joint CTC/attention decoding. For a prefix g and a label c it computes the probability that
+ * the label sequence of the utterance starts with g + c, the attention decoder combines it with its own scores to
+ * rank the extensions.
+ *
+ * The scorer keeps the forward variables r_t^n(g) and r_t^b(g) (alignments of g ending in its last label and in blank
+ * at frame t) for every prefix in a CircularArrayCTCBeamSearchTree, the arrays are indexed by the tree slot, so they
+ * are allocated once and reused with the slots. A prefix requested again finds its forward variables in the tree.
+ *
+ * Scoring all the labels is O(T V) without transcendental functions in the inner loop: with phi_t = r_t^n(g) +
+ * r_t^b(g) in probability domain the score of g + c is sum_t phi_{t-1} p_t(c) (only r^b for c equal to the last
+ * label of g). Probability rows are stored scaled by their maximum m_t, the weights exp(phi_{t-1} + m_t - max) are
+ * computed once per prefix over all frames and the sum is a weighted accumulation of the scaled rows, vectorized
+ * across labels. The scaling keeps the accumulation in float range for arbitrarily small log-probabilities, labels
+ * whose sum still underflows are rescored in log domain. Forward variables of g + c are only computed by Extend, i.e.
+ * for the extensions the caller keeps.
+ */
+class CTCPrefixScorer {
+ public:
+  /**
+   * @param vocabulary_size number of labels in a frame, blank included
+   * @param blank blank label
+   * @param capacity maximum number of prefixes kept in the tree
+   */
+  CTCPrefixScorer(LabelType vocabulary_size, LabelType blank = 0, IndexType capacity = 1024)
+      : vocabulary_size_(vocabulary_size), blank_(blank), tree_(capacity) {
+    if (blank >= vocabulary_size) {
+      throw std::invalid_argument("Blank label is out of vocabulary");
+    }
+  }
+
+  /**
+   * Starts scoring of a new utterance
+   * @param log_probs frames x vocabulary_size matrix of label log-probabilities stored row by row
+   * @param frames number of frames
+   * @return tree index of the empty prefix
+   */
+  IndexType Reset(const float *log_probs, IndexType frames) {
+    frames_ = frames;
+    log_probs_.assign(log_probs, log_probs + static_cast<size_t>(frames) * vocabulary_size_);
+    probs_.resize(log_probs_.size());
+    row_max_.resize(frames);
+    for (IndexType t = 0; t < frames; ++t) {
+      const auto *row = &log_probs_[static_cast<size_t>(t) * vocabulary_size_];
+      row_max_[t] = *std::max_element(row, row + vocabulary_size_);
+      for (LabelType label = 0; label < vocabulary_size_; ++label) {
+        probs_[static_cast<size_t>(t) * vocabulary_size_ + label] =
+            row_max_[t] == kLogZero ? 0.0f : std::exp(row[label] - row_max_[t]);
+      }
+    }
+    // Two arrays of frames + 1 forward variables per slot, t = 0 stands for the moment before the first frame
+    forward_.assign(static_cast<size_t>(tree_.GetCapacity()) * 2 * (frames + 1), kLogZero);
+    auto root = tree_.Reset();
+    auto *label_forward = GetForward(root);
+    auto *blank_forward = label_forward + frames_ + 1;
+    blank_forward[0] = 0.0f;
+    for (IndexType t = 1; t <= frames_; ++t) {
+      blank_forward[t] = blank_forward[t - 1] + LogProb(t, blank_);
+    }
+    tree_.GetEntry(root).score = 0.0f;
+    return root;
+  }
+
+  /**
+   * Scores all one-label extensions of the prefix
+   * @param prefix tree index of the prefix
+   * @param scores output array of vocabulary_size scores: prefix probabilities of prefix + label, the blank position
+   * receives the probability of the whole label sequence being equal to the prefix
+   */
+  void ScoreExtensions(IndexType prefix, float *scores) {
+    const auto *label_forward = GetForward(prefix);
+    const auto *blank_forward = label_forward + frames_ + 1;
+    auto last = tree_.GetLabel(prefix);
+
+    // phi_{t-1} + m_t for t = 1..T and its maximum
+    weights_.resize(frames_);
+    auto max_weight = kLogZero;
+    for (IndexType t = 0; t < frames_; ++t) {
+      weights_[t] = LogAddExp(label_forward[t], blank_forward[t]) + row_max_[t];
+      max_weight = std::max(max_weight, weights_[t]);
+    }
+    sums_.assign(vocabulary_size_, 0.0f);
+    if (max_weight != kLogZero) {
+      for (IndexType t = 0; t < frames_; ++t) {
+        auto weight = std::exp(weights_[t] - max_weight);
+        if (weight == 0.0f) {
+          continue;
+        }
+        const auto *row = &probs_[static_cast<size_t>(t) * vocabulary_size_];
+        for (LabelType label = 0; label < vocabulary_size_; ++label) {
+          sums_[label] += weight * row[label];
+        }
+      }
+    }
+    for (LabelType label = 0; label < vocabulary_size_; ++label) {
+      if (max_weight == kLogZero) {
+        scores[label] = kLogZero;
+      } else if (sums_[label] >= std::numeric_limits<float>::min()) {
+        scores[label] = max_weight + std::log(sums_[label]);
+      } else {
+        // The label is far below the others in every frame where the prefix is likely, the scaled sum lost it
+        scores[label] = ScoreInLogDomain(label_forward, blank_forward, label);
+      }
+    }
+
+    // Repeated label is only a new label after blank, a single label is scored in log domain
+    if (last != kNoLabel && last != blank_) {
+      scores[last] = ScoreInLogDomain(nullptr, blank_forward, last);
+    }
+    scores[blank_] = LogAddExp(label_forward[frames_], blank_forward[frames_]);
+  }
+
+  /**
+   * Appends the label to the prefix computing the forward variables of the extension, O(T) for a new prefix and O(1)
+   * if the extension is already in the tree.
+   * @return tree index of the extension or kNoIndex if the tree capacity is reached
+   */
+  IndexType Extend(IndexType prefix, LabelType label) {
+    if (label == blank_) {
+      throw std::invalid_argument("Blank can not extend a prefix");
+    }
+    bool created;
+    auto child = tree_.GetChild(prefix, label, &created);
+    if (child == kNoIndex || !created) {
+      return child;
+    }
+    const auto *label_forward = GetForward(prefix);
+    const auto *blank_forward = label_forward + frames_ + 1;
+    auto *child_label_forward = GetForward(child);
+    auto *child_blank_forward = child_label_forward + frames_ + 1;
+    bool repeat = label == tree_.GetLabel(prefix);
+    auto score = kLogZero;
+    child_label_forward[0] = kLogZero;
+    child_blank_forward[0] = kLogZero;
+    for (IndexType t = 1; t <= frames_; ++t) {
+      auto phi = repeat ? blank_forward[t - 1] : LogAddExp(label_forward[t - 1], blank_forward[t - 1]);
+      child_label_forward[t] = LogAddExp(child_label_forward[t - 1], phi) + LogProb(t, label);
+      child_blank_forward[t] = LogAddExp(child_blank_forward[t - 1], child_label_forward[t - 1]) + LogProb(t, blank_);
+      score = LogAddExp(score, phi + LogProb(t, label));
+    }
+    tree_.GetEntry(child).score = score;
+    return child;
+  }
+
+  /**
+   * Tells that the prefix is no longer needed, its slot is reused once its descendants are also released
+   */
+  void Release(IndexType prefix) { tree_.DeleteEntry(prefix); }
+
+  /**
+   * Prefix probability of a prefix created by Extend
+   */
+  float GetPrefixScore(IndexType prefix) { return tree_.GetEntry(prefix).score; }
+
+  const CircularArrayCTCBeamSearchTree<CTCPrefixScore> &GetTree() const { return tree_; }
+
+ private:
+  float LogProb(IndexType t, LabelType label) const {
+    return log_probs_[static_cast<size_t>(t - 1) * vocabulary_size_ + label];
+  }
+
+  /**
+   * log sum_t exp(phi_{t-1} + log p_t(label)), phi is the sum of both forward variables or only the blank one if
+   * label_forward is null
+   */
+  float ScoreInLogDomain(const float *label_forward, const float *blank_forward, LabelType label) const {
+    auto score = kLogZero;
+    for (IndexType t = 1; t <= frames_; ++t) {
+      auto phi = label_forward ? LogAddExp(label_forward[t - 1], blank_forward[t - 1]) : blank_forward[t - 1];
+      score = LogAddExp(score, phi + LogProb(t, label));
+    }
+    return score;
+  }
+
+  float *GetForward(IndexType index) { return &forward_[static_cast<size_t>(index) * 2 * (frames_ + 1)]; }
+
+  LabelType vocabulary_size_;
+  LabelType blank_;
+  CircularArrayCTCBeamSearchTree<CTCPrefixScore> tree_;
+  IndexType frames_ = 0;
+  std::vector<float> log_probs_;
+  // Probabilities scaled by the row maximum row_max_ of the log-probabilities
+  std::vector<float> probs_;
+  std::vector<float> row_max_;
+  // Per-slot forward variables: frames + 1 values ending in a label followed by frames + 1 values ending in blank
+  std::vector<float> forward_;
+  // Scratch buffers of ScoreExtensions
+  std::vector<float> weights_;
+  std::vector<float> sums_;
+};
+
+} // beam_search
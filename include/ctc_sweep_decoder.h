@@ -0,0 +1,175 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "ctc_decoder.h"
+
+namespace beam_search {
+
+/**
+ * Parameters varied by the sweep
+ */
+struct SweepConfig {
+  float lm_weight = 0.0f;
+  float insertion_bonus = 0.0f;
+};
+
+/**
+ * Decodes the same posteriors with several LM weight and insertion bonus configurations in one pass, e.g. for tuning
+ * on a development set. Every configuration has its own CTCPrefixBeamSearchDecoder and tree, the label selection of
+ * every frame (top-k and the hybrid mode decisions) is computed once per chunk and shared by all of them, so the
+ * posteriors are scanned once. Configurations are decoded in parallel by a fixed number of threads, each thread
+ * takes every threads-th configuration and the whole chunk, so there is no synchronization within a chunk. The worker
+ * threads are started with the sweep and wait for the chunks, the calling thread decodes its share of every chunk.
+ */
+class CTCSweepDecoder {
+ public:
+  /**
+   * @param vocabulary_size number of labels in a frame, blank included
+   * @param options common decoding options, lm_weight and insertion_bonus are taken from the configurations and the
+   * deadline mode is not supported
+   * @param configs configurations to decode
+   * @param threads number of threads, configurations are decoded by the calling thread if it is 1
+   * @param scorer label language model shared by all the configurations, should be safe to call concurrently
+   */
+  CTCSweepDecoder(LabelType vocabulary_size, const CTCDecoderOptions &options, const std::vector<SweepConfig> &configs,
+                  IndexType threads = 1, const LabelScorer &scorer = LabelScorer()) {
+    if (configs.empty()) {
+      throw std::invalid_argument("At least one configuration is required");
+    }
+    if (options.deadline.chunk_budget.count() > 0) {
+      throw std::invalid_argument("Deadline mode is not supported by the sweep");
+    }
+    decoders_.reserve(configs.size());
+    for (const auto &config: configs) {
+      auto config_options = options;
+      config_options.lm_weight = config.lm_weight;
+      config_options.insertion_bonus = config.insertion_bonus;
+      decoders_.emplace_back(vocabulary_size, config_options);
+      decoders_.back().SetLabelScorer(scorer);
+    }
+    stats_.resize(configs.size());
+    workers_count_ = std::min<size_t>(std::max<IndexType>(threads, 1), decoders_.size());
+    workers_.reserve(workers_count_ - 1);
+    for (size_t worker = 1; worker < workers_count_; ++worker) {
+      workers_.emplace_back(&CTCSweepDecoder::WorkerLoop, this, worker);
+    }
+  }
+
+  CTCSweepDecoder(const CTCSweepDecoder &) = delete;
+  CTCSweepDecoder &operator=(const CTCSweepDecoder &) = delete;
+
+  ~CTCSweepDecoder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    chunk_ready_.notify_all();
+    for (auto &worker: workers_) {
+      worker.join();
+    }
+  }
+
+  /**
+   * Starts decoding of a new utterance by all the configurations
+   */
+  void Reset() {
+    for (auto &decoder: decoders_) {
+      decoder.Reset();
+    }
+  }
+
+  /**
+   * Decodes a chunk of frames by all the configurations
+   * @param log_probs frames x vocabulary_size matrix of label log-probabilities stored row by row
+   * @param frames number of frames in the chunk
+   * @return statistics of the chunk for every configuration
+   */
+  const std::vector<ChunkStats> &ProcessChunk(const float *log_probs, IndexType frames) {
+    decoders_[0].SelectChunk(log_probs, frames, &selection_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      chunk_log_probs_ = log_probs;
+      chunk_frames_ = frames;
+      pending_workers_ = workers_.size();
+      ++chunk_;
+    }
+    chunk_ready_.notify_all();
+    Decode(0);
+    std::unique_lock<std::mutex> lock(mutex_);
+    chunk_done_.wait(lock, [this] { return pending_workers_ == 0; });
+    return stats_;
+  }
+
+  /**
+   * Returns the best hypothesis of the configuration
+   */
+  CTCHypothesis GetBest(size_t config) { return decoders_[config].GetBest(); }
+
+  /**
+   * Returns up to n best hypotheses of the configuration, see CTCPrefixBeamSearchDecoder::GetNBest
+   */
+  std::vector<CTCHypothesis> GetNBest(size_t config, IndexType n,
+                                      const FinalScoringOptions &options = FinalScoringOptions()) {
+    return decoders_[config].GetNBest(n, options);
+  }
+
+  const CTCPrefixBeamSearchDecoder &GetDecoder(size_t config) const { return decoders_[config]; }
+
+  size_t GetConfigs() const { return decoders_.size(); }
+
+ private:
+  /**
+   * Decodes the current chunk by every workers_count_-th configuration starting from the first one
+   */
+  void Decode(size_t first) {
+    for (auto config = first; config < decoders_.size(); config += workers_count_) {
+      stats_[config] = decoders_[config].ProcessChunk(chunk_log_probs_, chunk_frames_, selection_);
+    }
+  }
+
+  void WorkerLoop(size_t first) {
+    size_t chunk = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        chunk_ready_.wait(lock, [this, chunk] { return stop_ || chunk_ != chunk; });
+        if (stop_) {
+          return;
+        }
+        chunk = chunk_;
+      }
+      Decode(first);
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (--pending_workers_ == 0) {
+        chunk_done_.notify_one();
+      }
+    }
+  }
+
+  std::vector<CTCPrefixBeamSearchDecoder> decoders_;
+  std::vector<ChunkStats> stats_;
+  ChunkSelection selection_;
+
+  // Worker pool, the calling thread is the worker 0
+  size_t workers_count_ = 1;
+  std::vector<std::thread> workers_;
+  std::mutex mutex_;
+  std::condition_variable chunk_ready_;
+  std::condition_variable chunk_done_;
+  // Number of chunks started, workers wait for it to change
+  size_t chunk_ = 0;
+  size_t pending_workers_ = 0;
+  bool stop_ = false;
+  const float *chunk_log_probs_ = nullptr;
+  IndexType chunk_frames_ = 0;
+};
+
+} // beam_search
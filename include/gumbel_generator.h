@@ -0,0 +1,98 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+namespace beam_search {
+
+/**
+ * Natural logarithm of a positive normal float with absolute error below 1e-7 near 1 and relative error below 1e-6
+ * elsewhere. Only integer and float arithmetic is used, so loops calling it are vectorized.
+ */
+inline float FastLog(float x) {
+  std::uint32_t bits;
+  std::memcpy(&bits, &x, sizeof(bits));
+  // x = m * 2^e with m in [sqrt(1/2), sqrt(2)), so that the values near 1 keep their relative precision
+  bits -= 0x3f3504f3u;
+  auto exponent = static_cast<float>(static_cast<std::int32_t>(bits) >> 23);
+  bits = (bits & 0x007fffffu) + 0x3f3504f3u;
+  float mantissa;
+  std::memcpy(&mantissa, &bits, sizeof(mantissa));
+  // log(m) = 2 atanh(t), |t| < 0.172
+  auto t = (mantissa - 1.0f) / (mantissa + 1.0f);
+  auto t2 = t * t;
+  auto series = 2.0f * t * (1.0f + t2 * (1.0f / 3.0f + t2 * (1.0f / 5.0f + t2 * (1.0f / 7.0f))));
+  return exponent * 0.69314718f + series;
+}
+
+/**
+ * Counter based generator of standard Gumbel noise -log(-log(U)). The i-th value of the stream is a hash of the seed
+ * and i, so a batch of values is computed by independent vector lanes without a sequential state update, and the
+ * stream is reproducible for a seed regardless of the batch sizes. The stream has 2^32 values per seed.
+ */
+class GumbelGenerator {
+ public:
+  explicit GumbelGenerator(std::uint32_t seed = 0) { Seed(seed); }
+
+  /**
+   * Restarts the stream of the seed
+   */
+  void Seed(std::uint32_t seed) {
+    key_ = Hash(seed ^ 0x9e3779b9u);
+    counter_ = 0;
+  }
+
+  /**
+   * Writes the next count values of the stream
+   * @param output array of size count
+   * @param count number of values
+   */
+  void Generate(float *output, size_t count) {
+    auto counter = counter_;
+    auto key = key_;
+    for (size_t i = 0; i < count; ++i) {
+      auto hash = Hash((counter + static_cast<std::uint32_t>(i)) * 0x9e3779b9u + key);
+      output[i] = ToGumbel(hash);
+    }
+    counter_ += static_cast<std::uint32_t>(count);
+  }
+
+  float Next() {
+    float result;
+    Generate(&result, 1);
+    return result;
+  }
+
+  /**
+   * Uniform value in (0, 1) from the upper 23 bits of the hash. Every value i + 0.5 with i < 2^23 is exact in float,
+   * so the result never rounds to 1.
+   */
+  static float ToUniform(std::uint32_t hash) {
+    return (static_cast<float>(hash >> 9) + 0.5f) * (1.0f / 8388608.0f);
+  }
+
+  /**
+   * Gumbel noise of the hash
+   */
+  static float ToGumbel(std::uint32_t hash) { return -FastLog(-FastLog(ToUniform(hash))); }
+
+ private:
+  /**
+   * Integer hash with good avalanche, lowbias32 by Chris Wellons
+   */
+  static std::uint32_t Hash(std::uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+  }
+
+  std::uint32_t key_;
+  std::uint32_t counter_;
+};
+
+} // beam_search
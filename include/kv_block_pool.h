@@ -0,0 +1,146 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+#include "beam_search_tree.h"
+
+namespace beam_search {
+
+/**
+ * Pool of fixed size KV-cache blocks with reference counting for prefix-shared caches of seq2seq/LLM hypotheses.
+ *
+ * A block stores block_size consecutive tokens of token_elements floats each (keys and values in the layout chosen by
+ * the model). Hypotheses sharing a prefix share the blocks of the prefix, a block is returned to the free list once
+ * the last reference is released. Blocks are appended in place while only one hypothesis writes to them, otherwise
+ * the written part is copied (copy-on-write), see AppendToken.
+ */
+class KVBlockPool {
+ public:
+  /**
+   * @param blocks number of blocks, all the memory is allocated at construction
+   * @param block_size number of tokens in a block
+   * @param token_elements number of floats stored per token
+   */
+  KVBlockPool(IndexType blocks, IndexType block_size, size_t token_elements)
+      : block_size_(block_size), token_elements_(token_elements), reference_counts_(blocks, 0), used_(blocks, 0),
+        data_(static_cast<size_t>(blocks) * block_size * token_elements) {
+    if (block_size == 0) {
+      throw std::invalid_argument("Block size should be positive");
+    }
+    free_.reserve(blocks);
+    for (IndexType block = blocks; block-- > 0;) {
+      free_.push_back(block);
+    }
+  }
+
+  /**
+   * Takes an empty block from the free list with a single reference
+   * @return block id or kNoIndex if the pool is exhausted
+   */
+  IndexType Allocate() {
+    if (free_.empty()) {
+      return kNoIndex;
+    }
+    auto block = free_.back();
+    free_.pop_back();
+    reference_counts_[block] = 1;
+    used_[block] = 0;
+    return block;
+  }
+
+  void AddReference(IndexType block) { ++reference_counts_[block]; }
+
+  /**
+   * Deletes a reference to the block, the block is freed with the last one
+   */
+  void Release(IndexType block) {
+    if (reference_counts_[block] == 0) {
+      throw std::runtime_error("Attempted release of a free block");
+    }
+    if (--reference_counts_[block] == 0) {
+      free_.push_back(block);
+    }
+  }
+
+  /**
+   * Releases the reference of a token written by AppendToken. If it is the last token written to the block, the
+   * position becomes free for in-place appends of its siblings.
+   */
+  void ReleaseToken(IndexType block, IndexType offset) {
+    if (used_[block] == offset + 1) {
+      --used_[block];
+    }
+    Release(block);
+  }
+
+  /**
+   * Gets a block and an offset to write the token at the given position of a hypothesis. The returned block holds a
+   * new reference for the caller.
+   * @param block block of the previous token of the hypothesis, ignored for the first token of a block
+   * @param position position of the token in the hypothesis
+   * @param offset output offset of the token in the returned block
+   * @return block id or kNoIndex if the pool is exhausted
+   */
+  IndexType AppendToken(IndexType block, IndexType position, IndexType *offset) {
+    *offset = position % block_size_;
+    if (*offset == 0) {
+      auto result = Allocate();
+      if (result != kNoIndex) {
+        used_[result] = 1;
+      }
+      return result;
+    }
+    if (used_[block] == *offset) {
+      // Nobody has written past the previous token, the block is appended in place
+      AddReference(block);
+      ++used_[block];
+      return block;
+    }
+    auto result = Allocate();
+    if (result == kNoIndex) {
+      return kNoIndex;
+    }
+    std::copy(GetData(block), GetData(block) + static_cast<size_t>(*offset) * token_elements_, GetData(result));
+    used_[result] = *offset + 1;
+    return result;
+  }
+
+  /**
+   * Returns the storage of the block, block_size x token_elements floats
+   */
+  float *GetData(IndexType block) { return &data_[static_cast<size_t>(block) * block_size_ * token_elements_]; }
+
+  const float *GetData(IndexType block) const {
+    return &data_[static_cast<size_t>(block) * block_size_ * token_elements_];
+  }
+
+  IndexType GetReferenceCount(IndexType block) const { return reference_counts_[block]; }
+
+  /**
+   * Number of tokens written to the block
+   */
+  IndexType GetUsed(IndexType block) const { return used_[block]; }
+
+  IndexType GetBlockSize() const { return block_size_; }
+
+  size_t GetTokenElements() const { return token_elements_; }
+
+  IndexType GetFreeBlocks() const { return static_cast<IndexType>(free_.size()); }
+
+  IndexType GetBlocks() const { return static_cast<IndexType>(reference_counts_.size()); }
+
+ private:
+  IndexType block_size_;
+  size_t token_elements_;
+  std::vector<CounterType> reference_counts_;
+  std::vector<IndexType> used_;
+  std::vector<IndexType> free_;
+  std::vector<float> data_;
+};
+
+} // beam_search
@@ -0,0 +1,447 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "beam_search_tree.h"
+
+namespace beam_search {
+
+/**
+ * Deterministic automaton over labels compiled from a regular expression, used to constrain beam search hypotheses.
+ *
+ * Supported syntax: symbols mapped to labels, "." for any label, classes "[0-9a]" and negated classes "[^ab]",
+ * groups "(...)", alternation "|", quantifiers "*", "+", "?", "{m}", "{m,}" and "{m,n}", "\" escapes a metacharacter.
+ *
+ * Transitions are stored in a flat array of size number of states times vocabulary size, so the check whether a label
+ * may be appended to a hypothesis is a single lookup. States that cannot reach an accepting state are removed, so
+ * kNoIndex is returned for any label after which the hypothesis can not be completed to a match.
+ */
+class LabelDFA {
+ public:
+  static constexpr IndexType kStart = 0;
+
+  /**
+   * Compiles the regular expression.
+   * @param pattern regular expression
+   * @param symbols mapping of pattern characters to labels
+   * @param vocabulary_size number of labels, labels are expected to be in [0, vocabulary_size)
+   */
+  LabelDFA(const std::string &pattern, const std::unordered_map<char, LabelType> &symbols, LabelType vocabulary_size)
+      : vocabulary_size_(vocabulary_size) {
+    for (const auto &symbol: symbols) {
+      if (symbol.second >= vocabulary_size) {
+        throw std::invalid_argument("Symbol label is out of vocabulary");
+      }
+    }
+    Parser parser(pattern, symbols, vocabulary_size);
+    auto fragment = parser.Parse();
+    Determinize(parser.nfa_, fragment);
+  }
+
+  /**
+   * Transition from the state by the label
+   * @return next state or kNoIndex if the label is not allowed
+   */
+  IndexType Next(IndexType state, LabelType label) const {
+    return transitions_[static_cast<size_t>(state) * vocabulary_size_ + label];
+  }
+
+  /**
+   * @return true if the label sequence leading to the state matches the pattern
+   */
+  bool IsAccepting(IndexType state) const { return accepting_[state]; }
+
+  IndexType GetNumStates() const { return static_cast<IndexType>(accepting_.size()); }
+
+  LabelType GetVocabularySize() const { return vocabulary_size_; }
+
+ private:
+  struct NFAState {
+    std::vector<IndexType> epsilon;
+    IndexType label_set = kNoIndex;
+    IndexType target = kNoIndex;
+  };
+
+  struct NFA {
+    std::vector<NFAState> states;
+    std::vector<std::vector<LabelType>> label_sets;
+
+    IndexType AddState() {
+      states.emplace_back();
+      return static_cast<IndexType>(states.size() - 1);
+    }
+  };
+
+  struct Fragment {
+    IndexType start;
+    IndexType end;
+  };
+
+  /**
+   * Recursive descent parser building Thompson NFA
+   */
+  class Parser {
+   public:
+    Parser(const std::string &pattern, const std::unordered_map<char, LabelType> &symbols, LabelType vocabulary_size)
+        : pattern_(pattern), symbols_(symbols), vocabulary_size_(vocabulary_size) {}
+
+    Fragment Parse() {
+      position_ = 0;
+      auto result = ParseAlternation();
+      if (position_ != pattern_.size()) {
+        Fail("unexpected ')'");
+      }
+      return result;
+    }
+
+    NFA nfa_;
+
+   private:
+    Fragment Epsilon() {
+      Fragment result{nfa_.AddState(), nfa_.AddState()};
+      nfa_.states[result.start].epsilon.push_back(result.end);
+      return result;
+    }
+
+    Fragment ParseAlternation() {
+      auto first = ParseConcatenation();
+      if (position_ == pattern_.size() || pattern_[position_] != '|') {
+        return first;
+      }
+      Fragment result{nfa_.AddState(), nfa_.AddState()};
+      auto add = [&](const Fragment &branch) {
+        nfa_.states[result.start].epsilon.push_back(branch.start);
+        nfa_.states[branch.end].epsilon.push_back(result.end);
+      };
+      add(first);
+      while (position_ < pattern_.size() && pattern_[position_] == '|') {
+        ++position_;
+        add(ParseConcatenation());
+      }
+      return result;
+    }
+
+    Fragment ParseConcatenation() {
+      auto result = Epsilon();
+      while (position_ < pattern_.size() && pattern_[position_] != '|' && pattern_[position_] != ')') {
+        auto next = ParseRepetition();
+        nfa_.states[result.end].epsilon.push_back(next.start);
+        result.end = next.end;
+      }
+      return result;
+    }
+
+    Fragment ParseRepetition() {
+      auto first_state = static_cast<IndexType>(nfa_.states.size());
+      auto result = ParseAtom();
+      while (position_ < pattern_.size()) {
+        IndexType min_count;
+        IndexType max_count;
+        auto quantifier = pattern_[position_];
+        if (quantifier == '*') {
+          min_count = 0;
+          max_count = kNoIndex;
+        } else if (quantifier == '+') {
+          min_count = 1;
+          max_count = kNoIndex;
+        } else if (quantifier == '?') {
+          min_count = 0;
+          max_count = 1;
+        } else if (quantifier == '{') {
+          ++position_;
+          min_count = ParseNumber();
+          max_count = min_count;
+          if (position_ < pattern_.size() && pattern_[position_] == ',') {
+            ++position_;
+            max_count = position_ < pattern_.size() && pattern_[position_] == '}' ? kNoIndex : ParseNumber();
+          }
+          if (position_ == pattern_.size() || pattern_[position_] != '}') {
+            Fail("expected '}'");
+          }
+          if (max_count < min_count) {
+            Fail("invalid repetition range");
+          }
+        } else {
+          break;
+        }
+        ++position_;
+        result = Repeat(result, first_state, min_count, max_count);
+      }
+      return result;
+    }
+
+    /**
+     * Builds min_count mandatory copies of the atom followed by either a loop or (max_count - min_count) optional
+     * copies. Parsing creates states sequentially, so the atom occupies the states from first_state to the end and
+     * has no outgoing edges yet, the copies are made by cloning this range.
+     */
+    Fragment Repeat(Fragment atom, IndexType first_state, IndexType min_count, IndexType max_count) {
+      auto num_copies = max_count == kNoIndex ? min_count + 1 : max_count;
+      auto last_state = static_cast<IndexType>(nfa_.states.size());
+      std::vector<Fragment> copies = {atom};
+      for (IndexType i = 1; i < num_copies; ++i) {
+        auto offset = static_cast<IndexType>(nfa_.states.size()) - first_state;
+        for (auto state = first_state; state < last_state; ++state) {
+          NFAState clone = nfa_.states[state];
+          for (auto &next: clone.epsilon) {
+            next += offset;
+          }
+          if (clone.target != kNoIndex) {
+            clone.target += offset;
+          }
+          nfa_.states.push_back(std::move(clone));
+        }
+        copies.push_back({atom.start + offset, atom.end + offset});
+      }
+
+      auto result = Epsilon();
+      auto append = [&](const Fragment &next) {
+        nfa_.states[result.end].epsilon.push_back(next.start);
+        result.end = next.end;
+      };
+      for (IndexType i = 0; i < min_count; ++i) {
+        append(copies[i]);
+      }
+      if (max_count == kNoIndex) {
+        auto loop = copies[min_count];
+        Fragment star{nfa_.AddState(), nfa_.AddState()};
+        nfa_.states[star.start].epsilon.push_back(loop.start);
+        nfa_.states[star.start].epsilon.push_back(star.end);
+        nfa_.states[loop.end].epsilon.push_back(loop.start);
+        nfa_.states[loop.end].epsilon.push_back(star.end);
+        append(star);
+      } else {
+        for (auto i = min_count; i < max_count; ++i) {
+          nfa_.states[copies[i].start].epsilon.push_back(copies[i].end);
+          append(copies[i]);
+        }
+      }
+      return result;
+    }
+
+    Fragment ParseAtom() {
+      if (position_ == pattern_.size()) {
+        Fail("unexpected end of pattern");
+      }
+      auto symbol = pattern_[position_++];
+      if (symbol == '(') {
+        auto result = ParseAlternation();
+        if (position_ == pattern_.size() || pattern_[position_] != ')') {
+          Fail("expected ')'");
+        }
+        ++position_;
+        return result;
+      }
+      std::vector<bool> labels(vocabulary_size_, false);
+      if (symbol == '.') {
+        labels.assign(vocabulary_size_, true);
+      } else if (symbol == '[') {
+        ParseClass(&labels);
+      } else if (symbol == '*' || symbol == '+' || symbol == '?' || symbol == '{') {
+        Fail("quantifier without an atom");
+      } else {
+        if (symbol == '\\') {
+          if (position_ == pattern_.size()) {
+            Fail("unexpected end of pattern");
+          }
+          symbol = pattern_[position_++];
+        }
+        labels[Lookup(symbol)] = true;
+      }
+      Fragment result{nfa_.AddState(), nfa_.AddState()};
+      nfa_.states[result.start].label_set = static_cast<IndexType>(nfa_.label_sets.size());
+      nfa_.states[result.start].target = result.end;
+      nfa_.label_sets.emplace_back();
+      for (LabelType label = 0; label < vocabulary_size_; ++label) {
+        if (labels[label]) {
+          nfa_.label_sets.back().push_back(label);
+        }
+      }
+      return result;
+    }
+
+    void ParseClass(std::vector<bool> *labels) {
+      bool negated = position_ < pattern_.size() && pattern_[position_] == '^';
+      if (negated) {
+        ++position_;
+      }
+      bool first = true;
+      while (position_ < pattern_.size() && (first || pattern_[position_] != ']')) {
+        first = false;
+        auto from = pattern_[position_++];
+        if (from == '\\' && position_ < pattern_.size()) {
+          from = pattern_[position_++];
+        }
+        if (position_ + 1 < pattern_.size() && pattern_[position_] == '-' && pattern_[position_ + 1] != ']') {
+          auto to = pattern_[position_ + 1];
+          position_ += 2;
+          if (to < from) {
+            Fail("invalid class range");
+          }
+          // Characters of the range that are not mapped to labels are skipped
+          for (int symbol = from; symbol <= to; ++symbol) {
+            auto found = symbols_.find(static_cast<char>(symbol));
+            if (found != symbols_.end()) {
+              (*labels)[found->second] = true;
+            }
+          }
+        } else {
+          (*labels)[Lookup(from)] = true;
+        }
+      }
+      if (position_ == pattern_.size()) {
+        Fail("expected ']'");
+      }
+      ++position_;
+      if (negated) {
+        labels->flip();
+      }
+    }
+
+    IndexType ParseNumber() {
+      if (position_ == pattern_.size() || pattern_[position_] < '0' || pattern_[position_] > '9') {
+        Fail("expected number");
+      }
+      IndexType result = 0;
+      while (position_ < pattern_.size() && pattern_[position_] >= '0' && pattern_[position_] <= '9') {
+        result = result * 10 + (pattern_[position_++] - '0');
+      }
+      return result;
+    }
+
+    LabelType Lookup(char symbol) {
+      auto found = symbols_.find(symbol);
+      if (found == symbols_.end()) {
+        Fail(std::string("unknown symbol '") + symbol + "'");
+      }
+      return found->second;
+    }
+
+    [[noreturn]] void Fail(const std::string &message) {
+      throw std::invalid_argument("Invalid pattern at position " + std::to_string(position_) + ": " + message);
+    }
+
+    const std::string &pattern_;
+    const std::unordered_map<char, LabelType> &symbols_;
+    LabelType vocabulary_size_;
+    size_t position_ = 0;
+  };
+
+  /**
+   * Subset construction followed by removal of the states that can not reach an accepting state
+   */
+  void Determinize(const NFA &nfa, const Fragment &fragment) {
+    std::vector<IndexType> stamp(nfa.states.size(), kNoIndex);
+    IndexType current_stamp = 0;
+    auto closure = [&](std::vector<IndexType> *states) {
+      ++current_stamp;
+      for (auto state: *states) {
+        stamp[state] = current_stamp;
+      }
+      for (size_t i = 0; i < states->size(); ++i) {
+        for (auto next: nfa.states[(*states)[i]].epsilon) {
+          if (stamp[next] != current_stamp) {
+            stamp[next] = current_stamp;
+            states->push_back(next);
+          }
+        }
+      }
+      std::sort(states->begin(), states->end());
+    };
+
+    std::map<std::vector<IndexType>, IndexType> ids;
+    std::vector<std::vector<IndexType>> subsets = {{fragment.start}};
+    closure(&subsets[0]);
+    ids.emplace(subsets[0], 0);
+    std::vector<IndexType> transitions;
+    std::vector<std::vector<IndexType>> buckets(vocabulary_size_);
+    std::vector<LabelType> used_labels;
+    for (IndexType subset = 0; subset < subsets.size(); ++subset) {
+      transitions.resize(transitions.size() + vocabulary_size_, kNoIndex);
+      for (auto state: subsets[subset]) {
+        if (nfa.states[state].label_set == kNoIndex) {
+          continue;
+        }
+        for (auto label: nfa.label_sets[nfa.states[state].label_set]) {
+          if (buckets[label].empty()) {
+            used_labels.push_back(label);
+          }
+          buckets[label].push_back(nfa.states[state].target);
+        }
+      }
+      for (auto label: used_labels) {
+        auto target = std::move(buckets[label]);
+        buckets[label].clear();
+        closure(&target);
+        auto inserted = ids.emplace(target, static_cast<IndexType>(subsets.size()));
+        if (inserted.second) {
+          subsets.push_back(std::move(target));
+        }
+        transitions[static_cast<size_t>(subset) * vocabulary_size_ + label] = inserted.first->second;
+      }
+      used_labels.clear();
+    }
+
+    // Reverse reachability from accepting states
+    auto num_states = static_cast<IndexType>(subsets.size());
+    std::vector<std::vector<IndexType>> reverse(num_states);
+    std::vector<bool> useful(num_states, false);
+    std::vector<IndexType> queue;
+    for (IndexType state = 0; state < num_states; ++state) {
+      for (LabelType label = 0; label < vocabulary_size_; ++label) {
+        auto target = transitions[static_cast<size_t>(state) * vocabulary_size_ + label];
+        if (target != kNoIndex) {
+          reverse[target].push_back(state);
+        }
+      }
+      if (std::binary_search(subsets[state].begin(), subsets[state].end(), fragment.end)) {
+        useful[state] = true;
+        queue.push_back(state);
+      }
+    }
+    for (size_t head = 0; head < queue.size(); ++head) {
+      for (auto previous: reverse[queue[head]]) {
+        if (!useful[previous]) {
+          useful[previous] = true;
+          queue.push_back(previous);
+        }
+      }
+    }
+
+    // Start state keeps index 0 even if the pattern matches nothing
+    std::vector<IndexType> new_index(num_states, kNoIndex);
+    IndexType size = 0;
+    for (IndexType state = 0; state < num_states; ++state) {
+      if (useful[state] || state == kStart) {
+        new_index[state] = size++;
+      }
+    }
+    transitions_.assign(static_cast<size_t>(size) * vocabulary_size_, kNoIndex);
+    accepting_.assign(size, false);
+    for (IndexType state = 0; state < num_states; ++state) {
+      if (new_index[state] == kNoIndex) {
+        continue;
+      }
+      accepting_[new_index[state]] = std::binary_search(subsets[state].begin(), subsets[state].end(), fragment.end);
+      for (LabelType label = 0; label < vocabulary_size_; ++label) {
+        auto target = transitions[static_cast<size_t>(state) * vocabulary_size_ + label];
+        if (target != kNoIndex && useful[target]) {
+          transitions_[static_cast<size_t>(new_index[state]) * vocabulary_size_ + label] = new_index[target];
+        }
+      }
+    }
+  }
+
+  LabelType vocabulary_size_;
+  std::vector<IndexType> transitions_;
+  std::vector<bool> accepting_;
+};
+
+} // beam_search
@@ -0,0 +1,452 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "beam_search_tree.h"
+
+namespace beam_search {
+
+using WordIndex = IndexType;
+const WordIndex kNoWord = std::numeric_limits<WordIndex>::max();
+const float kNoScore = -std::numeric_limits<float>::infinity();
+
+struct Bigram {
+  WordIndex history;
+  WordIndex word;
+  float score;
+};
+
+/**
+ * Lexicon prefix tree annotated with LM lookahead scores.
+ *
+ * Word LM scores only become available when the word is complete, the lookahead score of a lexicon node is the best
+ * score of any word reachable from it, so the decoder can apply the difference between child and parent lookahead
+ * scores as soon as a label is appended and correct it when the word ends.
+ *
+ * Nodes are stored in BFS order, so children of any node occupy a contiguous range of indices sorted by label and
+ * all the scores are kept in flat arrays. Bigram lookahead is sparse: for every history only nodes lying on the paths
+ * of explicit bigram successors are stored, the rest is covered by backoff weight plus unigram lookahead.
+ */
+class LexiconLookahead {
+ public:
+  static constexpr IndexType kRoot = 0;
+
+  /**
+   * Builds the lexicon tree.
+   * @param words label sequences of the words, i-th sequence corresponds to the word with index i
+   * @param unigram_scores log-scores of the words, the size should match the number of words
+   */
+  LexiconLookahead(const std::vector<std::vector<LabelType>> &words, const std::vector<float> &unigram_scores)
+      : unigram_scores_(unigram_scores) {
+    if (words.size() != unigram_scores.size()) {
+      throw std::invalid_argument("Number of words and unigram scores should match");
+    }
+    // Insertion into a temporary tree with unsorted children lists, flattened afterwards
+    std::vector<std::vector<std::pair<LabelType, IndexType>>> children(1);
+    std::vector<WordIndex> words_at(1, kNoWord);
+    word_nodes_.resize(words.size());
+    for (WordIndex word = 0; word < words.size(); ++word) {
+      IndexType node = kRoot;
+      for (auto label: words[word]) {
+        auto child = std::find_if(children[node].begin(), children[node].end(),
+                                  [label](const std::pair<LabelType, IndexType> &item) {
+                                    return item.first == label;
+                                  });
+        if (child != children[node].end()) {
+          node = child->second;
+          continue;
+        }
+        children[node].emplace_back(label, static_cast<IndexType>(children.size()));
+        node = static_cast<IndexType>(children.size());
+        children.emplace_back();
+        words_at.push_back(kNoWord);
+      }
+      // Homophones share the node, the best scoring one is kept
+      if (words_at[node] == kNoWord || unigram_scores[words_at[node]] < unigram_scores[word]) {
+        words_at[node] = word;
+      }
+      word_nodes_[word] = node;
+    }
+
+    // Flattening in BFS order
+    std::vector<IndexType> new_index(children.size());
+    std::vector<IndexType> queue = {kRoot};
+    new_index[kRoot] = kRoot;
+    labels_.push_back(kNoLabel);
+    parents_.push_back(kNoIndex);
+    for (IndexType head = 0; head < queue.size(); ++head) {
+      auto old_node = queue[head];
+      child_begin_.push_back(static_cast<IndexType>(queue.size()));
+      std::sort(children[old_node].begin(), children[old_node].end());
+      for (const auto &child: children[old_node]) {
+        new_index[child.second] = static_cast<IndexType>(queue.size());
+        queue.push_back(child.second);
+        labels_.push_back(child.first);
+        parents_.push_back(head);
+      }
+    }
+    child_begin_.push_back(static_cast<IndexType>(queue.size()));
+
+    words_.resize(queue.size(), kNoWord);
+    lookahead_.resize(queue.size(), kNoScore);
+    for (IndexType node = 0; node < queue.size(); ++node) {
+      words_[node] = words_at[queue[node]];
+      if (words_[node] != kNoWord) {
+        lookahead_[node] = unigram_scores_[words_[node]];
+      }
+    }
+    for (auto &node: word_nodes_) {
+      node = new_index[node];
+    }
+    // Children always follow parents in BFS order, so a single reverse pass propagates maximums
+    for (IndexType node = static_cast<IndexType>(queue.size()) - 1; node > kRoot; --node) {
+      lookahead_[parents_[node]] = std::max(lookahead_[parents_[node]], lookahead_[node]);
+    }
+    backoff_weights_.assign(words.size(), 0.0f);
+    bigram_begin_.assign(words.size() + 1, 0);
+    lookahead_begin_.assign(words.size() + 1, 0);
+  }
+
+  /**
+   * Sets bigram scores replacing the previous ones. Bigram lookahead tables are precomputed here.
+   * @param bigrams explicit bigram scores, duplicates are not allowed
+   * @param backoff_weights backoff weight for each history word, unigram score with backoff weight is used for the
+   * pairs not presented in bigrams
+   */
+  void SetBigrams(std::vector<Bigram> bigrams, const std::vector<float> &backoff_weights) {
+    if (backoff_weights.size() != unigram_scores_.size()) {
+      throw std::invalid_argument("Number of backoff weights and words should match");
+    }
+    for (const auto &bigram: bigrams) {
+      if (bigram.history >= unigram_scores_.size() || bigram.word >= unigram_scores_.size()) {
+        throw std::out_of_range("Bigram refers to unknown word");
+      }
+    }
+    backoff_weights_ = backoff_weights;
+    std::sort(bigrams.begin(), bigrams.end(), [](const Bigram &lhs, const Bigram &rhs) {
+      return std::make_pair(lhs.history, lhs.word) < std::make_pair(rhs.history, rhs.word);
+    });
+
+    bigram_begin_.assign(unigram_scores_.size() + 1, 0);
+    bigram_words_.clear();
+    bigram_scores_.clear();
+    lookahead_begin_.assign(unigram_scores_.size() + 1, 0);
+    lookahead_nodes_.clear();
+    lookahead_scores_.clear();
+
+    // Scratch per-node maximums with the list of touched nodes, reset after each history
+    std::vector<float> best(labels_.size(), kNoScore);
+    std::vector<IndexType> touched;
+    size_t position = 0;
+    for (WordIndex history = 0; history < unigram_scores_.size(); ++history) {
+      bigram_begin_[history] = static_cast<IndexType>(bigram_words_.size());
+      lookahead_begin_[history] = static_cast<IndexType>(lookahead_nodes_.size());
+      for (; position < bigrams.size() && bigrams[position].history == history; ++position) {
+        bigram_words_.push_back(bigrams[position].word);
+        bigram_scores_.push_back(bigrams[position].score);
+        for (auto node = word_nodes_[bigrams[position].word]; node != kNoIndex; node = parents_[node]) {
+          if (best[node] == kNoScore) {
+            touched.push_back(node);
+          } else if (best[node] >= bigrams[position].score) {
+            break;
+          }
+          best[node] = std::max(best[node], bigrams[position].score);
+        }
+      }
+      std::sort(touched.begin(), touched.end());
+      for (auto node: touched) {
+        lookahead_nodes_.push_back(node);
+        lookahead_scores_.push_back(best[node]);
+        best[node] = kNoScore;
+      }
+      touched.clear();
+    }
+    bigram_begin_.back() = static_cast<IndexType>(bigram_words_.size());
+    lookahead_begin_.back() = static_cast<IndexType>(lookahead_nodes_.size());
+  }
+
+  /**
+   * Finds the child of a lexicon node.
+   * @param node lexicon node
+   * @param label label of the child
+   * @return index of the child or kNoIndex if no word in lexicon continues the node with the label
+   */
+  IndexType GetChild(IndexType node, LabelType label) const {
+    auto begin = labels_.begin() + child_begin_[node];
+    auto end = labels_.begin() + child_begin_[node + 1];
+    auto child = std::lower_bound(begin, end, label);
+    if (child == end || *child != label) {
+      return kNoIndex;
+    }
+    return static_cast<IndexType>(child - labels_.begin());
+  }
+
+  /**
+   * Children of a node are the consecutive nodes starting from the first child, sorted by label
+   */
+  IndexType GetFirstChild(IndexType node) const { return child_begin_[node]; }
+
+  IndexType GetChildCount(IndexType node) const { return child_begin_[node + 1] - child_begin_[node]; }
+
+  /**
+   * Returns the word that ends in the node or kNoWord
+   */
+  WordIndex GetWord(IndexType node) const { return words_[node]; }
+
+  /**
+   * Best unigram score among the words reachable from the node
+   */
+  float GetLookahead(IndexType node) const { return lookahead_[node]; }
+
+  /**
+   * Best score among the words reachable from the node given the previous word
+   * @param node lexicon node
+   * @param history previous word, kNoWord for the unigram lookahead
+   */
+  float GetLookahead(IndexType node, WordIndex history) const {
+    if (history == kNoWord) {
+      return lookahead_[node];
+    }
+    auto result = backoff_weights_[history] + lookahead_[node];
+    auto begin = lookahead_nodes_.begin() + lookahead_begin_[history];
+    auto end = lookahead_nodes_.begin() + lookahead_begin_[history + 1];
+    auto found = std::lower_bound(begin, end, node);
+    if (found != end && *found == node) {
+      result = std::max(result, lookahead_scores_[found - lookahead_nodes_.begin()]);
+    }
+    return result;
+  }
+
+  /**
+   * Lookahead bonus for the transition from parent to child, i.e. the value to add to the hypothesis score when the
+   * label is appended. When the word ends the accumulated bonus should be replaced with the word score.
+   */
+  float GetLookaheadBonus(IndexType parent, IndexType child, WordIndex history = kNoWord) const {
+    return GetLookahead(child, history) - GetLookahead(parent, history);
+  }
+
+  /**
+   * Score of the word given the previous word, kNoWord history stands for unigram score
+   */
+  float GetWordScore(WordIndex history, WordIndex word) const {
+    if (history == kNoWord) {
+      return unigram_scores_[word];
+    }
+    auto begin = bigram_words_.begin() + bigram_begin_[history];
+    auto end = bigram_words_.begin() + bigram_begin_[history + 1];
+    auto found = std::lower_bound(begin, end, word);
+    if (found != end && *found == word) {
+      return bigram_scores_[found - bigram_words_.begin()];
+    }
+    return backoff_weights_[history] + unigram_scores_[word];
+  }
+
+  /**
+   * Number of nodes in the lexicon tree including the root
+   */
+  IndexType GetSize() const { return static_cast<IndexType>(labels_.size()); }
+
+ private:
+  // Per-node arrays in BFS order
+  std::vector<LabelType> labels_;
+  std::vector<IndexType> parents_;
+  std::vector<IndexType> child_begin_;
+  std::vector<WordIndex> words_;
+  std::vector<float> lookahead_;
+
+  // Per-word arrays
+  std::vector<IndexType> word_nodes_;
+  std::vector<float> unigram_scores_;
+  std::vector<float> backoff_weights_;
+
+  // Bigrams grouped by history, sorted by word
+  std::vector<IndexType> bigram_begin_;
+  std::vector<WordIndex> bigram_words_;
+  std::vector<float> bigram_scores_;
+
+  // Sparse bigram lookahead grouped by history, sorted by node
+  std::vector<IndexType> lookahead_begin_;
+  std::vector<IndexType> lookahead_nodes_;
+  std::vector<float> lookahead_scores_;
+};
+
+/**
+ * Label scorer of CTCPrefixBeamSearchDecoder (see LabelScorer) applying the lexicon lookahead: appending a label
+ * inside a word adds the lookahead bonus of the lexicon transition, the word boundary label replaces the bonuses
+ * accumulated over the word with the word LM score given the previous word. Prefixes leaving the lexicon get the
+ * out-of-lexicon score once per word.
+ *
+ * LM states are pairs (lexicon node, previous word) numbered on the first use, state 0 is the root without history.
+ * Every state caches its transitions (word boundary, lexicon children, leaving the lexicon) with their scores, so a
+ * transition is computed once. States are stored in segments that never move and the cached transitions are atomic,
+ * Score only takes the mutex when it numbers a new state, so the scorer can be shared by several decoders.
+ */
+class LexiconLookaheadScorer {
+ public:
+  /**
+   * @param lexicon lexicon with the LM scores, should outlive the scorer
+   * @param boundary label separating the words
+   * @param oov_score score of a word that is not in the lexicon
+   */
+  LexiconLookaheadScorer(const LexiconLookahead &lexicon, LabelType boundary, float oov_score)
+      : lexicon_(lexicon), boundary_(boundary), oov_score_(oov_score) {
+    GetState(LexiconLookahead::kRoot, kNoWord);
+  }
+
+  /**
+   * Score of the label after the state, see LabelScorer
+   */
+  float Score(IndexType state, LabelType label, IndexType *next_state) {
+    auto &current = GetStateEntry(state);
+    auto node = current.node;
+    if (label == boundary_ ? node == LexiconLookahead::kRoot : node == kNoIndex) {
+      *next_state = state;
+      return 0.0f;
+    }
+    IndexType child = kNoIndex;
+    IndexType slot = 0;
+    if (label != boundary_) {
+      child = lexicon_.GetChild(node, label);
+      slot = 1 + (child == kNoIndex ? lexicon_.GetChildCount(node) : child - lexicon_.GetFirstChild(node));
+    }
+    auto &transition = current.transitions[slot];
+    auto cached = transition.next_state.load(std::memory_order_acquire);
+    if (cached != kNoIndex) {
+      *next_state = cached;
+      return transition.score.load(std::memory_order_relaxed);
+    }
+    // Concurrent misses compute the same transition, either store is fine
+    auto score = ComputeTransition(node, current.history, label, child, next_state);
+    transition.score.store(score, std::memory_order_relaxed);
+    transition.next_state.store(*next_state, std::memory_order_release);
+    return score;
+  }
+
+  /**
+   * Scorer function to pass to CTCPrefixBeamSearchDecoder::SetLabelScorer, refers to this object
+   */
+  std::function<float(IndexType, LabelType, IndexType *)> GetScorer() {
+    return [this](IndexType state, LabelType label, IndexType *next_state) {
+      return Score(state, label, next_state);
+    };
+  }
+
+  /**
+   * Number of states numbered so far
+   */
+  IndexType GetStates() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return states_;
+  }
+
+ private:
+  struct Transition {
+    std::atomic<IndexType> next_state{kNoIndex};
+    std::atomic<float> score{0.0f};
+  };
+
+  struct State {
+    IndexType node = kNoIndex;
+    WordIndex history = kNoWord;
+    // Word boundary, the children of the node in order, leaving the lexicon
+    std::unique_ptr<Transition[]> transitions;
+  };
+
+  // Segment k holds kFirstSegmentSize * 2^k states, enough segments for any IndexType state
+  static constexpr IndexType kFirstSegmentSize = 256;
+  static constexpr size_t kSegments = 24;
+
+  /**
+   * Score and target state of a transition that is not cached yet, child is the lexicon child for the labels other
+   * than the boundary
+   */
+  float ComputeTransition(IndexType node, WordIndex history, LabelType label, IndexType child, IndexType *next_state) {
+    if (label == boundary_) {
+      auto word = node == kNoIndex ? kNoWord : lexicon_.GetWord(node);
+      *next_state = GetState(LexiconLookahead::kRoot, word);
+      if (word == kNoWord) {
+        // The out-of-lexicon score was applied when the prefix left the lexicon, an incomplete word gets it here
+        return node == kNoIndex ? 0.0f : oov_score_ - GetAccumulatedBonus(node, history);
+      }
+      return lexicon_.GetWordScore(history, word) - GetAccumulatedBonus(node, history);
+    }
+    *next_state = GetState(child, history);
+    if (child == kNoIndex) {
+      return oov_score_ - GetAccumulatedBonus(node, history);
+    }
+    return lexicon_.GetLookaheadBonus(node, child, history);
+  }
+
+  /**
+   * Sum of the lookahead bonuses from the word start to the node
+   */
+  float GetAccumulatedBonus(IndexType node, WordIndex history) const {
+    return lexicon_.GetLookahead(node, history) - lexicon_.GetLookahead(LexiconLookahead::kRoot, history);
+  }
+
+  /**
+   * State by its number, no locking: a number is only known after the state is published
+   */
+  State &GetStateEntry(IndexType state) {
+    size_t segment = 0;
+    uint64_t begin = 0;
+    uint64_t size = kFirstSegmentSize;
+    while (state - begin >= size) {
+      begin += size;
+      size *= 2;
+      ++segment;
+    }
+    return segments_[segment][state - begin];
+  }
+
+  /**
+   * Number of the (node, history) state, kNoIndex node stands for a prefix that left the lexicon
+   */
+  IndexType GetState(IndexType node, WordIndex history) {
+    auto key = static_cast<uint64_t>(node) << 32 | history;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto inserted = state_numbers_.emplace(key, states_);
+    if (!inserted.second) {
+      return inserted.first->second;
+    }
+    size_t segment = 0;
+    uint64_t begin = 0;
+    uint64_t size = kFirstSegmentSize;
+    while (states_ - begin >= size) {
+      begin += size;
+      size *= 2;
+      ++segment;
+    }
+    if (!segments_[segment]) {
+      segments_[segment].reset(new State[size]);
+    }
+    auto &state = segments_[segment][states_ - begin];
+    state.node = node;
+    state.history = history;
+    state.transitions.reset(new Transition[node == kNoIndex ? 1 : 2 + lexicon_.GetChildCount(node)]);
+    return states_++;
+  }
+
+  const LexiconLookahead &lexicon_;
+  LabelType boundary_;
+  float oov_score_;
+  // Guards the numbering and the allocation of the states, not their reads
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, IndexType> state_numbers_;
+  std::unique_ptr<State[]> segments_[kSegments];
+  IndexType states_ = 0;
+};
+
+} // beam_search
@@ -0,0 +1,189 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "beam_search_tree.h"
+#include "nbest.h"
+
+namespace beam_search {
+
+struct MBRResult {
+  // Position of the minimum risk hypothesis in the input list
+  size_t best;
+  // Expected edit distance of each hypothesis to the rest of the list
+  std::vector<float> risks;
+};
+
+/**
+ * Minimum Bayes risk selection over hypotheses stored in the tree, the risk of a hypothesis is its expected edit
+ * distance to the other hypotheses weighted by their posteriors.
+ *
+ * Hypotheses share prefixes in the tree, so edit distance DP rows are computed per tree entry rather than per
+ * hypothesis: the prefix up to the LCA of all hypotheses is common and does not affect distances, the entries below
+ * it are numbered so that parents precede children and for every reference hypothesis the rows are computed in one
+ * sweep, each row from the row of the parent entry.
+ *
+ * Each row is computed in two passes, the first one (substitution and deletion) has no dependency between cells and
+ * vectorizes, the second one propagates insertions. With non-zero band only cells within the band around the diagonal
+ * are computed, distances are exact up to band, larger ones are replaced with max(band + 1, length difference).
+ */
+class MinimumBayesRisk {
+ public:
+  /**
+   * @param band half-width of the DP band, 0 for the full DP
+   */
+  explicit MinimumBayesRisk(IndexType band = 0) : band_(band) {}
+
+  /**
+   * Selects the minimum risk hypothesis.
+   * @param tree tree containing the hypotheses
+   * @param hypotheses indices of the hypotheses in the tree
+   * @param posteriors posteriors of the hypotheses, parallel to hypotheses
+   */
+  template<class BeamEntry>
+  MBRResult Select(const CircularArrayCTCBeamSearchTree<BeamEntry> &tree, const std::vector<IndexType> &hypotheses,
+                   const std::vector<float> &posteriors) {
+    if (hypotheses.size() != posteriors.size()) {
+      throw std::invalid_argument("Number of hypotheses and posteriors should match");
+    }
+    MBRResult result{0, std::vector<float>(hypotheses.size(), 0.0f)};
+    if (hypotheses.empty()) {
+      return result;
+    }
+    BuildSuffixTree(tree, hypotheses);
+
+    for (size_t reference = 0; reference < hypotheses.size(); ++reference) {
+      if (posteriors[reference] == 0.0f) {
+        continue;
+      }
+      ComputeRows(reference);
+      auto width = references_[reference].size() + 1;
+      for (size_t hypothesis = 0; hypothesis < hypotheses.size(); ++hypothesis) {
+        auto distance = rows_[ends_[hypothesis] * width + width - 1];
+        if (distance >= kInfinity) {
+          auto length_difference = std::abs(static_cast<int64_t>(node_depths_[ends_[hypothesis]]) -
+                                            static_cast<int64_t>(references_[reference].size()));
+          distance = static_cast<int32_t>(std::max<int64_t>(band_ + 1, length_difference));
+        }
+        result.risks[hypothesis] += posteriors[reference] * static_cast<float>(distance);
+      }
+    }
+    result.best = static_cast<size_t>(std::min_element(result.risks.begin(), result.risks.end()) -
+                                      result.risks.begin());
+    return result;
+  }
+
+  /**
+   * Selects the minimum risk hypothesis of the n-best list using its posteriors
+   */
+  template<class BeamEntry>
+  MBRResult Select(const CircularArrayCTCBeamSearchTree<BeamEntry> &tree, const std::vector<NBestEntry> &nbest) {
+    std::vector<IndexType> hypotheses;
+    std::vector<float> posteriors;
+    for (const auto &entry: nbest) {
+      hypotheses.push_back(entry.index);
+      posteriors.push_back(entry.posterior);
+    }
+    return Select(tree, hypotheses, posteriors);
+  }
+
+ private:
+  static constexpr int32_t kInfinity = std::numeric_limits<int32_t>::max() / 2;
+
+  /**
+   * Numbers the entries below the LCA of the hypotheses, local node 0 is the LCA itself
+   */
+  template<class BeamEntry>
+  void BuildSuffixTree(const CircularArrayCTCBeamSearchTree<BeamEntry> &tree,
+                       const std::vector<IndexType> &hypotheses) {
+    auto lca = hypotheses[0];
+    for (auto hypothesis: hypotheses) {
+      lca = tree.GetLCA(lca, hypothesis);
+    }
+    auto lca_depth = tree.GetDepth(lca);
+
+    local_index_.clear();
+    local_index_.emplace(lca, 0);
+    node_parents_.assign(1, 0);
+    node_labels_.assign(1, kNoLabel);
+    node_depths_.assign(1, 0);
+    ends_.clear();
+    references_.clear();
+    std::vector<IndexType> path;
+    for (auto hypothesis: hypotheses) {
+      path.clear();
+      for (auto index = hypothesis; index != lca; index = tree.GetParent(index)) {
+        path.push_back(index);
+      }
+      references_.emplace_back();
+      IndexType parent = 0;
+      for (auto index = path.rbegin(); index != path.rend(); ++index) {
+        references_.back().push_back(tree.GetLabel(*index));
+        auto inserted = local_index_.emplace(*index, static_cast<IndexType>(node_parents_.size()));
+        if (inserted.second) {
+          node_parents_.push_back(parent);
+          node_labels_.push_back(tree.GetLabel(*index));
+          node_depths_.push_back(tree.GetDepth(*index) - lca_depth);
+        }
+        parent = inserted.first->second;
+      }
+      ends_.push_back(parent);
+    }
+  }
+
+  /**
+   * Edit distance rows of all local nodes against the reference suffix
+   */
+  void ComputeRows(size_t reference) {
+    const auto &labels = references_[reference];
+    auto length = static_cast<int64_t>(labels.size());
+    auto width = static_cast<size_t>(length + 1);
+    rows_.assign(node_parents_.size() * width, kInfinity);
+    auto band = band_ == 0 ? std::numeric_limits<int64_t>::max() / 4 : static_cast<int64_t>(band_);
+    for (int64_t k = 0; k <= std::min(length, band); ++k) {
+      rows_[k] = static_cast<int32_t>(k);
+    }
+    for (size_t node = 1; node < node_parents_.size(); ++node) {
+      const auto *previous = &rows_[node_parents_[node] * width];
+      auto *current = &rows_[node * width];
+      auto depth = static_cast<int64_t>(node_depths_[node]);
+      auto low = std::max<int64_t>(0, depth - band);
+      auto high = std::min(length, depth + band);
+      if (low > high) {
+        continue;
+      }
+      auto label = node_labels_[node];
+      if (low == 0) {
+        current[0] = previous[0] + 1;
+        low = 1;
+      }
+      for (auto k = low; k <= high; ++k) {
+        current[k] = std::min(previous[k] + 1, previous[k - 1] + static_cast<int32_t>(labels[k - 1] != label));
+      }
+      for (auto k = std::max<int64_t>(low, 1); k <= high; ++k) {
+        current[k] = std::min(current[k], current[k - 1] + 1);
+      }
+    }
+  }
+
+  IndexType band_;
+  // Local numbering of the entries below the LCA, parents precede children
+  std::unordered_map<IndexType, IndexType> local_index_;
+  std::vector<IndexType> node_parents_;
+  std::vector<LabelType> node_labels_;
+  std::vector<IndexType> node_depths_;
+  // Local node and label suffix of every hypothesis
+  std::vector<IndexType> ends_;
+  std::vector<std::vector<LabelType>> references_;
+  std::vector<int32_t> rows_;
+};
+
+} // beam_search
@@ -0,0 +1,95 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "beam_search_tree.h"
+
+namespace beam_search {
+
+struct FinalScoringOptions {
+  // Scores are divided by length^length_penalty, 0 disables normalization
+  float length_penalty = 0.0f;
+  // Temperature of the softmax producing n-best posteriors from normalized scores
+  float temperature = 1.0f;
+};
+
+struct NBestEntry {
+  IndexType index;
+  // Length normalized score
+  float score;
+  // Posterior of the hypothesis within the n-best list
+  float posterior;
+};
+
+/**
+ * Length normalized final score of a hypothesis
+ * @param score accumulated score of the hypothesis
+ * @param length hypothesis length, empty hypotheses are treated as length 1
+ * @param length_penalty normalization power
+ */
+inline float LengthNormalizedScore(float score, IndexType length, float length_penalty) {
+  if (length_penalty == 0.0f) {
+    return score;
+  }
+  return score / std::pow(static_cast<float>(std::max<IndexType>(length, 1)), length_penalty);
+}
+
+/**
+ * Selects n best hypotheses by length normalized score. Lengths are taken from entry depths, so no backtraces are
+ * performed, selection is done with a bounded heap in O(B log n).
+ * @param tree tree containing the hypotheses
+ * @param beams indices of the final hypotheses
+ * @param scores accumulated scores of the hypotheses, parallel to beams
+ * @param n maximum number of hypotheses to return
+ * @param options normalization options
+ * @return hypotheses sorted by normalized score in descending order
+ */
+template<class BeamEntry>
+std::vector<NBestEntry> SelectNBest(const CircularArrayCTCBeamSearchTree<BeamEntry> &tree,
+                                    const std::vector<IndexType> &beams, const std::vector<float> &scores,
+                                    IndexType n, const FinalScoringOptions &options = FinalScoringOptions()) {
+  if (beams.size() != scores.size()) {
+    throw std::invalid_argument("Number of beams and scores should match");
+  }
+  if (options.temperature <= 0.0f) {
+    throw std::invalid_argument("Temperature should be positive");
+  }
+  // Heap ordered by "better" keeps the worst selected hypothesis on top, ties are resolved by index
+  auto better = [](const NBestEntry &lhs, const NBestEntry &rhs) {
+    return lhs.score > rhs.score || (lhs.score == rhs.score && lhs.index < rhs.index);
+  };
+  std::vector<NBestEntry> heap;
+  heap.reserve(std::min<size_t>(n, beams.size()) + 1);
+  for (size_t i = 0; i < beams.size(); ++i) {
+    NBestEntry candidate{beams[i], LengthNormalizedScore(scores[i], tree.GetDepth(beams[i]), options.length_penalty),
+                         0.0f};
+    if (heap.size() < n) {
+      heap.push_back(candidate);
+      std::push_heap(heap.begin(), heap.end(), better);
+    } else if (n > 0 && better(candidate, heap.front())) {
+      std::pop_heap(heap.begin(), heap.end(), better);
+      heap.back() = candidate;
+      std::push_heap(heap.begin(), heap.end(), better);
+    }
+  }
+  std::sort_heap(heap.begin(), heap.end(), better);
+
+  if (!heap.empty()) {
+    float normalizer = 0.0f;
+    for (auto &entry: heap) {
+      entry.posterior = std::exp((entry.score - heap.front().score) / options.temperature);
+      normalizer += entry.posterior;
+    }
+    for (auto &entry: heap) {
+      entry.posterior /= normalizer;
+    }
+  }
+  return heap;
+}
+
+} // beam_search
@@ -0,0 +1,413 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <tuple>
+#include <vector>
+
+#include "beam_search_tree.h"
+#include "gumbel_generator.h"
+#include "kv_block_pool.h"
+
+namespace beam_search {
+
+struct TokenBeamSearchOptions {
+  IndexType beam_size = 4;
+  // Candidates taken from every hypothesis, 0 for the whole vocabulary
+  IndexType top_k = 0;
+  // End of sequence token, kNoLabel if hypotheses only end by max_length
+  LabelType eos = kNoLabel;
+  IndexType max_length = 256;
+  IndexType tree_capacity = 4096;
+  // Diverse beam search: hypotheses are split into groups, a group is penalized by diversity_penalty for every
+  // hypothesis of the previous groups that has selected the same token at the step (Hamming diversity). Unlike the
+  // standard diverse beam search, at the first step all groups expand the shared root and a group never repeats the
+  // tokens of the previous groups there, even with zero penalty, otherwise the groups would start as duplicates
+  IndexType groups = 1;
+  float diversity_penalty = 0.0f;
+  // Stochastic beam search: hypotheses are selected by Gumbel perturbed scores, the finished hypotheses are beam_size
+  // samples without replacement, not compatible with groups
+  bool stochastic = false;
+  std::uint32_t seed = 0;
+};
+
+/**
+ * Token of a hypothesis with its accumulated score and the place of its KV-cache in the block pool
+ */
+struct TokenBeamEntry {
+  float score = 0.0f;
+  // Gumbel perturbed score of the stochastic search
+  float perturbed_score = 0.0f;
+  IndexType block = kNoIndex;
+  IndexType offset = 0;
+};
+
+struct TokenHypothesis {
+  std::vector<LabelType> tokens;
+  float score;
+  IndexType group = 0;
+  float perturbed_score = 0.0f;
+};
+
+/**
+ * Beam search for seq2seq/LLM models with paged, prefix-shared KV-cache.
+ *
+ * Every tree entry references the KV-cache block holding its token, the entry owns one reference to the block.
+ * A hypothesis continues the block of its parent in place unless a sibling has already written there, in which case
+ * the written part is copied, full blocks are never copied. Blocks of an entry are released from the DeleteEntry
+ * cascade through the tree entry callback, so a prefix shared by several hypotheses keeps a single copy of its cache
+ * for exactly as long as some hypothesis continues it. Blocks of the detached shared prefix are kept until Reset.
+ *
+ * Usage: every step the model computes next token log-probabilities of GetBeams() using their block tables, Step
+ * selects the new hypotheses and the model writes the KV-cache of their last tokens to GetTokenData.
+ *
+ * With several groups the search is the diverse beam search: all groups share the tree and the pool, beams of a
+ * group are stored contiguously in GetBeams() and the groups select their hypotheses one after another. Penalties
+ * only need the tokens selected by the previous groups at the same step, they are counted in a vocabulary array
+ * touched only at the selected tokens, so the overhead is O(beam_size) per step. Scores of the hypotheses are not
+ * penalized, the penalty only affects the selection. The first step deviates from the standard algorithm: the groups
+ * share the root, so the tokens selected by the previous groups are excluded rather than penalized.
+ *
+ * Stochastic mode is the stochastic beam search (Gumbel-top-k): a token gets the score of the hypothesis plus Gumbel
+ * noise conditioned on the maximum over its siblings being the perturbed score of the parent, and the beam keeps the
+ * largest perturbed scores together with the finished hypotheses. The finished hypotheses are then beam_size
+ * sequences sampled without replacement from the model in a single search, ordered by their perturbed scores (the
+ * threshold of the importance weights is the smallest of them). With top_k the sampling is restricted to the top-k
+ * tokens of every step. The noise stream of the seed continues across Reset.
+ */
+class TokenBeamSearch {
+ public:
+  /**
+   * @param pool pool of KV-cache blocks, can be shared by several searches
+   * @param vocabulary_size number of tokens
+   * @param options search options
+   */
+  TokenBeamSearch(KVBlockPool *pool, LabelType vocabulary_size,
+                  const TokenBeamSearchOptions &options = TokenBeamSearchOptions())
+      : pool_(pool), vocabulary_size_(vocabulary_size), options_(options), tree_(options.tree_capacity) {
+    if (options.beam_size == 0) {
+      throw std::invalid_argument("Beam size should be positive");
+    }
+    if (options.groups == 0 || options.groups > options.beam_size) {
+      throw std::invalid_argument("Number of groups should be between 1 and beam size");
+    }
+    if (options.stochastic && options.groups > 1) {
+      throw std::invalid_argument("Stochastic beam search does not support groups");
+    }
+    token_counts_.assign(vocabulary_size, 0);
+    generator_.Seed(options.seed);
+    tree_.SetEntryCallback([this](EntryEvent event, IndexType, TokenBeamEntry &entry) {
+      if (event == EntryEvent::kDetached) {
+        // The reference moves to the prefix table indexed by depth
+        prefix_blocks_.push_back(entry.block);
+      } else if (entry.block != kNoIndex) {
+        pool_->ReleaseToken(entry.block, entry.offset);
+      }
+      entry.block = kNoIndex;
+    });
+    ResetBeams();
+  }
+
+  TokenBeamSearch(const TokenBeamSearch &) = delete;
+  TokenBeamSearch &operator=(const TokenBeamSearch &) = delete;
+
+  ~TokenBeamSearch() { ReleaseAll(); }
+
+  /**
+   * Starts a new search releasing all the blocks of the previous one
+   */
+  void Reset() {
+    ReleaseAll();
+    ResetBeams();
+    finished_.clear();
+  }
+
+  /**
+   * Tree entries of the active hypotheses, the first step starts from the root with no tokens
+   */
+  const std::vector<IndexType> &GetBeams() const { return beams_; }
+
+  /**
+   * Beams of the group are GetBeams()[GetGroupBegin(group), GetGroupBegin(group + 1)), before the first step all
+   * the groups start from the root stored in the group 0
+   */
+  IndexType GetGroupBegin(IndexType group) const { return group_begins_[group]; }
+
+  /**
+   * Blocks holding the KV-cache of the hypothesis tokens, token at position p is at offset p % block_size of the
+   * block p / block_size. Entries of block boundaries are found with GetAncestor, the detached ones in the prefix
+   * table.
+   * @param beam tree entry of the hypothesis
+   * @param table output block table
+   */
+  void GetBlockTable(IndexType beam, std::vector<IndexType> *table) const {
+    auto depth = tree_.GetDepth(beam);
+    auto block_size = pool_->GetBlockSize();
+    table->resize((depth + block_size - 1) / block_size);
+    for (IndexType block = static_cast<IndexType>(table->size()); block-- > 0;) {
+      auto last_depth = std::min((block + 1) * block_size, depth);
+      auto index = tree_.GetAncestor(beam, last_depth);
+      (*table)[block] = index == kNoIndex ? prefix_blocks_[last_depth] : tree_.GetEntry(index).block;
+      if (index != kNoIndex) {
+        beam = index;
+      }
+    }
+  }
+
+  /**
+   * Storage for the KV-cache of the last token of the hypothesis, pool token_elements floats
+   */
+  float *GetTokenData(IndexType beam) {
+    const auto &entry = tree_.GetEntry(beam);
+    return pool_->GetData(entry.block) + static_cast<size_t>(entry.offset) * pool_->GetTokenElements();
+  }
+
+  /**
+   * Returns the tokens of the hypothesis
+   */
+  std::vector<LabelType> GetTokens(IndexType beam) { return tree_.BacktraceString(beam); }
+
+  float GetScore(IndexType beam) { return tree_.GetEntry(beam).score; }
+
+  /**
+   * Performs a step of the search
+   * @param log_probs GetBeams().size() x vocabulary_size matrix of next token log-probabilities stored row by row
+   * @return number of active hypotheses after the step
+   */
+  IndexType Step(const float *log_probs) {
+    // The first step expands the root once for every group
+    bool shared_root = beams_.size() == 1 && tree_.GetDepth(beams_[0]) == 0;
+    next_beams_.clear();
+    next_group_begins_.resize(options_.groups + 1);
+    for (IndexType group = 0; group < options_.groups; ++group) {
+      next_group_begins_[group] = static_cast<IndexType>(next_beams_.size());
+      if (shared_root) {
+        CollectCandidates(log_probs, 0, 1, true);
+      } else {
+        CollectCandidates(log_probs, group_begins_[group], group_begins_[group + 1], false);
+      }
+      SelectGroup(group);
+    }
+    next_group_begins_[options_.groups] = static_cast<IndexType>(next_beams_.size());
+    for (auto token: selected_tokens_) {
+      token_counts_[token] = 0;
+    }
+    selected_tokens_.clear();
+    for (auto beam: beams_) {
+      tree_.DeleteEntry(beam);
+    }
+    beams_.swap(next_beams_);
+    group_begins_.swap(next_group_begins_);
+
+    if (!beams_.empty() && tree_.GetDepth(beams_[0]) >= options_.max_length) {
+      for (IndexType group = 0; group < options_.groups; ++group) {
+        for (auto i = group_begins_[group]; i < group_begins_[group + 1]; ++i) {
+          const auto &entry = tree_.GetEntry(beams_[i]);
+          finished_.push_back({tree_.BacktraceString(beams_[i]), entry.score, group, entry.perturbed_score});
+          tree_.DeleteEntry(beams_[i]);
+        }
+      }
+      beams_.clear();
+      group_begins_.assign(options_.groups + 1, 0);
+    }
+    if (options_.stochastic) {
+      std::sort(finished_.begin(), finished_.end(), [](const TokenHypothesis &lhs, const TokenHypothesis &rhs) {
+        return lhs.perturbed_score > rhs.perturbed_score;
+      });
+    }
+    return static_cast<IndexType>(beams_.size());
+  }
+
+  bool IsFinished() const { return beams_.empty(); }
+
+  /**
+   * Hypotheses ended with eos or by max_length in the order of completion, the samples of the stochastic search are
+   * ordered by their perturbed scores
+   */
+  const std::vector<TokenHypothesis> &GetFinished() const { return finished_; }
+
+  const CircularArrayCTCBeamSearchTree<TokenBeamEntry> &GetTree() const { return tree_; }
+
+ private:
+  // Selection score, parent, token, the score and the perturbed score of the hypothesis
+  using Candidate = std::tuple<float, IndexType, LabelType, float, float>;
+
+  static constexpr float kNegativeInfinity = -std::numeric_limits<float>::infinity();
+
+  static bool Better(const Candidate &lhs, const Candidate &rhs) {
+    return std::get<0>(lhs) > std::get<0>(rhs) ||
+        (std::get<0>(lhs) == std::get<0>(rhs) && std::make_pair(std::get<1>(lhs), std::get<2>(lhs)) <
+            std::make_pair(std::get<1>(rhs), std::get<2>(rhs)));
+  }
+
+  /**
+   * Top-k continuations of the hypotheses [begin, end) with accumulated scores, the selection scores are penalized by
+   * the tokens of the previous groups
+   * @param skip_selected exclude the tokens selected by the previous groups, used when the groups expand the same root
+   */
+  void CollectCandidates(const float *log_probs, IndexType begin, IndexType end, bool skip_selected) {
+    candidates_.clear();
+    auto top_k = options_.top_k == 0 ? vocabulary_size_ : std::min<IndexType>(options_.top_k, vocabulary_size_);
+    order_.resize(vocabulary_size_);
+    for (auto i = begin; i < end; ++i) {
+      const float *row = log_probs + static_cast<size_t>(i) * vocabulary_size_;
+      auto base = tree_.GetEntry(beams_[i]).score;
+      for (LabelType token = 0; token < vocabulary_size_; ++token) {
+        order_[token] = token;
+      }
+      if (top_k < vocabulary_size_) {
+        std::nth_element(order_.begin(), order_.begin() + top_k - 1, order_.end(), [row](LabelType lhs, LabelType rhs) {
+          return row[lhs] > row[rhs] || (row[lhs] == row[rhs] && lhs < rhs);
+        });
+      }
+      if (options_.stochastic) {
+        CollectPerturbed(row, tree_.GetEntry(beams_[i]), beams_[i], top_k);
+        continue;
+      }
+      for (IndexType k = 0; k < top_k; ++k) {
+        auto token = order_[k];
+        if (skip_selected && token_counts_[token] > 0) {
+          continue;
+        }
+        auto score = base + row[token];
+        candidates_.emplace_back(score - options_.diversity_penalty * token_counts_[token], beams_[i], token, score,
+                                 score);
+      }
+    }
+  }
+
+  /**
+   * Candidates of the stochastic search from the first top_k tokens of order_: perturbed scores G = score + Gumbel
+   * with maximum Z are conditioned on max G = T for the perturbed score T of the parent,
+   * G' = -log(exp(-T) - exp(-Z) + exp(-G)), computed in the numerically stable form.
+   */
+  void CollectPerturbed(const float *row, const TokenBeamEntry &parent, IndexType parent_index, IndexType top_k) {
+    noise_.resize(top_k);
+    generator_.Generate(noise_.data(), top_k);
+    auto maximum = kNegativeInfinity;
+    for (IndexType k = 0; k < top_k; ++k) {
+      noise_[k] += parent.score + row[order_[k]];
+      maximum = std::max(maximum, noise_[k]);
+    }
+    for (IndexType k = 0; k < top_k; ++k) {
+      auto score = parent.score + row[order_[k]];
+      float perturbed;
+      if (noise_[k] == maximum) {
+        perturbed = parent.perturbed_score;
+      } else {
+        auto v = parent.perturbed_score - noise_[k] + Log1MExp(noise_[k] - maximum);
+        perturbed = parent.perturbed_score - std::max(0.0f, v) - std::log1p(std::exp(-std::abs(v)));
+      }
+      candidates_.emplace_back(perturbed, parent_index, order_[k], score, perturbed);
+    }
+  }
+
+  /**
+   * log(1 - exp(x)) for x < 0
+   */
+  static float Log1MExp(float x) { return x > -0.693f ? std::log(-std::expm1(x)) : std::log1p(-std::exp(x)); }
+
+  /**
+   * Selects the hypotheses of the group from the candidates and counts their tokens for the next groups
+   */
+  void SelectGroup(IndexType group) {
+    auto group_size = options_.beam_size / options_.groups + (group < options_.beam_size % options_.groups ? 1 : 0);
+    auto survivors = std::min<size_t>(group_size, candidates_.size());
+    std::partial_sort(candidates_.begin(), candidates_.begin() + survivors, candidates_.end(), Better);
+    if (options_.stochastic) {
+      // Finished samples stay in the beam while their perturbed scores are among the largest ones
+      size_t kept = 0;
+      size_t taken = 0;
+      while (kept + taken < group_size && (kept < finished_.size() || taken < survivors)) {
+        if (taken == survivors || (kept < finished_.size() &&
+            finished_[kept].perturbed_score >= std::get<0>(candidates_[taken]))) {
+          ++kept;
+        } else {
+          ++taken;
+        }
+      }
+      finished_.resize(kept);
+      survivors = taken;
+    }
+
+    bool created;
+    for (size_t i = 0; i < survivors; ++i) {
+      IndexType parent;
+      LabelType token;
+      float score;
+      float perturbed_score;
+      std::tie(std::ignore, parent, token, score, perturbed_score) = candidates_[i];
+      if (token_counts_[token]++ == 0) {
+        selected_tokens_.push_back(token);
+      }
+      if (token == options_.eos) {
+        finished_.push_back({tree_.BacktraceString(parent), score, group, perturbed_score});
+        continue;
+      }
+      auto child = tree_.GetChild(parent, token, &created);
+      if (child == kNoIndex) {
+        continue;
+      }
+      auto &entry = tree_.GetEntry(child);
+      entry.score = score;
+      entry.perturbed_score = perturbed_score;
+      entry.block = pool_->AppendToken(tree_.GetEntry(parent).block, tree_.GetDepth(child) - 1, &entry.offset);
+      if (entry.block == kNoIndex) {
+        tree_.DeleteEntry(child);
+        continue;
+      }
+      next_beams_.push_back(child);
+    }
+  }
+
+  void ResetBeams() {
+    beams_.assign(1, tree_.Reset());
+    group_begins_.assign(options_.groups + 1, 1);
+    group_begins_[0] = 0;
+  }
+
+  /**
+   * Deletes all the hypotheses, their blocks are released by the callback, and releases the detached prefix blocks
+   */
+  void ReleaseAll() {
+    for (auto beam: beams_) {
+      tree_.DeleteEntry(beam);
+    }
+    beams_.clear();
+    group_begins_.assign(options_.groups + 1, 0);
+    for (auto block: prefix_blocks_) {
+      if (block != kNoIndex) {
+        pool_->Release(block);
+      }
+    }
+    prefix_blocks_.clear();
+  }
+
+  KVBlockPool *pool_;
+  LabelType vocabulary_size_;
+  TokenBeamSearchOptions options_;
+  CircularArrayCTCBeamSearchTree<TokenBeamEntry> tree_;
+  std::vector<IndexType> beams_;
+  // Position of the first beam of every group in beams_ and the end of the last group
+  std::vector<IndexType> group_begins_;
+  std::vector<TokenHypothesis> finished_;
+  // Blocks of the detached entries by depth, the references are owned by the table
+  std::vector<IndexType> prefix_blocks_;
+  // Scratch buffers
+  std::vector<Candidate> candidates_;
+  std::vector<IndexType> next_beams_;
+  std::vector<IndexType> next_group_begins_;
+  std::vector<LabelType> order_;
+  // Number of hypotheses of the previous groups that have selected the token at the current step
+  std::vector<IndexType> token_counts_;
+  std::vector<LabelType> selected_tokens_;
+  GumbelGenerator generator_;
+  std::vector<float> noise_;
+};
+
+} // beam_search
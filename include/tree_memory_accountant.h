@@ -0,0 +1,156 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+namespace beam_search {
+
+enum class Admission {
+  kAccepted,
+  kDowngraded,
+  kRejected
+};
+
+/**
+ * Process wide accounting of the memory held by CircularArrayCTCBeamSearchTree instances: the ring and the detached
+ * shared prefix (including the segments shared by forks). Every tree charges the global accountant for its memory
+ * and updates the charge when the detached prefix grows, so the usage of many long streams is visible in one place.
+ *
+ * Budgets drive the admission of new streams: a stream that fits the soft budget is accepted, a stream whose reduced
+ * configuration fits the hard budget is downgraded, otherwise it is rejected. A budget of 0 means no limit. Admission
+ * reads the current usage without reserving it, so concurrent admissions may exceed a budget by the streams admitted
+ * at the same moment.
+ */
+class TreeMemoryAccountant {
+ public:
+  static TreeMemoryAccountant &Global() {
+    static TreeMemoryAccountant accountant;
+    return accountant;
+  }
+
+  /**
+   * @param soft_budget bytes above which new streams are downgraded, 0 for no limit
+   * @param hard_budget bytes above which new streams are rejected, 0 for no limit
+   */
+  void SetBudgets(size_t soft_budget, size_t hard_budget) {
+    soft_budget_ = soft_budget;
+    hard_budget_ = hard_budget;
+  }
+
+  /**
+   * Admission of a new stream
+   * @param bytes memory of the stream in its requested configuration
+   * @param downgraded_bytes memory of the stream in the reduced configuration
+   */
+  Admission Admit(size_t bytes, size_t downgraded_bytes) const {
+    auto usage = GetUsage();
+    if (Fits(usage + bytes, soft_budget_) && Fits(usage + bytes, hard_budget_)) {
+      return Admission::kAccepted;
+    }
+    if (Fits(usage + downgraded_bytes, hard_budget_)) {
+      return Admission::kDowngraded;
+    }
+    return Admission::kRejected;
+  }
+
+  void Charge(size_t bytes) {
+    auto usage = usage_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    auto peak = peak_.load(std::memory_order_relaxed);
+    while (usage > peak && !peak_.compare_exchange_weak(peak, usage, std::memory_order_relaxed)) {}
+  }
+
+  void Release(size_t bytes) { usage_.fetch_sub(bytes, std::memory_order_relaxed); }
+
+  void AddTree() { trees_.fetch_add(1, std::memory_order_relaxed); }
+
+  void RemoveTree() { trees_.fetch_sub(1, std::memory_order_relaxed); }
+
+  size_t GetUsage() const { return usage_.load(std::memory_order_relaxed); }
+
+  size_t GetPeakUsage() const { return peak_.load(std::memory_order_relaxed); }
+
+  /**
+   * Resets the peak usage to the current usage
+   */
+  void ResetPeakUsage() { peak_.store(GetUsage(), std::memory_order_relaxed); }
+
+  size_t GetTrees() const { return trees_.load(std::memory_order_relaxed); }
+
+  size_t GetSoftBudget() const { return soft_budget_; }
+
+  size_t GetHardBudget() const { return hard_budget_; }
+
+ private:
+  static bool Fits(size_t bytes, size_t budget) { return budget == 0 || bytes <= budget; }
+
+  std::atomic<size_t> usage_{0};
+  std::atomic<size_t> peak_{0};
+  std::atomic<size_t> trees_{0};
+  std::atomic<size_t> soft_budget_{0};
+  std::atomic<size_t> hard_budget_{0};
+};
+
+/**
+ * Charge of an object to the global accountant, released with the object. Copies charge the same amount again, moves
+ * transfer the charge.
+ */
+class MemoryCharge {
+ public:
+  MemoryCharge() = default;
+
+  MemoryCharge(const MemoryCharge &other) { Set(other.bytes_); }
+
+  MemoryCharge(MemoryCharge &&other) noexcept : bytes_(other.bytes_) { other.bytes_ = 0; }
+
+  MemoryCharge &operator=(const MemoryCharge &other) {
+    Set(other.bytes_);
+    return *this;
+  }
+
+  MemoryCharge &operator=(MemoryCharge &&other) noexcept {
+    if (this != &other) {
+      Set(0);
+      bytes_ = other.bytes_;
+      other.bytes_ = 0;
+    }
+    return *this;
+  }
+
+  ~MemoryCharge() { Set(0); }
+
+  /**
+   * Updates the charge to the given amount
+   */
+  void Set(size_t bytes) {
+    auto &accountant = TreeMemoryAccountant::Global();
+    if (bytes > bytes_) {
+      accountant.Charge(bytes - bytes_);
+    } else if (bytes < bytes_) {
+      accountant.Release(bytes_ - bytes);
+    }
+    bytes_ = bytes;
+  }
+
+  size_t Get() const { return bytes_; }
+
+ private:
+  size_t bytes_ = 0;
+};
+
+/**
+ * Counts the owning object in the global accountant, copies and moves count as new objects
+ */
+class TreeCounter {
+ public:
+  TreeCounter() { TreeMemoryAccountant::Global().AddTree(); }
+
+  TreeCounter(const TreeCounter &) { TreeMemoryAccountant::Global().AddTree(); }
+
+  TreeCounter &operator=(const TreeCounter &) = default;
+
+  ~TreeCounter() { TreeMemoryAccountant::Global().RemoveTree(); }
+};
+
+} // beam_search
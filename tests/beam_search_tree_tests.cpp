@@ -4,10 +4,55 @@
 
 #include <catch2/catch.hpp>
 
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "tree_copy_entries.h"
+
 using beam_search::CircularArrayCTCBeamSearchTree;
+using beam_search::EntryHandle;
 
 struct EmptyBeamEntry {};
 
+namespace {
+
+/**
+ * One step of a random beam search: every beam is extended with two random labels below labels, on_child(parent,
+ * child) is called for every extension, a random subset of at most three created children replaces the beams.
+ */
+template<class BeamEntry, class OnChild>
+void RandomSearchStep(CircularArrayCTCBeamSearchTree<BeamEntry> &tree, std::vector<beam_search::IndexType> &beams,
+                      std::mt19937 &generator, beam_search::LabelType labels, OnChild on_child) {
+  std::vector<beam_search::IndexType> candidates;
+  bool created;
+  for (auto beam: beams) {
+    for (int i = 0; i < 2; ++i) {
+      auto child = tree.GetChild(beam, static_cast<beam_search::LabelType>(generator() % labels), &created);
+      REQUIRE(child != beam_search::kNoIndex);
+      on_child(beam, child);
+      if (created) {
+        candidates.push_back(child);
+      }
+    }
+  }
+  std::shuffle(candidates.begin(), candidates.end(), generator);
+  auto survivors = std::min<size_t>(3, candidates.size());
+  for (size_t i = survivors; i < candidates.size(); ++i) {
+    tree.DeleteEntry(candidates[i]);
+  }
+  for (auto beam: beams) {
+    tree.DeleteEntry(beam);
+  }
+  beams.assign(candidates.begin(), candidates.begin() + survivors);
+}
+
+void IgnoreChild(beam_search::IndexType, beam_search::IndexType) {}
+
+} // namespace
+
 TEST_CASE("Circular array CTC beam search tree test") {
   /**
    *                             -> (3, 0)  -> (6, 3) -> (8, 0) -> (9, 5)
@@ -22,7 +67,8 @@ TEST_CASE("Circular array CTC beam search tree test") {
 
   auto root = tree.InitializeTree();
   std::vector<beam_search::IndexType> active_entries;
-  bool* created;
+  bool created_value;
+  bool *created = &created_value;
   active_entries.push_back(tree.GetChild(root, 0, created));
   CHECK(*created == true);
   active_entries.push_back(tree.GetChild(active_entries[0], 1, created));
@@ -124,4 +170,477 @@ TEST_CASE("Circular array CTC beam search tree test") {
   CHECK(tree.GetSize() == 4);
   tree.DeleteEntry(active_entries[2]);
   CHECK(tree.GetSize() == 1);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Circular array CTC beam search tree random queries test") {
+  /**
+   * Random beam search: every hypothesis is extended with two random labels, a random half of the candidates survives.
+   * Small capacity makes the ring wrap many times and the shared prefix get detached.
+   */
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> tree(256);
+  std::mt19937 generator(17);
+  std::vector<beam_search::IndexType> beams = {tree.InitializeTree()};
+  for (int step = 0; step < 3000; ++step) {
+    RandomSearchStep(tree, beams, generator, 4, IgnoreChild);
+
+    auto duplicated = beams;
+    duplicated.push_back(beams[0]);
+    auto backtraces = tree.BacktraceAll(duplicated);
+    for (size_t i = 0; i < duplicated.size(); ++i) {
+      CHECK(backtraces[i] == tree.BacktraceString(duplicated[i]));
+    }
+
+    for (size_t i = 0; i < beams.size(); ++i) {
+      auto first = tree.BacktraceString(beams[i]);
+      CHECK(tree.GetDepth(beams[i]) == first.size());
+      for (size_t j = i + 1; j < beams.size(); ++j) {
+        auto second = tree.BacktraceString(beams[j]);
+        auto mismatch = std::mismatch(first.begin(), first.end(), second.begin(), second.end());
+        auto common = static_cast<beam_search::IndexType>(mismatch.first - first.begin());
+        CHECK(tree.GetCommonPrefixLength(beams[i], beams[j]) == common);
+        auto lca = tree.GetLCA(beams[i], beams[j]);
+        CHECK(tree.GetAncestor(beams[i], common) == lca);
+        CHECK(tree.GetAncestor(beams[j], common) == lca);
+      }
+      auto lca_depth = tree.GetDepth(tree.GetLCA(beams[0], beams[i]));
+      auto middle = tree.GetAncestor(beams[i], (tree.GetDepth(beams[i]) + lca_depth) / 2);
+      auto prefix = tree.BacktraceString(middle);
+      CHECK(std::equal(prefix.begin(), prefix.end(), first.begin()));
+    }
+  }
+  CHECK(tree.GetAncestor(beams[0], 0) == beam_search::kNoIndex);
+}
+
+TEST_CASE("Circular array CTC beam search tree batched GetChild test") {
+  /**
+   * Two trees receive the same requests, one through GetChild and one through GetChildren, including duplicates,
+   * existing children and requests beyond the capacity.
+   */
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> sequential(32);
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> batched(32);
+  std::vector<beam_search::IndexType> beams = {sequential.InitializeTree()};
+  batched.InitializeTree();
+  std::mt19937 generator(5);
+  for (int step = 0; step < 6; ++step) {
+    std::vector<beam_search::IndexType> parents;
+    std::vector<beam_search::LabelType> labels;
+    for (int i = 0; i < 12; ++i) {
+      parents.push_back(beams[generator() % beams.size()]);
+      labels.push_back(static_cast<beam_search::LabelType>(generator() % 5));
+    }
+    std::vector<beam_search::IndexType> expected(parents.size());
+    std::vector<bool> expected_created(parents.size());
+    for (size_t i = 0; i < parents.size(); ++i) {
+      bool created;
+      expected[i] = sequential.GetChild(parents[i], labels[i], &created);
+      expected_created[i] = created;
+    }
+    std::vector<beam_search::IndexType> children(parents.size());
+    std::unique_ptr<bool[]> created(new bool[parents.size()]);
+    batched.GetChildren(parents.data(), labels.data(), static_cast<beam_search::IndexType>(parents.size()),
+                        children.data(), created.get());
+    for (size_t i = 0; i < parents.size(); ++i) {
+      CHECK(children[i] == expected[i]);
+      CHECK(created[i] == expected_created[i]);
+      if (children[i] != beam_search::kNoIndex) {
+        CHECK(batched.BacktraceString(children[i]) == sequential.BacktraceString(expected[i]));
+        beams.push_back(children[i]);
+      }
+    }
+    CHECK(batched.GetSize() == sequential.GetSize());
+  }
+  CHECK(batched.GetSize() == 32);
+}
+
+TEST_CASE("Circular array CTC beam search tree handles test") {
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> tree(8);
+  auto beam = tree.InitializeTree();
+  bool created;
+  auto first = tree.GetChild(beam, 1, &created);
+  auto handle = tree.GetHandle(first);
+  CHECK(tree.IsValid(handle));
+  CHECK(tree.Resolve(handle) == first);
+  tree.DeleteEntry(first);
+  // Deleted but not reclaimed entry is still valid
+  CHECK(tree.IsValid(handle));
+
+  // A chain of hypotheses moves through the ring until the slot of the first child is reused
+  EntryHandle reused;
+  for (beam_search::LabelType label = 0; label < 20; ++label) {
+    auto child = tree.GetChild(beam, label, &created);
+    REQUIRE(child != beam_search::kNoIndex);
+    tree.DeleteEntry(beam);
+    beam = child;
+    if (beam == first) {
+      reused = tree.GetHandle(beam);
+    }
+  }
+  CHECK(tree.GetSize() < 8);
+  CHECK(reused.index == first);
+  CHECK_FALSE(tree.IsValid(reused));
+  CHECK_FALSE(tree.IsValid(handle));
+#if BEAM_SEARCH_CHECK_HANDLES
+  CHECK_THROWS(tree.Resolve(handle));
+#endif
+  reused = tree.GetHandle(beam);
+  CHECK(tree.IsValid(reused));
+
+  tree.Reset();
+  CHECK_FALSE(tree.IsValid(reused));
+  CHECK_FALSE(tree.IsValid(EntryHandle()));
+}
+
+TEST_CASE("Circular array CTC beam search tree fork test") {
+  struct ScoreBeamEntry {
+    int score = 0;
+  };
+  CircularArrayCTCBeamSearchTree<ScoreBeamEntry> tree(16);
+  auto beam = tree.InitializeTree();
+  bool created;
+  // Single hypothesis of length 20, most of it is detached
+  for (beam_search::LabelType label = 0; label < 20; ++label) {
+    auto child = tree.GetChild(beam, label, &created);
+    tree.GetEntry(child).score = label;
+    tree.DeleteEntry(beam);
+    beam = child;
+  }
+  auto left = tree.GetChild(beam, 100, &created);
+  auto right = tree.GetChild(beam, 200, &created);
+  tree.DeleteEntry(beam);
+
+  auto fork = tree.Fork();
+  auto reference = tree.BacktraceString(left);
+  CHECK(fork.BacktraceString(left) == reference);
+  CHECK(fork.GetDepth(right) == 21);
+  CHECK(fork.IsValid(tree.GetHandle(right)));
+
+  // The trees continue independently: the original keeps the left branch, the fork keeps the right one
+  tree.DeleteEntry(right);
+  fork.DeleteEntry(left);
+  auto original_beam = left;
+  auto fork_beam = right;
+  for (beam_search::LabelType label = 0; label < 30; ++label) {
+    auto child = tree.GetChild(original_beam, label, &created);
+    tree.DeleteEntry(original_beam);
+    original_beam = child;
+    child = fork.GetChild(fork_beam, 50 + label, &created);
+    fork.DeleteEntry(fork_beam);
+    fork_beam = child;
+  }
+  auto original_string = tree.BacktraceString(original_beam);
+  auto fork_string = fork.BacktraceString(fork_beam);
+  REQUIRE(original_string.size() == 51);
+  REQUIRE(fork_string.size() == 51);
+  CHECK(std::equal(original_string.begin(), original_string.begin() + 20, fork_string.begin()));
+  CHECK(original_string[20] == 100);
+  CHECK(fork_string[20] == 200);
+  CHECK(original_string.back() == 29);
+  CHECK(fork_string.back() == 79);
+  CHECK(fork.BacktraceAll({fork_beam})[0] == fork_string);
+
+  auto entries = fork.Backtrace(fork_beam);
+  REQUIRE(entries.size() == 52);
+  CHECK(entries[5].GetLabel() == 4);
+  CHECK(entries[5].GetEntry().score == 4);
+  CHECK(entries[21].GetLabel() == 200);
+}
+
+TEST_CASE("Circular array CTC beam search tree undo test") {
+  /**
+   * Random beam search with a small ring, from time to time a few last frames are rewound and the state is compared
+   * with the one saved after the corresponding frame.
+   */
+  struct ScoreBeamEntry {
+    int score = 0;
+  };
+  struct State {
+    std::vector<beam_search::IndexType> beams;
+    std::vector<std::vector<beam_search::LabelType>> strings;
+    std::vector<int> scores;
+    beam_search::IndexType size;
+  };
+  CircularArrayCTCBeamSearchTree<ScoreBeamEntry> tree(256);
+  auto save = [&tree](const std::vector<beam_search::IndexType> &beams) {
+    State state{beams, {}, {}, tree.GetSize()};
+    for (auto beam: beams) {
+      state.strings.push_back(tree.BacktraceString(beam));
+      state.scores.push_back(tree.GetEntry(beam).score);
+    }
+    return state;
+  };
+  tree.EnableUndo(4);
+  std::vector<State> history = {save({tree.InitializeTree()})};
+  std::mt19937 generator(3);
+  bool created;
+  for (int step = 0; step < 2000; ++step) {
+    tree.BeginFrame();
+    auto beams = history.back().beams;
+    RandomSearchStep(tree, beams, generator, 3, [&tree, &generator](beam_search::IndexType,
+                                                                    beam_search::IndexType child) {
+      tree.ModifyEntry(child).score += static_cast<int>(generator() % 10);
+    });
+    history.push_back(save(beams));
+
+    if (step % 7 == 6) {
+      auto frames = static_cast<beam_search::IndexType>(1 + generator() % tree.GetUndoFrames());
+      tree.Rewind(frames);
+      history.resize(history.size() - frames);
+      auto restored = save(history.back().beams);
+      CHECK(restored.strings == history.back().strings);
+      CHECK(restored.scores == history.back().scores);
+      CHECK(restored.size == history.back().size);
+    }
+  }
+  CHECK_THROWS(tree.Rewind(tree.GetUndoFrames() + 1));
+
+  // Single hypothesis in a tiny ring: slots reclaimed within the log are reused and restored by Rewind
+  CircularArrayCTCBeamSearchTree<ScoreBeamEntry> chain(4);
+  chain.EnableUndo(8);
+  std::vector<beam_search::IndexType> chain_beams = {chain.InitializeTree()};
+  std::vector<EntryHandle> handles = {chain.GetHandle(chain_beams.back())};
+  for (beam_search::LabelType label = 0; label < 20; ++label) {
+    chain.BeginFrame();
+    auto child = chain.GetChild(chain_beams.back(), label, &created);
+    chain.ModifyEntry(child).score = label;
+    chain.DeleteEntry(chain_beams.back());
+    chain_beams.push_back(child);
+    handles.push_back(chain.GetHandle(child));
+  }
+  CHECK(chain.GetUndoFrames() == 8);
+  chain.Rewind(6);
+  CHECK(chain.GetUndoFrames() == 2);
+  auto beam = chain_beams[14];
+  CHECK(chain.IsValid(handles[14]));
+  CHECK_FALSE(chain.IsValid(handles[20]));
+  CHECK(chain.GetEntry(beam).score == 13);
+  auto expected = chain.BacktraceString(beam);
+  REQUIRE(expected.size() == 14);
+  CHECK(expected.back() == 13);
+  for (beam_search::LabelType label = 100; label < 110; ++label) {
+    chain.BeginFrame();
+    auto child = chain.GetChild(beam, label, &created);
+    chain.DeleteEntry(beam);
+    beam = child;
+  }
+  expected.insert(expected.end(), {100, 101, 102, 103, 104, 105, 106, 107, 108, 109});
+  CHECK(chain.BacktraceString(beam) == expected);
+
+  // A handle of an entry created in a rewound frame stays stale when its slot is created again
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> small(8);
+  small.EnableUndo(2);
+  auto root = small.InitializeTree();
+  small.BeginFrame();
+  auto rewound = small.GetHandle(small.GetChild(root, 1, &created));
+  small.Rewind(1);
+  small.BeginFrame();
+  auto recreated = small.GetChild(root, 2, &created);
+  CHECK(recreated == rewound.index);
+  CHECK_FALSE(small.IsValid(rewound));
+  CHECK(small.IsValid(small.GetHandle(recreated)));
+}
+
+TEST_CASE("Circular array CTC beam search tree revived child test") {
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> tree(8);
+  auto root = tree.InitializeTree();
+  bool created;
+  auto beam = tree.GetChild(root, 1, &created);
+  auto pruned = tree.GetChild(beam, 2, &created);
+  tree.DeleteEntry(root);
+  tree.DeleteEntry(pruned);
+
+  // Deleted child is returned by GetChild again and takes its references back
+  CHECK(tree.GetChild(beam, 2, &created) == pruned);
+  CHECK_FALSE(created);
+  tree.DeleteEntry(beam);
+  CHECK(tree.BacktraceString(pruned) == std::vector<beam_search::LabelType>({1, 2}));
+  CHECK(tree.GetSize() == 1);
+  auto child = tree.GetChild(pruned, 3, &created);
+  tree.DeleteEntry(pruned);
+  CHECK(tree.GetSize() == 1);
+  CHECK(tree.BacktraceString(child) == std::vector<beam_search::LabelType>({1, 2, 3}));
+}
+
+namespace {
+
+/**
+ * Random beam search in a small ring forking the tree every few steps, returns the backtraces of the final beams of
+ * the last fork with the accumulated random scores stored in the frame field
+ */
+template<class BeamEntry>
+std::vector<std::pair<std::vector<beam_search::LabelType>, std::vector<beam_search::IndexType>>> ForkedSearch() {
+  CircularArrayCTCBeamSearchTree<BeamEntry> tree(256);
+  std::mt19937 generator(5);
+  std::vector<beam_search::IndexType> beams = {tree.InitializeTree()};
+  for (int step = 0; step < 1500; ++step) {
+    RandomSearchStep(tree, beams, generator, 4, [&tree, &generator](beam_search::IndexType parent,
+                                                                    beam_search::IndexType child) {
+      tree.GetEntry(child).frame = tree.GetEntry(parent).frame + static_cast<beam_search::IndexType>(generator() % 10);
+    });
+    if (step % 13 == 0) {
+      tree = tree.Fork();
+    }
+  }
+  std::vector<std::pair<std::vector<beam_search::LabelType>, std::vector<beam_search::IndexType>>> result;
+  for (auto beam: beams) {
+    result.emplace_back();
+    for (const auto &entry: tree.Backtrace(beam)) {
+      result.back().first.push_back(entry.GetLabel());
+      result.back().second.push_back(entry.GetEntry().frame);
+    }
+    REQUIRE(result.back().first.size() == tree.GetDepth(beam) + 1);
+  }
+  return result;
+}
+
+} // namespace
+
+TEST_CASE("Circular array CTC beam search tree trivially copyable entries test") {
+  auto trivial = ForkedSearch<beam_search::TrivialCopyEntry>();
+  auto generic = ForkedSearch<beam_search::GenericCopyEntry>();
+  REQUIRE(trivial.size() == 3);
+  CHECK(trivial == generic);
+  // Scores grow along the hypothesis, so a misplaced entry of a copy would break the order
+  for (const auto &hypothesis: trivial) {
+    CHECK(std::is_sorted(hypothesis.second.begin(), hypothesis.second.end()));
+  }
+}
+
+namespace {
+
+// Counts constructions of the payload
+struct CountedBeamEntry {
+  CountedBeamEntry() { ++constructed; }
+
+  explicit CountedBeamEntry(int score) : score(score) { ++constructed; }
+
+  int score = 0;
+  static int constructed;
+};
+
+int CountedBeamEntry::constructed = 0;
+
+} // namespace
+
+TEST_CASE("Circular array CTC beam search tree reserved children test") {
+  CircularArrayCTCBeamSearchTree<CountedBeamEntry> tree(8);
+  std::vector<std::pair<beam_search::EntryEvent, int>> events;
+  tree.SetEntryCallback([&events](beam_search::EntryEvent event, beam_search::IndexType,
+                                  CountedBeamEntry &entry) {
+    events.emplace_back(event, entry.score);
+  });
+  auto beam = tree.InitializeTree();
+  bool created;
+  CountedBeamEntry::constructed = 0;
+  // Many frames in a small ring: only the survivor of every frame is materialized, the pruned children never are
+  for (int frame = 0; frame < 20; ++frame) {
+    std::vector<beam_search::IndexType> children;
+    for (beam_search::LabelType label = 0; label < 3; ++label) {
+      children.push_back(tree.ReserveChild(beam, label, &created));
+      REQUIRE(children.back() != beam_search::kNoIndex);
+      CHECK(created);
+      CHECK_FALSE(tree.IsMaterialized(children.back()));
+    }
+    auto survivor = children[frame % 3];
+    tree.MaterializeEntry(survivor, frame + 1);
+    CHECK(tree.IsMaterialized(survivor));
+    for (auto child: children) {
+      if (child != survivor) {
+        tree.DeleteEntry(child);
+      }
+    }
+    tree.DeleteEntry(beam);
+    beam = survivor;
+  }
+  CHECK(CountedBeamEntry::constructed == 20);
+  CHECK(tree.GetEntry(beam).score == 20);
+  auto string = tree.BacktraceString(beam);
+  REQUIRE(string.size() == 20);
+  for (int frame = 0; frame < 20; ++frame) {
+    CHECK(string[frame] == frame % 3);
+  }
+  auto entries = tree.Backtrace(beam);
+  for (size_t i = 1; i < entries.size(); ++i) {
+    CHECK(entries[i].GetEntry().score == static_cast<int>(i));
+  }
+  // Only the materialized survivors are reported, once they are detached
+  REQUIRE_FALSE(events.empty());
+  for (size_t i = 0; i < events.size(); ++i) {
+    CHECK(events[i].first == beam_search::EntryEvent::kDetached);
+    CHECK(events[i].second == static_cast<int>(i));
+  }
+
+  // A pruned reserved child requested again still needs its payload, GetChild materializes it with the default
+  auto pruned = tree.ReserveChild(beam, 7, &created);
+  auto kept = tree.ReserveChild(beam, 8, &created);
+  tree.MaterializeEntry(kept, 100);
+  tree.DeleteEntry(pruned);
+  CHECK(tree.ReserveChild(beam, 7, &created) == pruned);
+  CHECK(created);
+  tree.DeleteEntry(pruned);
+  CHECK(tree.GetChild(beam, 7, &created) == pruned);
+  CHECK(created);
+  CHECK(tree.IsMaterialized(pruned));
+  CHECK(tree.GetEntry(pruned).score == 0);
+  CHECK(tree.GetChild(beam, 8, &created) == kept);
+  CHECK_FALSE(created);
+  CHECK(tree.GetEntry(kept).score == 100);
+
+  // Same for the batched lookup
+  auto reserved = tree.ReserveChild(beam, 9, &created);
+  tree.DeleteEntry(reserved);
+  beam_search::IndexType parents[] = {beam, beam, beam};
+  beam_search::LabelType labels[] = {9, 8, 9};
+  beam_search::IndexType batch_children[3];
+  bool batch_created[3];
+  tree.GetChildren(parents, labels, 3, batch_children, batch_created);
+  CHECK(batch_children[0] == reserved);
+  CHECK(batch_children[2] == reserved);
+  CHECK(batch_created[0]);
+  CHECK_FALSE(batch_created[1]);
+  CHECK_FALSE(batch_created[2]);
+  CHECK(tree.IsMaterialized(reserved));
+}
+
+TEST_CASE("Circular array CTC beam search tree detached reserved entry test") {
+  CircularArrayCTCBeamSearchTree<CountedBeamEntry> tree(4);
+  std::vector<beam_search::IndexType> detached;
+  tree.SetEntryCallback([&detached](beam_search::EntryEvent event, beam_search::IndexType index, CountedBeamEntry &) {
+    if (event == beam_search::EntryEvent::kDetached) {
+      detached.push_back(index);
+    }
+  });
+  auto beam = tree.InitializeTree();
+  bool created;
+  // Every slot of the ring holds a payload of an old entry
+  for (int frame = 0; frame < 6; ++frame) {
+    auto child = tree.GetChild(beam, 1, &created);
+    REQUIRE(child != beam_search::kNoIndex);
+    tree.ModifyEntry(child).score = 42;
+    tree.DeleteEntry(beam);
+    beam = child;
+  }
+  // The reserved entry is never materialized and becomes a part of the shared prefix of its only child
+  auto reserved = tree.ReserveChild(beam, 2, &created);
+  REQUIRE(reserved != beam_search::kNoIndex);
+  REQUIRE_FALSE(tree.IsMaterialized(reserved));
+  CHECK(tree.GetEntry(reserved).score == 42);
+  auto child = tree.ReserveChild(reserved, 3, &created);
+  REQUIRE(child != beam_search::kNoIndex);
+  tree.MaterializeEntry(child, 7);
+  detached.clear();
+  tree.DeleteEntry(reserved);
+  tree.DeleteEntry(beam);
+  // Only the materialized entry is reported
+  CHECK(detached == std::vector<beam_search::IndexType>{beam});
+
+  auto string = tree.BacktraceString(child);
+  auto entries = tree.Backtrace(child);
+  REQUIRE(string.size() == 8);
+  REQUIRE(entries.size() == 9);
+  CHECK(string[6] == 2);
+  CHECK(entries[7].GetEntry().score == 0);
+  CHECK(entries[8].GetEntry().score == 7);
+  for (size_t i = 1; i < 7; ++i) {
+    CHECK(entries[i].GetEntry().score == 42);
+  }
+}
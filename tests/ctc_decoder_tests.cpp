@@ -0,0 +1,337 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "ctc_decoder.h"
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <map>
+#include <random>
+#include <vector>
+
+using beam_search::CTCDecoderOptions;
+using beam_search::CTCPrefixBeamSearchDecoder;
+using beam_search::LabelType;
+
+namespace {
+
+/**
+ * Random posteriors normalized by frame. If peak is set, it is added to the logit of blank (label 0) in most frames
+ * and of a random label in the rest, which resembles the output of a trained model.
+ */
+std::vector<float> RandomLogProbs(size_t frames, size_t vocabulary_size, unsigned seed, float peak = 0.0f) {
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> distribution(0.0f, 4.0f);
+  std::vector<float> result(frames * vocabulary_size);
+  for (size_t t = 0; t < frames; ++t) {
+    float normalizer = 0.0f;
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      result[t * vocabulary_size + label] = distribution(generator);
+    }
+    auto peak_label = generator() % 4 == 0 ? generator() % vocabulary_size : 0;
+    result[t * vocabulary_size + peak_label] += peak;
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      normalizer += std::exp(result[t * vocabulary_size + label]);
+    }
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      result[t * vocabulary_size + label] -= std::log(normalizer);
+    }
+  }
+  return result;
+}
+
+/**
+ * Exact label sequence probabilities by enumeration of all alignments, blank is 0
+ */
+std::map<std::vector<LabelType>, double> ExactProbabilities(const std::vector<float> &log_probs, size_t frames,
+                                                             size_t vocabulary_size) {
+  std::map<std::vector<LabelType>, double> result;
+  std::vector<LabelType> alignment(frames, 0);
+  while (true) {
+    double probability = 1.0;
+    std::vector<LabelType> labels;
+    for (size_t t = 0; t < frames; ++t) {
+      probability *= std::exp(log_probs[t * vocabulary_size + alignment[t]]);
+      if (alignment[t] != 0 && (t == 0 || alignment[t] != alignment[t - 1])) {
+        labels.push_back(alignment[t]);
+      }
+    }
+    result[labels] += probability;
+    size_t t = 0;
+    for (; t < frames && ++alignment[t] == vocabulary_size; ++t) {
+      alignment[t] = 0;
+    }
+    if (t == frames) {
+      break;
+    }
+  }
+  return result;
+}
+
+} // namespace
+
+TEST_CASE("CTC prefix beam search decoder exact search test") {
+  const size_t frames = 6;
+  const size_t vocabulary_size = 3;
+  auto log_probs = RandomLogProbs(frames, vocabulary_size, 1);
+  auto exact = ExactProbabilities(log_probs, frames, vocabulary_size);
+
+  // Beam wider than the number of prefixes makes the search exact
+  CTCDecoderOptions options;
+  options.beam_size = 1000;
+  CTCPrefixBeamSearchDecoder decoder(vocabulary_size, options);
+  decoder.ProcessChunk(log_probs.data(), 2);
+  decoder.ProcessChunk(log_probs.data() + 2 * vocabulary_size, frames - 2);
+  auto nbest = decoder.GetNBest(1000);
+  CHECK(nbest.size() == exact.size());
+  for (const auto &hypothesis: nbest) {
+    CHECK(hypothesis.score == Approx(std::log(exact[hypothesis.labels])).epsilon(1e-4));
+  }
+  auto best = decoder.GetBest();
+  CHECK(best.labels == nbest[0].labels);
+
+  // Narrow beam still finds the best hypothesis on these posteriors and the result does not depend on chunking
+  options.beam_size = 4;
+  options.top_k = 2;
+  CTCPrefixBeamSearchDecoder narrow(vocabulary_size, options);
+  narrow.ProcessChunk(log_probs.data(), frames);
+  auto narrow_best = narrow.GetBest();
+  narrow.Reset();
+  for (size_t t = 0; t < frames; ++t) {
+    narrow.ProcessChunk(log_probs.data() + t * vocabulary_size, 1);
+  }
+  CHECK(narrow.GetBest().labels == narrow_best.labels);
+  CHECK(narrow.GetBeams().size() <= 4);
+}
+
+TEST_CASE("CTC prefix beam search decoder shallow fusion test") {
+  const size_t frames = 6;
+  const size_t vocabulary_size = 3;
+  auto log_probs = RandomLogProbs(frames, vocabulary_size, 3);
+  auto exact = ExactProbabilities(log_probs, frames, vocabulary_size);
+  // Bigram LM, the state is the previous label
+  const float bigram[3][3] = {{0.0f, -0.3f, -1.5f}, {0.0f, -2.0f, -0.2f}, {0.0f, -0.1f, -2.5f}};
+  auto scorer = [&bigram](beam_search::IndexType state, LabelType label, beam_search::IndexType *next_state) {
+    *next_state = label;
+    return bigram[state][label];
+  };
+
+  CTCDecoderOptions options;
+  options.beam_size = 1000;
+  options.lm_weight = 0.7f;
+  options.insertion_bonus = 0.4f;
+  CTCPrefixBeamSearchDecoder decoder(vocabulary_size, options);
+  decoder.SetLabelScorer(scorer);
+  decoder.ProcessChunk(log_probs.data(), frames);
+  auto nbest = decoder.GetNBest(1000);
+  CHECK(nbest.size() == exact.size());
+  for (const auto &hypothesis: nbest) {
+    float lm = 0.0f;
+    beam_search::IndexType state = 0;
+    for (auto label: hypothesis.labels) {
+      lm += scorer(state, label, &state);
+    }
+    auto expected = std::log(exact[hypothesis.labels]) + options.lm_weight * lm +
+        options.insertion_bonus * hypothesis.labels.size();
+    CHECK(hypothesis.score == Approx(expected).epsilon(1e-4));
+  }
+  CHECK(decoder.GetBest().labels == nbest[0].labels);
+}
+
+TEST_CASE("CTC prefix beam search decoder long utterance test") {
+  // Small tree capacity makes the ring wrap, pruned prefixes are revisited by later frames
+  const size_t frames = 2000;
+  const size_t vocabulary_size = 5;
+  auto log_probs = RandomLogProbs(frames, vocabulary_size, 2, 6.0f);
+  CTCDecoderOptions options;
+  options.beam_size = 6;
+  options.beam_threshold = 1.0f;
+  options.tree_capacity = 256;
+  CTCPrefixBeamSearchDecoder decoder(vocabulary_size, options);
+  auto stats = decoder.ProcessChunk(log_probs.data(), frames);
+  CHECK_FALSE(stats.IsDegraded());
+
+  // The same search without ring wraps
+  options.tree_capacity = 1 << 16;
+  CTCPrefixBeamSearchDecoder reference(vocabulary_size, options);
+  reference.ProcessChunk(log_probs.data(), frames);
+  auto nbest = decoder.GetNBest(3);
+  auto reference_nbest = reference.GetNBest(3);
+  REQUIRE(nbest.size() == reference_nbest.size());
+  for (size_t i = 0; i < nbest.size(); ++i) {
+    CHECK(nbest[i].labels == reference_nbest[i].labels);
+    CHECK(nbest[i].score == reference_nbest[i].score);
+  }
+  CHECK(nbest[0].labels == decoder.GetBest().labels);
+}
+
+TEST_CASE("CTC prefix beam search decoder candidate staging test") {
+  // Every frame creates up to beam_size x (vocabulary_size - 1) new prefixes, a tree holding all of them until they
+  // are reclaimed would overflow, only the survivors are inserted, so nothing is dropped and the result matches a
+  // decoder with a large tree
+  const size_t frames = 300;
+  const size_t vocabulary_size = 40;
+  auto log_probs = RandomLogProbs(frames, vocabulary_size, 4, 6.0f);
+  CTCDecoderOptions options;
+  options.beam_size = 4;
+  options.beam_threshold = 3.0f;
+  options.tree_capacity = 512;
+  CTCPrefixBeamSearchDecoder decoder(vocabulary_size, options);
+  auto stats = decoder.ProcessChunk(log_probs.data(), frames);
+  CHECK(stats.dropped_candidates == 0);
+
+  options.tree_capacity = 1 << 16;
+  CTCPrefixBeamSearchDecoder reference(vocabulary_size, options);
+  reference.ProcessChunk(log_probs.data(), frames);
+  auto nbest = decoder.GetNBest(4);
+  auto reference_nbest = reference.GetNBest(4);
+  REQUIRE(nbest.size() == reference_nbest.size());
+  for (size_t i = 0; i < nbest.size(); ++i) {
+    CHECK(nbest[i].labels == reference_nbest[i].labels);
+    CHECK(nbest[i].score == reference_nbest[i].score);
+  }
+
+  // Even a tree too small for the beam keeps at least one hypothesis
+  options.tree_capacity = 2;
+  CTCPrefixBeamSearchDecoder tiny(vocabulary_size, options);
+  stats = tiny.ProcessChunk(log_probs.data(), frames);
+  CHECK(stats.dropped_candidates > 0);
+  CHECK_FALSE(tiny.GetBeams().empty());
+  CHECK(tiny.GetBest().score > beam_search::kLogZero);
+}
+
+TEST_CASE("CTC prefix beam search decoder deadline test") {
+  const size_t frames = 50;
+  const size_t vocabulary_size = 8;
+  auto log_probs = RandomLogProbs(frames, vocabulary_size, 3);
+  CTCDecoderOptions options;
+  options.beam_size = 8;
+  CTCPrefixBeamSearchDecoder reference(vocabulary_size, options);
+  reference.ProcessChunk(log_probs.data(), frames);
+
+  // Every clock reading advances the time by 1us
+  int64_t time = 0;
+  options.deadline.clock = [&time]() {
+    time += 1000;
+    return std::chrono::nanoseconds(time);
+  };
+  options.deadline.chunk_budget = std::chrono::seconds(1);
+  CTCPrefixBeamSearchDecoder relaxed(vocabulary_size, options);
+  auto stats = relaxed.ProcessChunk(log_probs.data(), frames);
+  CHECK_FALSE(stats.IsDegraded());
+  CHECK(stats.min_beam_size == 8);
+  CHECK(relaxed.GetBest().labels == reference.GetBest().labels);
+
+  options.deadline.chunk_budget = std::chrono::microseconds(frames);
+  CTCPrefixBeamSearchDecoder tight(vocabulary_size, options);
+  stats = tight.ProcessChunk(log_probs.data(), frames);
+  CHECK(stats.IsDegraded());
+  CHECK(stats.degraded_frames > 0);
+  CHECK(stats.min_beam_size == 1);
+  CHECK(stats.elapsed.count() > 0);
+  CHECK(tight.GetBeams().size() >= 1);
+}
+
+TEST_CASE("CTC prefix beam search decoder hybrid mode test") {
+  const size_t frames = 300;
+  const size_t vocabulary_size = 6;
+  auto log_probs = RandomLogProbs(frames, vocabulary_size, 4, 5.0f);
+  CTCDecoderOptions options;
+  options.beam_size = 8;
+  CTCPrefixBeamSearchDecoder beam(vocabulary_size, options);
+  beam.ProcessChunk(log_probs.data(), frames);
+
+  // Margin that no frame reaches does not change the search
+  options.hybrid_margin = 100.0f;
+  CTCPrefixBeamSearchDecoder never(vocabulary_size, options);
+  auto stats = never.ProcessChunk(log_probs.data(), frames);
+  CHECK(stats.greedy_frames == 0);
+  CHECK(never.GetBest().labels == beam.GetBest().labels);
+
+  options.hybrid_margin = 3.0f;
+  CTCPrefixBeamSearchDecoder hybrid(vocabulary_size, options);
+  stats = hybrid.ProcessChunk(log_probs.data(), frames);
+  CHECK(stats.greedy_frames > frames / 2);
+  CHECK(stats.greedy_frames < frames);
+  CHECK_FALSE(stats.IsDegraded());
+  CHECK(hybrid.GetBest().labels == beam.GetBest().labels);
+}
+
+TEST_CASE("CTC prefix beam search decoder ensemble test") {
+  const size_t frames = 400;
+  const size_t vocabulary_size = 8;
+  auto first = RandomLogProbs(frames, vocabulary_size, 5, 5.0f);
+  auto second = RandomLogProbs(frames, vocabulary_size, 6, 5.0f);
+  const float *streams[] = {first.data(), second.data()};
+  const float weights[] = {0.3f, 0.7f};
+  std::vector<float> fused(frames * vocabulary_size);
+  for (size_t i = 0; i < fused.size(); ++i) {
+    fused[i] = weights[0] * first[i] + weights[1] * second[i];
+  }
+
+  auto check_same = [](CTCPrefixBeamSearchDecoder &lhs, CTCPrefixBeamSearchDecoder &rhs) {
+    auto lhs_nbest = lhs.GetNBest(8);
+    auto rhs_nbest = rhs.GetNBest(8);
+    REQUIRE(lhs_nbest.size() == rhs_nbest.size());
+    for (size_t i = 0; i < lhs_nbest.size(); ++i) {
+      CHECK(lhs_nbest[i].labels == rhs_nbest[i].labels);
+      CHECK(lhs_nbest[i].score == rhs_nbest[i].score);
+    }
+  };
+
+  // Fusion of all the labels matches decoding of the fused matrix
+  CTCDecoderOptions options;
+  options.beam_size = 6;
+  options.hybrid_margin = 3.0f;
+  CTCPrefixBeamSearchDecoder ensemble(vocabulary_size, options);
+  CTCPrefixBeamSearchDecoder reference(vocabulary_size, options);
+  for (size_t t = 0; t < frames; t += 100) {
+    auto stats = ensemble.ProcessEnsembleChunk(streams, weights, 2, 100);
+    CHECK(stats.fused_labels == 100 * vocabulary_size);
+    for (auto &stream: streams) {
+      stream += 100 * vocabulary_size;
+    }
+    reference.ProcessChunk(fused.data() + t * vocabulary_size, 100);
+  }
+  check_same(ensemble, reference);
+
+  // With top-k pre-pruning of identical models only a part of the labels is fused
+  options.top_k = 3;
+  const float *same[] = {first.data(), first.data()};
+  const float halves[] = {0.5f, 0.5f};
+  CTCPrefixBeamSearchDecoder pruned(vocabulary_size, options);
+  CTCPrefixBeamSearchDecoder single(vocabulary_size, options);
+  auto stats = pruned.ProcessEnsembleChunk(same, halves, 2, frames);
+  single.ProcessChunk(first.data(), frames);
+  CHECK(stats.fused_labels < frames * vocabulary_size * 3 / 4);
+  check_same(pruned, single);
+}
+
+TEST_CASE("ArgMax test") {
+  std::mt19937 generator(7);
+  for (LabelType size = 1; size < 70; ++size) {
+    for (int attempt = 0; attempt < 20; ++attempt) {
+      // Few distinct values produce ties
+      std::vector<float> values(size);
+      for (auto &value: values) {
+        value = static_cast<float>(generator() % 5);
+      }
+      auto expected = std::max_element(values.begin(), values.end()) - values.begin();
+      CHECK(beam_search::ArgMax(values.data(), size) == expected);
+    }
+  }
+}
+
+TEST_CASE("TopTwoMargin test") {
+  std::vector<float> values = {1.0f, 5.0f, 3.0f, 5.0f, -1.0f, 2.0f, 0.0f, 4.5f, 1.0f, 2.0f};
+  LabelType first;
+  CHECK(beam_search::TopTwoMargin(values.data(), static_cast<LabelType>(values.size()), &first) == 0.0f);
+  CHECK(first == 1);
+  values[3] = 0.0f;
+  CHECK(beam_search::TopTwoMargin(values.data(), static_cast<LabelType>(values.size()), &first) == 0.5f);
+  CHECK(beam_search::TopTwoMargin(values.data() + 2, 1, &first) == std::numeric_limits<float>::infinity());
+  CHECK(first == 0);
+}
@@ -0,0 +1,35 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "ctc_greedy_decoder.h"
+
+#include <catch2/catch.hpp>
+
+#include <vector>
+
+using beam_search::CTCGreedyDecoder;
+using beam_search::LabelType;
+
+TEST_CASE("CTC greedy decoder test") {
+  const LabelType vocabulary_size = 4;
+  // Best path: 1 1 0 1 2 2 3 0
+  std::vector<LabelType> path = {1, 1, 0, 1, 2, 2, 3, 0};
+  std::vector<float> log_probs(path.size() * vocabulary_size, -3.0f);
+  float expected_score = 0.0f;
+  for (size_t t = 0; t < path.size(); ++t) {
+    log_probs[t * vocabulary_size + path[t]] = -0.5f;
+    expected_score += -0.5f;
+  }
+  CTCGreedyDecoder decoder(vocabulary_size);
+  decoder.ProcessChunk(log_probs.data(), 3);
+  CHECK(decoder.GetBest().labels == std::vector<LabelType>({1}));
+  decoder.ProcessChunk(log_probs.data() + 3 * vocabulary_size, 5);
+  auto best = decoder.GetBest();
+  CHECK(best.labels == std::vector<LabelType>({1, 1, 2, 3}));
+  CHECK(best.score == Approx(expected_score));
+  CHECK(decoder.GetNBest(5).size() == 1);
+  CHECK(decoder.GetNBest(5, beam_search::FinalScoringOptions()).size() == 1);
+
+  decoder.Reset();
+  decoder.ProcessChunk(log_probs.data() + 4 * vocabulary_size, 4);
+  CHECK(decoder.GetBest().labels == std::vector<LabelType>({2, 3}));
+}
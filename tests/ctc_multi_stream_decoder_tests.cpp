@@ -0,0 +1,157 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "ctc_multi_stream_decoder.h"
+
+#include <catch2/catch.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using beam_search::ChunkStats;
+using beam_search::CTCDecoderBatch;
+using beam_search::CTCDecoderOptions;
+using beam_search::CTCMultiStreamDecoder;
+using beam_search::CTCPrefixBeamSearchDecoder;
+using beam_search::IndexType;
+using beam_search::LabelType;
+
+TEST_CASE("CTC multi-stream decoder test") {
+  const size_t frames = 200;
+  const LabelType vocabulary_size = 6;
+  const IndexType streams = 3;
+  std::mt19937 generator(13);
+  std::uniform_real_distribution<float> distribution(0.0f, 4.0f);
+  std::vector<std::vector<float>> log_probs(streams, std::vector<float>(frames * vocabulary_size));
+  for (auto &stream: log_probs) {
+    for (size_t t = 0; t < frames; ++t) {
+      float normalizer = 0.0f;
+      for (LabelType label = 0; label < vocabulary_size; ++label) {
+        stream[t * vocabulary_size + label] = distribution(generator) + (label == 0 ? 3.0f : 0.0f);
+        normalizer += std::exp(stream[t * vocabulary_size + label]);
+      }
+      for (LabelType label = 0; label < vocabulary_size; ++label) {
+        stream[t * vocabulary_size + label] -= std::log(normalizer);
+      }
+    }
+  }
+  // Bigram LM, the state is the previous label
+  std::vector<float> bigram(vocabulary_size * vocabulary_size);
+  for (auto &score: bigram) {
+    score = -distribution(generator);
+  }
+  size_t calls = 0;
+  auto scorer = [&bigram, &calls, vocabulary_size](IndexType state, LabelType label, IndexType *next_state) {
+    ++calls;
+    *next_state = label;
+    return bigram[state * vocabulary_size + label];
+  };
+
+  CTCDecoderOptions options;
+  options.beam_size = 6;
+  options.top_k = 4;
+  options.lm_weight = 0.6f;
+  options.insertion_bonus = 0.5f;
+  options.blank_skip_threshold = -0.05f;
+  CTCMultiStreamDecoder decoder(vocabulary_size, options, streams, scorer);
+  std::vector<const float *> chunk(streams);
+  for (size_t t = 0; t < frames; t += 40) {
+    for (IndexType stream = 0; stream < streams; ++stream) {
+      chunk[stream] = log_probs[stream].data() + t * vocabulary_size;
+    }
+    auto &stats = decoder.ProcessChunk(chunk.data(), 40);
+    REQUIRE(stats.size() == streams);
+  }
+  // Identical LM contexts of the streams are scored once
+  CHECK(calls == decoder.GetLMCalls());
+  CHECK(decoder.GetLMCalls() < decoder.GetLMQueries());
+
+  // Every stream matches a separate decoder
+  size_t separate_calls = 0;
+  for (IndexType stream = 0; stream < streams; ++stream) {
+    CTCPrefixBeamSearchDecoder single(vocabulary_size, options);
+    single.SetLabelScorer(scorer);
+    calls = 0;
+    single.ProcessChunk(log_probs[stream].data(), frames);
+    separate_calls += calls;
+    auto expected = single.GetNBest(6);
+    auto nbest = decoder.GetNBest(stream, 6);
+    REQUIRE(nbest.size() == expected.size());
+    for (size_t i = 0; i < nbest.size(); ++i) {
+      CHECK(nbest[i].labels == expected[i].labels);
+      CHECK(nbest[i].score == expected[i].score);
+    }
+  }
+  CHECK(separate_calls == decoder.GetLMQueries());
+
+  decoder.Reset(1);
+  CHECK(decoder.GetBest(1).labels.empty());
+  CHECK(!decoder.GetBest(0).labels.empty());
+}
+
+TEST_CASE("CTC decoder batch test") {
+  // Decoders with their own vocabularies, options, scorers and chunk lengths
+  const std::vector<LabelType> vocabulary_sizes = {5, 7, 9};
+  const std::vector<IndexType> beam_sizes = {3, 5, 8};
+  const size_t frames = 120;
+  std::mt19937 generator(29);
+  std::uniform_real_distribution<float> distribution(0.0f, 4.0f);
+  std::vector<std::vector<float>> log_probs;
+  for (auto vocabulary_size: vocabulary_sizes) {
+    log_probs.emplace_back(frames * vocabulary_size);
+    for (auto &value: log_probs.back()) {
+      value = -distribution(generator);
+    }
+  }
+  auto scorer = [](IndexType state, LabelType label, IndexType *next_state) {
+    *next_state = label;
+    return state == label ? -2.0f : -0.5f;
+  };
+  std::vector<CTCPrefixBeamSearchDecoder> batched;
+  std::vector<CTCPrefixBeamSearchDecoder> separate;
+  for (size_t i = 0; i < vocabulary_sizes.size(); ++i) {
+    CTCDecoderOptions options;
+    options.beam_size = beam_sizes[i];
+    options.top_k = 4;
+    options.lm_weight = i == 1 ? 0.5f : 0.0f;
+    batched.emplace_back(vocabulary_sizes[i], options);
+    separate.emplace_back(vocabulary_sizes[i], options);
+    if (i == 1) {
+      batched.back().SetLabelScorer(scorer);
+      separate.back().SetLabelScorer(scorer);
+    }
+  }
+
+  CTCDecoderBatch batch;
+  std::vector<CTCPrefixBeamSearchDecoder *> decoders;
+  for (auto &decoder: batched) {
+    decoders.push_back(&decoder);
+  }
+  std::vector<size_t> positions(batched.size(), 0);
+  std::vector<const float *> chunks(batched.size());
+  std::vector<IndexType> lengths(batched.size());
+  std::vector<ChunkStats> stats(batched.size());
+  while (positions[0] < frames || positions[1] < frames || positions[2] < frames) {
+    for (size_t i = 0; i < batched.size(); ++i) {
+      lengths[i] = static_cast<IndexType>(std::min<size_t>(generator() % 20, frames - positions[i]));
+      chunks[i] = log_probs[i].data() + positions[i] * vocabulary_sizes[i];
+      separate[i].ProcessChunk(chunks[i], lengths[i]);
+      positions[i] += lengths[i];
+    }
+    batch.ProcessChunks(decoders.data(), chunks.data(), lengths.data(), decoders.size(), stats.data());
+    for (size_t i = 0; i < batched.size(); ++i) {
+      CHECK(stats[i].frames == lengths[i]);
+      CHECK(stats[i].min_beam_size == beam_sizes[i]);
+    }
+  }
+  for (size_t i = 0; i < batched.size(); ++i) {
+    auto expected = separate[i].GetNBest(4);
+    auto nbest = batched[i].GetNBest(4);
+    REQUIRE(nbest.size() == expected.size());
+    for (size_t j = 0; j < nbest.size(); ++j) {
+      CHECK(nbest[j].labels == expected[j].labels);
+      CHECK(nbest[j].score == expected[j].score);
+    }
+  }
+}
@@ -0,0 +1,117 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "ctc_prefix_scorer.h"
+
+#include <catch2/catch.hpp>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+using beam_search::CTCPrefixScorer;
+using beam_search::IndexType;
+using beam_search::LabelType;
+
+namespace {
+
+/**
+ * Probabilities of label sequences starting with the prefix and equal to it, by enumeration of all alignments
+ */
+void ExactScores(const std::vector<float> &log_probs, size_t frames, size_t vocabulary_size,
+                 const std::vector<LabelType> &prefix, double *starts_with, double *equals) {
+  *starts_with = 0.0;
+  *equals = 0.0;
+  std::vector<LabelType> alignment(frames, 0);
+  while (true) {
+    double probability = 1.0;
+    std::vector<LabelType> labels;
+    for (size_t t = 0; t < frames; ++t) {
+      probability *= std::exp(static_cast<double>(log_probs[t * vocabulary_size + alignment[t]]));
+      if (alignment[t] != 0 && (t == 0 || alignment[t] != alignment[t - 1])) {
+        labels.push_back(alignment[t]);
+      }
+    }
+    if (labels.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), labels.begin())) {
+      *starts_with += probability;
+      if (labels.size() == prefix.size()) {
+        *equals += probability;
+      }
+    }
+    size_t t = 0;
+    for (; t < frames && ++alignment[t] == vocabulary_size; ++t) {
+      alignment[t] = 0;
+    }
+    if (t == frames) {
+      break;
+    }
+  }
+}
+
+/**
+ * Random log-probabilities normalized in every frame, the rare label is about 150 nats below the others
+ */
+std::vector<float> RandomLogProbs(size_t frames, size_t vocabulary_size, unsigned seed,
+                                  LabelType rare_label = beam_search::kNoLabel) {
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> distribution(0.0f, 3.0f);
+  std::vector<float> log_probs(frames * vocabulary_size);
+  for (size_t t = 0; t < frames; ++t) {
+    float normalizer = 0.0f;
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      log_probs[t * vocabulary_size + label] = distribution(generator) - (label == rare_label ? 150.0f : 0.0f);
+      normalizer += std::exp(log_probs[t * vocabulary_size + label]);
+    }
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      log_probs[t * vocabulary_size + label] -= std::log(normalizer);
+    }
+  }
+  return log_probs;
+}
+
+/**
+ * Compares the scorer against enumeration breadth-first over prefixes up to length 3
+ * @param margin absolute tolerance in addition to the relative one, for scores close to zero
+ */
+void CheckScorer(const std::vector<float> &log_probs, size_t frames, size_t vocabulary_size, double margin = 0.0) {
+  CTCPrefixScorer scorer(vocabulary_size, 0, 64);
+  auto root = scorer.Reset(log_probs.data(), frames);
+  std::vector<std::pair<IndexType, std::vector<LabelType>>> prefixes = {{root, {}}};
+  std::vector<float> scores(vocabulary_size);
+  for (size_t i = 0; i < prefixes.size(); ++i) {
+    auto prefix = prefixes[i];
+    scorer.ScoreExtensions(prefix.first, scores.data());
+    double starts_with, equals;
+    ExactScores(log_probs, frames, vocabulary_size, prefix.second, &starts_with, &equals);
+    CHECK(scores[0] == Approx(std::log(equals)).epsilon(1e-4).margin(margin));
+    for (LabelType label = 1; label < vocabulary_size; ++label) {
+      auto extended = prefix.second;
+      extended.push_back(label);
+      ExactScores(log_probs, frames, vocabulary_size, extended, &starts_with, &equals);
+      CHECK(scores[label] == Approx(std::log(starts_with)).epsilon(1e-4).margin(margin));
+      if (extended.size() <= 3) {
+        auto child = scorer.Extend(prefix.first, label);
+        REQUIRE(child != beam_search::kNoIndex);
+        CHECK(scorer.GetPrefixScore(child) == Approx(scores[label]).epsilon(1e-4));
+        prefixes.emplace_back(child, extended);
+      }
+    }
+  }
+  // Extension requested again is found in the tree
+  CHECK(scorer.Extend(prefixes[0].first, 1) == prefixes[1].first);
+  CHECK_THROWS(scorer.Extend(root, 0));
+}
+
+} // namespace
+
+TEST_CASE("CTC prefix scorer test") {
+  const size_t frames = 6;
+  const size_t vocabulary_size = 3;
+  CheckScorer(RandomLogProbs(frames, vocabulary_size, 11), frames, vocabulary_size);
+}
+
+TEST_CASE("CTC prefix scorer small probabilities test") {
+  // Log-probabilities of label 2 around -150 underflow in float probability domain
+  const size_t frames = 6;
+  const size_t vocabulary_size = 3;
+  CheckScorer(RandomLogProbs(frames, vocabulary_size, 11, 2), frames, vocabulary_size, 1e-5);
+}
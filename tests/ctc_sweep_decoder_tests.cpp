@@ -0,0 +1,82 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "ctc_sweep_decoder.h"
+
+#include <catch2/catch.hpp>
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+using beam_search::CTCDecoderOptions;
+using beam_search::CTCPrefixBeamSearchDecoder;
+using beam_search::CTCSweepDecoder;
+using beam_search::IndexType;
+using beam_search::LabelType;
+using beam_search::SweepConfig;
+
+TEST_CASE("CTC sweep decoder test") {
+  const size_t frames = 300;
+  const LabelType vocabulary_size = 6;
+  std::mt19937 generator(11);
+  std::uniform_real_distribution<float> distribution(0.0f, 4.0f);
+  std::vector<float> log_probs(frames * vocabulary_size);
+  for (size_t t = 0; t < frames; ++t) {
+    float normalizer = 0.0f;
+    for (LabelType label = 0; label < vocabulary_size; ++label) {
+      log_probs[t * vocabulary_size + label] = distribution(generator) + (label == 0 ? 3.0f : 0.0f);
+      normalizer += std::exp(log_probs[t * vocabulary_size + label]);
+    }
+    for (LabelType label = 0; label < vocabulary_size; ++label) {
+      log_probs[t * vocabulary_size + label] -= std::log(normalizer);
+    }
+  }
+  std::vector<float> bigram(vocabulary_size * vocabulary_size);
+  for (auto &score: bigram) {
+    score = -distribution(generator);
+  }
+  auto scorer = [&bigram, vocabulary_size](IndexType state, LabelType label, IndexType *next_state) {
+    *next_state = label;
+    return bigram[state * vocabulary_size + label];
+  };
+
+  CTCDecoderOptions options;
+  options.beam_size = 6;
+  options.top_k = 4;
+  options.hybrid_margin = 4.0f;
+  std::vector<SweepConfig> configs = {{0.0f, 0.0f}, {0.5f, 0.0f}, {0.5f, 1.0f}, {1.5f, -0.5f}, {0.8f, 0.3f}};
+  CTCSweepDecoder sweep(vocabulary_size, options, configs, 2, scorer);
+  for (int utterance = 0; utterance < 2; ++utterance) {
+    sweep.Reset();
+    for (size_t t = 0; t < frames; t += 50) {
+      auto &stats = sweep.ProcessChunk(log_probs.data() + t * vocabulary_size, 50);
+      REQUIRE(stats.size() == configs.size());
+      CHECK(stats[0].frames == 50);
+    }
+  }
+
+  // Every configuration matches a separate decoder
+  for (size_t config = 0; config < configs.size(); ++config) {
+    auto config_options = options;
+    config_options.lm_weight = configs[config].lm_weight;
+    config_options.insertion_bonus = configs[config].insertion_bonus;
+    CTCPrefixBeamSearchDecoder decoder(vocabulary_size, config_options);
+    decoder.SetLabelScorer(scorer);
+    decoder.ProcessChunk(log_probs.data(), frames);
+    auto expected = decoder.GetNBest(6);
+    auto nbest = sweep.GetNBest(config, 6);
+    REQUIRE(nbest.size() == expected.size());
+    for (size_t i = 0; i < nbest.size(); ++i) {
+      CHECK(nbest[i].labels == expected[i].labels);
+      CHECK(nbest[i].score == expected[i].score);
+    }
+    CHECK(sweep.GetBest(config).labels == decoder.GetBest().labels);
+  }
+  // Insertion bonus changes the length of the result
+  CHECK(sweep.GetBest(2).labels.size() >= sweep.GetBest(1).labels.size());
+  CHECK_THROWS([&] {
+    auto deadline = options;
+    deadline.deadline.chunk_budget = std::chrono::milliseconds(1);
+    CTCSweepDecoder invalid(vocabulary_size, deadline, configs);
+  }());
+}
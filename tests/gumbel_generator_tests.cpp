@@ -0,0 +1,67 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "gumbel_generator.h"
+
+#include <catch2/catch.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+using beam_search::FastLog;
+using beam_search::GumbelGenerator;
+
+TEST_CASE("Fast log test") {
+  for (float x = 1e-30f; x < 1e30f; x *= 1.37f) {
+    CHECK(FastLog(x) == Approx(std::log(x)).epsilon(1e-6).margin(1e-7));
+  }
+  for (float x = 0.99f; x < 1.01f; x += 1e-5f) {
+    CHECK(FastLog(x) == Approx(std::log(x)).margin(1e-7));
+  }
+  CHECK(FastLog(1.0f) == 0.0f);
+}
+
+TEST_CASE("Gumbel generator test") {
+  const size_t count = 1000000;
+  GumbelGenerator generator(7);
+  std::vector<float> noise(count);
+  generator.Generate(noise.data(), count);
+  double sum = 0.0;
+  double squares = 0.0;
+  size_t finite = 0;
+  for (auto value: noise) {
+    finite += std::isfinite(value) ? 1 : 0;
+    sum += value;
+    squares += value * value;
+  }
+  REQUIRE(finite == count);
+  auto mean = sum / count;
+  // Mean is the Euler-Mascheroni constant, variance is pi^2 / 6
+  CHECK(mean == Approx(0.5772).margin(0.01));
+  CHECK(squares / count - mean * mean == Approx(1.6449).margin(0.03));
+
+  // The stream does not depend on the batch sizes
+  generator.Seed(7);
+  std::vector<float> batches(10);
+  generator.Generate(batches.data(), 3);
+  generator.Generate(batches.data() + 3, 7);
+  for (size_t i = 0; i < batches.size(); ++i) {
+    CHECK(batches[i] == noise[i]);
+  }
+  GumbelGenerator other(8);
+  CHECK(other.Next() != noise[0]);
+}
+
+TEST_CASE("Gumbel generator extreme hashes test") {
+  // The largest hash gives the largest noise, not a value flipped to the lower tail
+  CHECK(GumbelGenerator::ToUniform(0xffffffffu) < 1.0f);
+  CHECK(GumbelGenerator::ToUniform(0u) > 0.0f);
+  auto largest = GumbelGenerator::ToGumbel(0xffffffffu);
+  auto smallest = GumbelGenerator::ToGumbel(0u);
+  CHECK(largest == Approx(-std::log(-std::log1p(-0.5 / 8388608.0))).epsilon(1e-4));
+  CHECK(smallest == Approx(-std::log(-std::log(0.5 / 8388608.0))).epsilon(1e-4));
+  for (std::uint32_t hash = 0xffffffffu; hash > 0xfffff000u; hash -= 0x100u) {
+    CHECK(GumbelGenerator::ToGumbel(hash) <= largest);
+    CHECK(GumbelGenerator::ToGumbel(hash) > 10.0f);
+  }
+}
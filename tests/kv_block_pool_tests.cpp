@@ -0,0 +1,44 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "kv_block_pool.h"
+
+#include <catch2/catch.hpp>
+
+using beam_search::IndexType;
+using beam_search::KVBlockPool;
+
+TEST_CASE("KV block pool test") {
+  KVBlockPool pool(3, 4, 2);
+  IndexType offset;
+  auto first = pool.AppendToken(beam_search::kNoIndex, 0, &offset);
+  CHECK(offset == 0);
+  pool.GetData(first)[0] = 1.0f;
+  // The only continuation is appended in place
+  CHECK(pool.AppendToken(first, 1, &offset) == first);
+  CHECK(offset == 1);
+  pool.GetData(first)[2] = 2.0f;
+  CHECK(pool.GetReferenceCount(first) == 2);
+  CHECK(pool.GetUsed(first) == 2);
+
+  // Another continuation of the first token copies the written prefix
+  auto copy = pool.AppendToken(first, 1, &offset);
+  CHECK(copy != first);
+  CHECK(offset == 1);
+  CHECK(pool.GetData(copy)[0] == 1.0f);
+  CHECK(pool.GetUsed(copy) == 2);
+  CHECK(pool.GetFreeBlocks() == 1);
+
+  auto last = pool.Allocate();
+  CHECK(pool.Allocate() == beam_search::kNoIndex);
+  CHECK(pool.AppendToken(copy, 4, &offset) == beam_search::kNoIndex);
+  pool.Release(last);
+  pool.Release(copy);
+  // Released last token frees its position for an in-place append
+  pool.ReleaseToken(first, 1);
+  CHECK(pool.GetFreeBlocks() == 2);
+  CHECK(pool.AppendToken(first, 1, &offset) == first);
+  pool.Release(first);
+  pool.Release(first);
+  CHECK(pool.GetFreeBlocks() == 3);
+  CHECK_THROWS(pool.Release(first));
+}
@@ -0,0 +1,100 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "label_dfa.h"
+
+#include <catch2/catch.hpp>
+
+using beam_search::CircularArrayCTCBeamSearchTree;
+using beam_search::IndexType;
+using beam_search::LabelDFA;
+using beam_search::LabelType;
+using beam_search::kNoIndex;
+
+namespace {
+
+/**
+ * Labels: 0 is blank, digits are 1..10, '-' is 11, '+' is 12
+ */
+std::unordered_map<char, LabelType> PhoneSymbols() {
+  std::unordered_map<char, LabelType> symbols;
+  for (char digit = '0'; digit <= '9'; ++digit) {
+    symbols[digit] = static_cast<LabelType>(digit - '0' + 1);
+  }
+  symbols['-'] = 11;
+  symbols['+'] = 12;
+  return symbols;
+}
+
+bool Matches(const LabelDFA &dfa, const std::string &text) {
+  auto symbols = PhoneSymbols();
+  IndexType state = LabelDFA::kStart;
+  for (auto symbol: text) {
+    state = dfa.Next(state, symbols[symbol]);
+    if (state == kNoIndex) {
+      return false;
+    }
+  }
+  return dfa.IsAccepting(state);
+}
+
+struct ConstrainedBeamEntry {
+  IndexType dfa_state = LabelDFA::kStart;
+};
+
+} // namespace
+
+TEST_CASE("Label DFA test") {
+  LabelDFA dfa("\\+?[0-9]{3}-[0-9]{2,3}(-[0-9]+)*", PhoneSymbols(), 13);
+  CHECK(Matches(dfa, "123-45"));
+  CHECK(Matches(dfa, "+123-456"));
+  CHECK(Matches(dfa, "123-456-7-89"));
+  CHECK_FALSE(Matches(dfa, "123-4567"));
+  CHECK_FALSE(Matches(dfa, "12-345"));
+  CHECK_FALSE(Matches(dfa, "123-"));
+  CHECK_FALSE(Matches(dfa, "123-456-"));
+
+  // Blank and labels that can not lead to a match are rejected right away
+  CHECK(dfa.Next(LabelDFA::kStart, 0) == kNoIndex);
+  CHECK(dfa.Next(LabelDFA::kStart, 11) == kNoIndex);
+
+  LabelDFA alternation("(1|23)*[^0-9+]", PhoneSymbols(), 13);
+  CHECK(Matches(alternation, "1231-"));
+  CHECK_FALSE(Matches(alternation, "13-"));
+  CHECK(alternation.Next(LabelDFA::kStart, 0) != kNoIndex);
+
+  LabelDFA empty("1{0}", PhoneSymbols(), 13);
+  CHECK(empty.IsAccepting(LabelDFA::kStart));
+  CHECK(empty.Next(LabelDFA::kStart, 2) == kNoIndex);
+
+  CHECK_THROWS(LabelDFA("(12", PhoneSymbols(), 13));
+  CHECK_THROWS(LabelDFA("12)", PhoneSymbols(), 13));
+  CHECK_THROWS(LabelDFA("a", PhoneSymbols(), 13));
+  CHECK_THROWS(LabelDFA("1{3,2}", PhoneSymbols(), 13));
+  CHECK_THROWS(LabelDFA("*1", PhoneSymbols(), 13));
+}
+
+TEST_CASE("Label DFA constrained expansion test") {
+  LabelDFA dfa("[0-9]{2}", PhoneSymbols(), 13);
+  CircularArrayCTCBeamSearchTree<ConstrainedBeamEntry> tree(16);
+  auto root = tree.InitializeTree();
+  bool created;
+
+  std::vector<IndexType> children;
+  for (LabelType label = 1; label < 13; ++label) {
+    auto state = dfa.Next(tree.GetEntry(root).dfa_state, label);
+    if (state == kNoIndex) {
+      continue;
+    }
+    auto child = tree.GetChild(root, label, &created);
+    tree.GetEntry(child).dfa_state = state;
+    children.push_back(child);
+  }
+  CHECK(children.size() == 10);
+
+  auto state = tree.GetEntry(children[0]).dfa_state;
+  CHECK_FALSE(dfa.IsAccepting(state));
+  CHECK(dfa.Next(state, 11) == kNoIndex);
+  CHECK(dfa.Next(state, 3) != kNoIndex);
+  CHECK(dfa.IsAccepting(dfa.Next(state, 3)));
+  CHECK(dfa.Next(dfa.Next(state, 3), 3) == kNoIndex);
+}
@@ -0,0 +1,156 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "lm_lookahead.h"
+
+#include <cmath>
+#include <functional>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include "ctc_decoder.h"
+
+using beam_search::CTCDecoderOptions;
+using beam_search::CTCPrefixBeamSearchDecoder;
+using beam_search::LabelType;
+using beam_search::LexiconLookahead;
+using beam_search::LexiconLookaheadScorer;
+using beam_search::kNoIndex;
+using beam_search::kNoWord;
+
+TEST_CASE("Lexicon lookahead test") {
+  /**
+   * Words over labels {a = 0, b = 1, c = 2}
+   *   0: ab   -1
+   *   1: abc  -3
+   *   2: ac   -2
+   *   3: b    -5
+   */
+  LexiconLookahead lexicon({{0, 1}, {0, 1, 2}, {0, 2}, {1}}, {-1.0f, -3.0f, -2.0f, -5.0f});
+  CHECK(lexicon.GetSize() == 6);
+
+  auto a = lexicon.GetChild(LexiconLookahead::kRoot, 0);
+  auto ab = lexicon.GetChild(a, 1);
+  auto abc = lexicon.GetChild(ab, 2);
+  auto ac = lexicon.GetChild(a, 2);
+  auto b = lexicon.GetChild(LexiconLookahead::kRoot, 1);
+  CHECK(lexicon.GetChild(LexiconLookahead::kRoot, 2) == kNoIndex);
+  CHECK(lexicon.GetChild(abc, 0) == kNoIndex);
+
+  CHECK(lexicon.GetWord(a) == kNoWord);
+  CHECK(lexicon.GetWord(ab) == 0);
+  CHECK(lexicon.GetWord(abc) == 1);
+  CHECK(lexicon.GetWord(b) == 3);
+
+  CHECK(lexicon.GetLookahead(LexiconLookahead::kRoot) == -1.0f);
+  CHECK(lexicon.GetLookahead(a) == -1.0f);
+  CHECK(lexicon.GetLookahead(abc) == -3.0f);
+  CHECK(lexicon.GetLookahead(ac) == -2.0f);
+  CHECK(lexicon.GetLookahead(b) == -5.0f);
+  CHECK(lexicon.GetLookaheadBonus(a, ac) == -1.0f);
+
+  /**
+   * After word "b" the word "ac" is strongly preferred, the rest is backed off
+   */
+  lexicon.SetBigrams({{3, 2, -0.5f}, {3, 1, -2.5f}}, {-1.0f, -1.0f, -1.0f, -4.0f});
+  CHECK(lexicon.GetWordScore(3, 2) == -0.5f);
+  CHECK(lexicon.GetWordScore(3, 1) == -2.5f);
+  CHECK(lexicon.GetWordScore(3, 0) == -5.0f);
+  CHECK(lexicon.GetWordScore(0, 1) == -4.0f);
+  CHECK(lexicon.GetWordScore(kNoWord, 1) == -3.0f);
+
+  CHECK(lexicon.GetLookahead(LexiconLookahead::kRoot, 3) == -0.5f);
+  CHECK(lexicon.GetLookahead(ab, 3) == -2.5f);
+  CHECK(lexicon.GetLookahead(ac, 3) == -0.5f);
+  CHECK(lexicon.GetLookahead(b, 3) == -9.0f);
+  CHECK(lexicon.GetLookahead(a, 0) == -2.0f);
+  CHECK(lexicon.GetLookahead(a, kNoWord) == -1.0f);
+}
+
+TEST_CASE("Lexicon lookahead scorer test") {
+  /**
+   * Labels {blank = 0, a = 1, b = 2, c = 3, space = 4}, the only word is "ab". The first frame slightly prefers "c",
+   * so the beam of size 1 keeps "c" and never reaches the word unless the lookahead penalizes leaving the lexicon.
+   */
+  const size_t frames = 3;
+  const size_t vocabulary_size = 5;
+  const float probs[frames][vocabulary_size] = {
+      {0.1f, 0.4f, 0.01f, 0.48f, 0.01f},
+      {0.1f, 0.01f, 0.87f, 0.01f, 0.01f},
+      {0.05f, 0.01f, 0.01f, 0.01f, 0.92f}};
+  std::vector<float> log_probs;
+  for (const auto &frame: probs) {
+    for (auto prob: frame) {
+      log_probs.push_back(std::log(prob));
+    }
+  }
+  LexiconLookahead lexicon({{1, 2}}, {-1.0f});
+  const LabelType space = 4;
+
+  CTCDecoderOptions options;
+  options.beam_size = 1;
+  CTCPrefixBeamSearchDecoder plain(vocabulary_size, options);
+  plain.ProcessChunk(log_probs.data(), frames);
+  CHECK(plain.GetBest().labels == std::vector<LabelType>{3, 2, space});
+
+  options.lm_weight = 1.0f;
+  LexiconLookaheadScorer scorer(lexicon, space, -5.0f);
+  CTCPrefixBeamSearchDecoder narrow(vocabulary_size, options);
+  narrow.SetLabelScorer(scorer.GetScorer());
+  narrow.ProcessChunk(log_probs.data(), frames);
+  auto best = narrow.GetBest();
+  CHECK(best.labels == std::vector<LabelType>{1, 2, space});
+  // The lookahead bonuses are replaced with the word score at the boundary
+  auto ctc = std::log(probs[0][1]) + std::log(probs[1][2]) + std::log(probs[2][space]);
+  CHECK(best.score == Approx(ctc - 1.0f).epsilon(1e-4));
+
+  // Words out of the lexicon get the out-of-lexicon score once
+  beam_search::IndexType state = 0;
+  float score = 0.0f;
+  for (auto label: std::vector<LabelType>{3, 2, 1, space, 1, 2, space}) {
+    score += scorer.Score(state, label, &state);
+  }
+  CHECK(score == Approx(-5.0f - 1.0f));
+}
+
+TEST_CASE("Lexicon lookahead scorer concurrency test") {
+  // Random label sequences over {a = 0, b = 1, c = 2, space = 3} scored by two threads with a shared scorer match a
+  // scorer used by a single thread, the second pass is served from the cached transitions
+  LexiconLookahead lexicon({{0, 1}, {0, 1, 2}, {0, 2}, {1}}, {-1.0f, -3.0f, -2.0f, -5.0f});
+  lexicon.SetBigrams({{3, 2, -0.5f}, {3, 1, -2.5f}}, {-1.0f, -1.0f, -1.0f, -4.0f});
+  const LabelType space = 3;
+  std::mt19937 generator(5);
+  std::vector<std::vector<LabelType>> sequences(64);
+  for (auto &sequence: sequences) {
+    for (int i = 0; i < 200; ++i) {
+      sequence.push_back(static_cast<LabelType>(generator() % 4));
+    }
+  }
+  auto score_all = [&sequences](LexiconLookaheadScorer &scorer, size_t first, size_t step, std::vector<float> *scores) {
+    for (auto i = first; i < sequences.size(); i += step) {
+      beam_search::IndexType state = 0;
+      float score = 0.0f;
+      for (auto label: sequences[i]) {
+        score += scorer.Score(state, label, &state);
+      }
+      (*scores)[i] = score;
+    }
+  };
+  LexiconLookaheadScorer reference(lexicon, space, -4.0f);
+  std::vector<float> expected(sequences.size());
+  score_all(reference, 0, 1, &expected);
+
+  LexiconLookaheadScorer shared(lexicon, space, -4.0f);
+  for (int pass = 0; pass < 2; ++pass) {
+    std::vector<float> scores(sequences.size());
+    std::thread other(score_all, std::ref(shared), 1, 2, &scores);
+    score_all(shared, 0, 2, &scores);
+    other.join();
+    for (size_t i = 0; i < sequences.size(); ++i) {
+      CHECK(scores[i] == expected[i]);
+    }
+  }
+  CHECK(shared.GetStates() == reference.GetStates());
+}
@@ -0,0 +1,103 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "mbr.h"
+
+#include <catch2/catch.hpp>
+
+#include <random>
+
+using beam_search::CircularArrayCTCBeamSearchTree;
+using beam_search::IndexType;
+using beam_search::LabelType;
+using beam_search::MinimumBayesRisk;
+
+namespace {
+
+struct EmptyBeamEntry {};
+
+size_t EditDistance(const std::vector<LabelType> &first, const std::vector<LabelType> &second) {
+  std::vector<size_t> row(second.size() + 1);
+  for (size_t j = 0; j <= second.size(); ++j) {
+    row[j] = j;
+  }
+  for (size_t i = 1; i <= first.size(); ++i) {
+    auto diagonal = row[0];
+    row[0] = i;
+    for (size_t j = 1; j <= second.size(); ++j) {
+      auto up = row[j];
+      row[j] = std::min({row[j] + 1, row[j - 1] + 1, diagonal + (first[i - 1] != second[j - 1])});
+      diagonal = up;
+    }
+  }
+  return row.back();
+}
+
+} // namespace
+
+TEST_CASE("Minimum Bayes risk test") {
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> tree(1024);
+  auto root = tree.InitializeTree();
+  std::mt19937 generator(3);
+  bool created;
+
+  // Common prefix followed by random branches of different lengths
+  auto prefix = root;
+  for (LabelType label = 0; label < 5; ++label) {
+    prefix = tree.GetChild(prefix, label, &created);
+  }
+  std::vector<IndexType> hypotheses;
+  std::vector<float> posteriors;
+  for (int i = 0; i < 12; ++i) {
+    auto index = i < 4 ? prefix : hypotheses[generator() % hypotheses.size()];
+    auto length = generator() % 6;
+    for (size_t j = 0; j < length; ++j) {
+      index = tree.GetChild(index, static_cast<LabelType>(generator() % 3), &created);
+    }
+    hypotheses.push_back(index);
+    posteriors.push_back(static_cast<float>(generator() % 10 + 1) / 10.0f);
+  }
+
+  std::vector<float> expected(hypotheses.size(), 0.0f);
+  for (size_t i = 0; i < hypotheses.size(); ++i) {
+    for (size_t j = 0; j < hypotheses.size(); ++j) {
+      expected[i] += posteriors[j] * static_cast<float>(EditDistance(tree.BacktraceString(hypotheses[i]),
+                                                                     tree.BacktraceString(hypotheses[j])));
+    }
+  }
+
+  MinimumBayesRisk mbr;
+  auto result = mbr.Select(tree, hypotheses, posteriors);
+  for (size_t i = 0; i < hypotheses.size(); ++i) {
+    CHECK(result.risks[i] == Approx(expected[i]));
+  }
+  CHECK(result.best == static_cast<size_t>(std::min_element(expected.begin(), expected.end()) - expected.begin()));
+
+  // Banded distances are exact up to the band and bounded from below by band + 1 otherwise
+  MinimumBayesRisk banded(2);
+  auto banded_result = banded.Select(tree, hypotheses, {1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+                                                        0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f});
+  auto reference = tree.BacktraceString(hypotheses[0]);
+  for (size_t i = 0; i < hypotheses.size(); ++i) {
+    auto distance = EditDistance(tree.BacktraceString(hypotheses[i]), reference);
+    if (distance <= 2) {
+      CHECK(banded_result.risks[i] == Approx(static_cast<float>(distance)));
+    } else {
+      CHECK(banded_result.risks[i] >= 3.0f);
+      CHECK(banded_result.risks[i] <= static_cast<float>(distance));
+    }
+  }
+
+  /**
+   * Single dominating hypothesis in the middle of two others
+   *   prefix -> 7 -> 7 -> 7
+   *   prefix -> 7 -> 8
+   *   prefix -> 7 -> 7 -> 8
+   */
+  auto a = tree.GetChild(prefix, 7, &created);
+  auto aa = tree.GetChild(a, 7, &created);
+  auto aaa = tree.GetChild(aa, 7, &created);
+  auto ab = tree.GetChild(a, 8, &created);
+  auto aab = tree.GetChild(aa, 8, &created);
+  auto choice = mbr.Select(tree, {aaa, ab, aab}, {0.4f, 0.3f, 0.3f});
+  CHECK(choice.best == 2);
+}
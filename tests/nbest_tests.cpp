@@ -0,0 +1,59 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "nbest.h"
+
+#include <catch2/catch.hpp>
+
+using beam_search::CircularArrayCTCBeamSearchTree;
+using beam_search::FinalScoringOptions;
+using beam_search::IndexType;
+using beam_search::SelectNBest;
+
+struct EmptyBeamEntry {};
+
+TEST_CASE("Final n-best selection test") {
+  /**
+   * root -> (a, 1) -> (b, 2) -> (c, 3) -> (d, 4)
+   *              \
+   *               -> (e, 2)
+   */
+  CircularArrayCTCBeamSearchTree<EmptyBeamEntry> tree(16);
+  auto root = tree.InitializeTree();
+  bool created;
+  auto a = tree.GetChild(root, 0, &created);
+  auto b = tree.GetChild(a, 1, &created);
+  auto c = tree.GetChild(b, 2, &created);
+  auto d = tree.GetChild(c, 3, &created);
+  auto e = tree.GetChild(a, 4, &created);
+  CHECK(tree.GetDepth(root) == 0);
+  CHECK(tree.GetDepth(d) == 4);
+  CHECK(tree.GetDepth(e) == 2);
+  CHECK(tree.GetDepth(d) == tree.BacktraceString(d).size());
+
+  std::vector<IndexType> beams = {a, d, e, c};
+  std::vector<float> scores = {-3.0f, -4.0f, -3.0f, -6.0f};
+
+  auto raw = SelectNBest(tree, beams, scores, 2);
+  REQUIRE(raw.size() == 2);
+  CHECK(raw[0].index == a);
+  CHECK(raw[1].index == e);
+  CHECK(raw[0].posterior == Approx(0.5f));
+
+  FinalScoringOptions options;
+  options.length_penalty = 1.0f;
+  auto normalized = SelectNBest(tree, beams, scores, 3, options);
+  REQUIRE(normalized.size() == 3);
+  CHECK(normalized[0].index == d);
+  CHECK(normalized[0].score == Approx(-1.0f));
+  CHECK(normalized[1].index == e);
+  CHECK(normalized[2].index == c);
+  CHECK(normalized[0].posterior + normalized[1].posterior + normalized[2].posterior == Approx(1.0f));
+  CHECK(normalized[0].posterior / normalized[1].posterior == Approx(std::exp(0.5f)));
+
+  options.temperature = 0.5f;
+  auto sharpened = SelectNBest(tree, beams, scores, 3, options);
+  CHECK(sharpened[0].posterior / sharpened[1].posterior == Approx(std::exp(1.0f)));
+
+  CHECK(SelectNBest(tree, beams, scores, 10).size() == 4);
+  CHECK(SelectNBest(tree, beams, scores, 0).empty());
+}
@@ -0,0 +1,231 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "token_beam_search.h"
+
+#include <catch2/catch.hpp>
+
+#include <cmath>
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+using beam_search::IndexType;
+using beam_search::KVBlockPool;
+using beam_search::LabelType;
+using beam_search::TokenBeamSearch;
+using beam_search::TokenBeamSearchOptions;
+
+namespace {
+
+/**
+ * Deterministic "model": next token log-probabilities depend on the last tokens of the hypothesis
+ */
+void ModelStep(const std::vector<LabelType> &tokens, LabelType vocabulary_size, float *row) {
+  std::seed_seq seed(tokens.end() - std::min<size_t>(tokens.size(), 3), tokens.end());
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<float> distribution(-5.0f, 0.0f);
+  for (LabelType token = 0; token < vocabulary_size; ++token) {
+    row[token] = distribution(generator);
+  }
+}
+
+/**
+ * Normalized version of ModelStep for the sampling tests
+ */
+void NormalizedModelStep(const std::vector<LabelType> &tokens, LabelType vocabulary_size, float *row) {
+  ModelStep(tokens, vocabulary_size, row);
+  float sum = 0.0f;
+  for (LabelType token = 0; token < vocabulary_size; ++token) {
+    sum += std::exp(row[token]);
+  }
+  for (LabelType token = 0; token < vocabulary_size; ++token) {
+    row[token] -= std::log(sum);
+  }
+}
+
+/**
+ * Runs the search to the end with NormalizedModelStep
+ */
+void RunSearch(TokenBeamSearch *search, LabelType vocabulary_size) {
+  std::vector<float> log_probs;
+  while (!search->IsFinished()) {
+    const auto &beams = search->GetBeams();
+    log_probs.resize(beams.size() * vocabulary_size);
+    for (size_t i = 0; i < beams.size(); ++i) {
+      NormalizedModelStep(search->GetTokens(beams[i]), vocabulary_size, &log_probs[i * vocabulary_size]);
+    }
+    search->Step(log_probs.data());
+  }
+}
+
+} // namespace
+
+TEST_CASE("Token beam search KV-cache test") {
+  const LabelType vocabulary_size = 6;
+  KVBlockPool pool(256, 4, 1);
+  TokenBeamSearchOptions options;
+  options.beam_size = 4;
+  options.top_k = 3;
+  options.eos = 5;
+  options.max_length = 100;
+  // Small tree makes the shared prefix detached
+  options.tree_capacity = 64;
+  TokenBeamSearch search(&pool, vocabulary_size, options);
+
+  std::vector<float> log_probs;
+  std::vector<IndexType> table;
+  for (int step = 0; !search.IsFinished(); ++step) {
+    const auto &beams = search.GetBeams();
+    log_probs.resize(beams.size() * vocabulary_size);
+    for (size_t i = 0; i < beams.size(); ++i) {
+      auto tokens = search.GetTokens(beams[i]);
+      // Every cached token is read back through the block table
+      search.GetBlockTable(beams[i], &table);
+      for (size_t position = 0; position < tokens.size(); ++position) {
+        CHECK(pool.GetData(table[position / 4])[position % 4] == tokens[position]);
+      }
+      ModelStep(tokens, vocabulary_size, &log_probs[i * vocabulary_size]);
+    }
+    search.Step(log_probs.data());
+    for (auto beam: search.GetBeams()) {
+      *search.GetTokenData(beam) = search.GetTokens(beam).back();
+    }
+    // Hypotheses share the blocks of their common prefix
+    std::set<IndexType> blocks;
+    size_t tables = 0;
+    for (auto beam: search.GetBeams()) {
+      search.GetBlockTable(beam, &table);
+      blocks.insert(table.begin(), table.end());
+      tables += table.size();
+    }
+    if (step > 8 && search.GetBeams().size() > 1) {
+      CHECK(blocks.size() < tables);
+    }
+  }
+  CHECK(!search.GetFinished().empty());
+  // Hypotheses longer than the tree capacity have used the detached prefix
+  size_t longest = 0;
+  for (const auto &hypothesis: search.GetFinished()) {
+    longest = std::max(longest, hypothesis.tokens.size());
+  }
+  CHECK(longest > options.tree_capacity);
+  search.Reset();
+  CHECK(pool.GetFreeBlocks() == pool.GetBlocks());
+}
+
+TEST_CASE("Diverse token beam search test") {
+  const LabelType vocabulary_size = 8;
+  KVBlockPool pool(256, 4, 1);
+  TokenBeamSearchOptions options;
+  options.beam_size = 4;
+  options.groups = 2;
+  options.diversity_penalty = 100.0f;
+  options.max_length = 12;
+  TokenBeamSearch search(&pool, vocabulary_size, options);
+
+  std::vector<float> log_probs;
+  while (!search.IsFinished()) {
+    const auto &beams = search.GetBeams();
+    log_probs.resize(beams.size() * vocabulary_size);
+    for (size_t i = 0; i < beams.size(); ++i) {
+      ModelStep(search.GetTokens(beams[i]), vocabulary_size, &log_probs[i * vocabulary_size]);
+    }
+    search.Step(log_probs.data());
+    // Large penalty makes the groups select different tokens at every step
+    std::set<LabelType> first_group;
+    for (auto i = search.GetGroupBegin(0); i < search.GetGroupBegin(1); ++i) {
+      first_group.insert(search.GetTokens(search.GetBeams()[i]).back());
+    }
+    for (auto i = search.GetGroupBegin(1); i < search.GetGroupBegin(2); ++i) {
+      CHECK(first_group.count(search.GetTokens(search.GetBeams()[i]).back()) == 0);
+    }
+    if (!search.IsFinished()) {
+      CHECK(search.GetGroupBegin(1) == 2);
+      CHECK(search.GetGroupBegin(2) == 4);
+    }
+  }
+  REQUIRE(search.GetFinished().size() == 4);
+  CHECK(search.GetFinished()[0].group == 0);
+  CHECK(search.GetFinished()[3].group == 1);
+  CHECK(search.GetFinished()[0].tokens[0] != search.GetFinished()[3].tokens[0]);
+
+  // Without the penalty the groups still split the first step, the shared root is not expanded twice by the groups
+  options.diversity_penalty = 0.0f;
+  TokenBeamSearch plain(&pool, vocabulary_size, options);
+  log_probs.resize(vocabulary_size);
+  ModelStep({}, vocabulary_size, log_probs.data());
+  plain.Step(log_probs.data());
+  CHECK(plain.GetBeams().size() == 4);
+  std::set<LabelType> first_tokens;
+  for (auto beam: plain.GetBeams()) {
+    first_tokens.insert(plain.GetTokens(beam).back());
+  }
+  CHECK(first_tokens.size() == 4);
+}
+
+TEST_CASE("Stochastic token beam search test") {
+  // Tokens 0 and 1, eos 2, at most 3 tokens: 15 distinct sequences
+  const LabelType vocabulary_size = 3;
+  KVBlockPool pool(256, 4, 1);
+  TokenBeamSearchOptions options;
+  options.eos = 2;
+  options.max_length = 3;
+  options.stochastic = true;
+  options.seed = 5;
+
+  // Beam of all the sequences returns every sequence once with its log-probability
+  options.beam_size = 15;
+  TokenBeamSearch all(&pool, vocabulary_size, options);
+  RunSearch(&all, vocabulary_size);
+  std::map<std::vector<LabelType>, float> probabilities;
+  std::vector<float> row(vocabulary_size);
+  for (const auto &hypothesis: all.GetFinished()) {
+    float score = 0.0f;
+    for (size_t length = 0; length <= hypothesis.tokens.size() && length < 3; ++length) {
+      std::vector<LabelType> prefix(hypothesis.tokens.begin(), hypothesis.tokens.begin() + length);
+      NormalizedModelStep(prefix, vocabulary_size, row.data());
+      score += length < hypothesis.tokens.size() ? row[hypothesis.tokens[length]] : row[options.eos];
+    }
+    CHECK(hypothesis.score == Approx(score).margin(1e-5));
+    probabilities[hypothesis.tokens] = std::exp(score);
+  }
+  CHECK(probabilities.size() == 15);
+  for (size_t i = 1; i < all.GetFinished().size(); ++i) {
+    CHECK(all.GetFinished()[i - 1].perturbed_score >= all.GetFinished()[i].perturbed_score);
+  }
+
+  // Beam of size 1 is ancestral sampling
+  options.beam_size = 1;
+  TokenBeamSearch single(&pool, vocabulary_size, options);
+  const int samples = 20000;
+  std::map<std::vector<LabelType>, int> counts;
+  for (int sample = 0; sample < samples; ++sample) {
+    single.Reset();
+    RunSearch(&single, vocabulary_size);
+    REQUIRE(single.GetFinished().size() == 1);
+    ++counts[single.GetFinished()[0].tokens];
+  }
+  for (const auto &probability: probabilities) {
+    CHECK(static_cast<float>(counts[probability.first]) / samples == Approx(probability.second).margin(0.015));
+  }
+
+  // Samples without replacement are distinct
+  options.beam_size = 4;
+  TokenBeamSearch sampler(&pool, vocabulary_size, options);
+  for (int sample = 0; sample < 100; ++sample) {
+    sampler.Reset();
+    RunSearch(&sampler, vocabulary_size);
+    std::set<std::vector<LabelType>> distinct;
+    for (const auto &hypothesis: sampler.GetFinished()) {
+      distinct.insert(hypothesis.tokens);
+    }
+    CHECK(sampler.GetFinished().size() == 4);
+    CHECK(distinct.size() == 4);
+  }
+  CHECK_THROWS(TokenBeamSearch(&pool, vocabulary_size, [&options] {
+    auto grouped = options;
+    grouped.groups = 2;
+    return grouped;
+  }()));
+}
@@ -0,0 +1,75 @@
+// @author Nikolay Malkovsky 2022--...
+
+#include "tree_memory_accountant.h"
+
+#include <catch2/catch.hpp>
+
+#include "beam_search_tree.h"
+#include "ctc_decoder.h"
+
+using beam_search::Admission;
+using beam_search::CircularArrayCTCBeamSearchTree;
+using beam_search::CTCDecoderOptions;
+using beam_search::IndexType;
+using beam_search::LabelType;
+using beam_search::TreeMemoryAccountant;
+
+TEST_CASE("Tree memory accountant test") {
+  using Tree = CircularArrayCTCBeamSearchTree<int>;
+  auto &accountant = TreeMemoryAccountant::Global();
+  auto usage = accountant.GetUsage();
+  auto trees = accountant.GetTrees();
+  {
+    Tree tree(100);
+    CHECK(tree.GetMemoryUsage() == Tree::EstimateMemory(100));
+    CHECK(accountant.GetUsage() == usage + tree.GetMemoryUsage());
+    CHECK(accountant.GetTrees() == trees + 1);
+
+    // A long single hypothesis detaches its prefix, the charge follows the detached entries
+    bool created;
+    auto beam = tree.Reset();
+    for (LabelType label = 0; label < 1000; ++label) {
+      auto child = tree.GetChild(beam, label % 7, &created);
+      tree.DeleteEntry(beam);
+      beam = child;
+    }
+    CHECK(tree.GetMemoryUsage() > Tree::EstimateMemory(100));
+    CHECK(accountant.GetUsage() == usage + tree.GetMemoryUsage());
+
+    // The detached prefix committed by Fork is charged once for both trees
+    auto before_fork = accountant.GetUsage();
+    {
+      auto fork = tree.Fork();
+      CHECK(tree.GetMemoryUsage() == Tree::EstimateMemory(100));
+      CHECK(accountant.GetUsage() == before_fork + fork.GetMemoryUsage());
+      CHECK(accountant.GetTrees() == trees + 2);
+      auto copy = fork;
+      CHECK(accountant.GetUsage() == before_fork + 2 * fork.GetMemoryUsage());
+    }
+    CHECK(accountant.GetUsage() == before_fork);
+    CHECK(accountant.GetPeakUsage() >= before_fork + 2 * Tree::EstimateMemory(100));
+  }
+  CHECK(accountant.GetUsage() == usage);
+  CHECK(accountant.GetTrees() == trees);
+
+  // Admission by the budgets
+  accountant.SetBudgets(usage + 1000, usage + 2000);
+  CHECK(accountant.Admit(900, 400) == Admission::kAccepted);
+  CHECK(accountant.Admit(1500, 800) == Admission::kDowngraded);
+  CHECK(accountant.Admit(3000, 2500) == Admission::kRejected);
+
+  using CTCTree = CircularArrayCTCBeamSearchTree<beam_search::CTCBeamEntry>;
+  accountant.SetBudgets(usage + CTCTree::EstimateMemory(1024), usage + CTCTree::EstimateMemory(2048));
+  CTCDecoderOptions options;
+  options.beam_size = 8;
+  options.tree_capacity = 1024;
+  CHECK(beam_search::AdmitStream(&options) == Admission::kAccepted);
+  options.tree_capacity = 4096;
+  CHECK(beam_search::AdmitStream(&options) == Admission::kDowngraded);
+  CHECK(options.beam_size == 4);
+  CHECK(options.tree_capacity == 2048);
+  options.tree_capacity = 8192;
+  CHECK(beam_search::AdmitStream(&options) == Admission::kRejected);
+  CHECK(options.tree_capacity == 8192);
+  accountant.SetBudgets(0, 0);
+}
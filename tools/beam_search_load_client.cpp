@@ -0,0 +1,194 @@
+// @author Nikolay Malkovsky 2022--...
+
+/**
+ * Load generator for beam_search_server: every connection streams random posteriors of several utterances chunk by
+ * chunk, waits for the partial hypothesis after every chunk and checks the final hypothesis against a local decoder.
+ * Prints the chunk latency percentiles and the decoded frames per second, exits with an error on a mismatch.
+ *
+ * Usage: beam_search_load_client <socket path> [connections] [utterances] [frames] [chunk frames] [vocabulary size]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ctc_decoder.h"
+#include "decoding_protocol.h"
+
+using namespace beam_search;
+using namespace beam_search::protocol;
+
+namespace {
+
+struct LoadOptions {
+  const char *socket_path;
+  size_t connections = 8;
+  size_t utterances = 4;
+  std::uint32_t frames = 500;
+  std::uint32_t chunk_frames = 50;
+  std::uint32_t vocabulary_size = 32;
+  std::uint32_t beam_size = 8;
+  std::uint32_t top_k = 8;
+};
+
+struct LoadResult {
+  std::vector<double> latencies;
+  size_t frames = 0;
+  size_t mismatches = 0;
+  size_t failures = 0;
+};
+
+/**
+ * Normalized random posteriors peaked at blank in most frames like the output of a trained model
+ */
+std::vector<float> RandomLogProbs(std::uint32_t frames, std::uint32_t vocabulary_size, std::mt19937 &generator) {
+  std::uniform_real_distribution<float> distribution(0.0f, 2.0f);
+  std::vector<float> result(static_cast<size_t>(frames) * vocabulary_size);
+  for (size_t t = 0; t < frames; ++t) {
+    auto *row = &result[t * vocabulary_size];
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      row[label] = distribution(generator);
+    }
+    row[generator() % 3 == 0 ? generator() % vocabulary_size : 0] += 5.0f;
+    float normalizer = 0.0f;
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      normalizer += std::exp(row[label]);
+    }
+    for (size_t label = 0; label < vocabulary_size; ++label) {
+      row[label] -= std::log(normalizer);
+    }
+  }
+  return result;
+}
+
+int Connect(const char *path) {
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Streams the utterances of a connection
+ */
+void RunConnection(const LoadOptions &options, size_t seed, LoadResult *result) {
+  int fd = Connect(options.socket_path);
+  if (fd < 0) {
+    ++result->failures;
+    return;
+  }
+  std::mt19937 generator(seed);
+  CTCDecoderOptions decoder_options;
+  decoder_options.beam_size = options.beam_size;
+  decoder_options.top_k = options.top_k;
+  CTCPrefixBeamSearchDecoder reference(options.vocabulary_size, decoder_options);
+  std::vector<char> message;
+  std::vector<char> payload;
+  MessageType type;
+  CTCHypothesis hypothesis;
+  for (size_t utterance = 0; utterance < options.utterances; ++utterance) {
+    StartRequest start{options.vocabulary_size, options.beam_size, options.top_k};
+    if (!SendMessage(fd, MessageType::kStart, &start, sizeof(start))) {
+      ++result->failures;
+      break;
+    }
+    auto log_probs = RandomLogProbs(options.frames, options.vocabulary_size, generator);
+    bool failed = false;
+    for (std::uint32_t t = 0; t < options.frames && !failed; t += options.chunk_frames) {
+      std::uint32_t frames = std::min(options.chunk_frames, options.frames - t);
+      auto floats = static_cast<size_t>(frames) * options.vocabulary_size;
+      message.resize(sizeof(frames) + floats * sizeof(float));
+      std::memcpy(message.data(), &frames, sizeof(frames));
+      std::memcpy(message.data() + sizeof(frames), &log_probs[static_cast<size_t>(t) * options.vocabulary_size],
+                  floats * sizeof(float));
+      auto begin = std::chrono::steady_clock::now();
+      failed = !SendMessage(fd, MessageType::kChunk, message.data(), message.size()) ||
+          !ReceiveMessage(fd, &type, &payload) || type != MessageType::kPartial || !DecodeHypothesis(payload,
+                                                                                                     &hypothesis);
+      result->latencies.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() -
+                                                                            begin).count());
+      result->frames += frames;
+    }
+    failed = failed || !SendMessage(fd, MessageType::kFinish, nullptr, 0) || !ReceiveMessage(fd, &type, &payload) ||
+        type != MessageType::kFinal || !DecodeHypothesis(payload, &hypothesis);
+    if (failed) {
+      ++result->failures;
+      break;
+    }
+    reference.Reset();
+    reference.ProcessChunk(log_probs.data(), options.frames);
+    if (reference.GetBest().labels != hypothesis.labels) {
+      ++result->mismatches;
+    }
+  }
+  close(fd);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <socket path> [connections] [utterances] [frames] [chunk frames] "
+                         "[vocabulary size]\n", argv[0]);
+    return 1;
+  }
+  LoadOptions options;
+  options.socket_path = argv[1];
+  if (argc > 2) options.connections = std::strtoul(argv[2], nullptr, 10);
+  if (argc > 3) options.utterances = std::strtoul(argv[3], nullptr, 10);
+  if (argc > 4) options.frames = std::strtoul(argv[4], nullptr, 10);
+  if (argc > 5) options.chunk_frames = std::strtoul(argv[5], nullptr, 10);
+  if (argc > 6) options.vocabulary_size = std::strtoul(argv[6], nullptr, 10);
+  if (options.chunk_frames == 0 || options.vocabulary_size < 2) {
+    std::fprintf(stderr, "Chunk frames should be positive and vocabulary size at least 2\n");
+    return 1;
+  }
+
+  std::vector<LoadResult> results(options.connections);
+  std::vector<std::thread> threads;
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t connection = 0; connection < options.connections; ++connection) {
+    threads.emplace_back(RunConnection, std::cref(options), connection, &results[connection]);
+  }
+  for (auto &thread: threads) {
+    thread.join();
+  }
+  auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  LoadResult total;
+  for (const auto &result: results) {
+    total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+    total.frames += result.frames;
+    total.mismatches += result.mismatches;
+    total.failures += result.failures;
+  }
+  std::sort(total.latencies.begin(), total.latencies.end());
+  auto percentile = [&total](double fraction) {
+    if (total.latencies.empty()) {
+      return 0.0;
+    }
+    return total.latencies[std::min(total.latencies.size() - 1,
+                                    static_cast<size_t>(fraction * total.latencies.size()))];
+  };
+  std::printf("connections %zu, chunks %zu, frames %zu, %.0f frames/s\n", options.connections,
+              total.latencies.size(), total.frames, total.frames / seconds);
+  std::printf("chunk latency ms: p50 %.3f, p90 %.3f, p99 %.3f\n", percentile(0.5), percentile(0.9),
+              percentile(0.99));
+  std::printf("mismatches %zu, failed connections %zu\n", total.mismatches, total.failures);
+  return total.mismatches == 0 && total.failures == 0 ? 0 : 1;
+}
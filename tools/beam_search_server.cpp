@@ -0,0 +1,518 @@
+// @author Nikolay Malkovsky 2022--...
+
+/**
+ * Decoding server: accepts streaming posterior chunks over a Unix domain socket and returns partial and final CTC
+ * prefix beam search hypotheses, see decoding_protocol.h for the messages.
+ *
+ * A single thread polls the connections and splits their input into messages, every connection has its own queue of
+ * requests and its own decoder. Connections with pending requests are put to the ready queue. A worker takes its share
+ * of the ready connections, up to kMaxBatch, as a batch and decodes them in rounds: every round handles the requests of
+ * each connection up to its next chunk, then the chunks of the round are decoded together frame by frame by
+ * CTCDecoderBatch. A connection leaves the batch once it has no pending requests, it is handled by at most one worker
+ * at a time, so the requests of a stream stay in order. Workers never block on the sockets: responses are appended to
+ * the output queue of the connection and sent by the poll thread when the socket is writable, a client that lets its
+ * queue grow over kMaxPendingOutput is disconnected.
+ *
+ * New streams are admitted by the tree memory budgets: streams over the soft budget are decoded with halved beam size
+ * and tree capacity, streams over the hard budget are rejected with an error.
+ *
+ * Usage: beam_search_server <socket path> [workers] [soft budget MB] [hard budget MB]
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ctc_multi_stream_decoder.h"
+#include "decoding_protocol.h"
+
+using namespace beam_search;
+using namespace beam_search::protocol;
+
+namespace {
+
+// Limit of the responses queued for a client that does not read them
+const size_t kMaxPendingOutput = 16u << 20;
+
+// Limit of the connections decoded together by a worker
+const size_t kMaxBatch = 32;
+
+std::atomic<bool> stop_requested(false);
+
+void RequestStop(int) { stop_requested = true; }
+
+struct Request {
+  MessageType type;
+  std::vector<char> payload;
+};
+
+/**
+ * Client connection, shared by the poll thread and the worker decoding it
+ */
+struct Connection {
+  explicit Connection(int fd) : fd(fd) {}
+
+  ~Connection() { close(fd); }
+
+  int fd;
+  // Input not yet split into messages, owned by the poll thread
+  std::vector<char> input;
+  // Requests and the scheduling flag are guarded by the mutex
+  std::mutex mutex;
+  std::deque<Request> requests;
+  bool scheduled = false;
+  // Encoded responses not yet sent, guarded by the mutex, sent by the poll thread. The connection is shut down once
+  // the output is sent if close_after_output is set.
+  std::vector<char> output;
+  bool close_after_output = false;
+  // Decoder state, owned by the worker decoding the connection
+  std::unique_ptr<CTCPrefixBeamSearchDecoder> decoder;
+  LabelType vocabulary_size = 0;
+  bool failed = false;
+};
+
+/**
+ * Connections decoded together by a worker and the chunks of the current round
+ */
+struct WorkerBatch {
+  std::vector<std::shared_ptr<Connection>> connections;
+  // Chunk of connections[i], copied since the payload is not aligned for floats
+  std::vector<std::vector<float>> chunks;
+  std::vector<CTCPrefixBeamSearchDecoder *> decoders;
+  std::vector<const float *> log_probs;
+  std::vector<IndexType> frames;
+  std::vector<ChunkStats> stats;
+  CTCDecoderBatch decoder_batch;
+};
+
+class Server {
+ public:
+  explicit Server(size_t workers) : worker_count_(workers) {
+    if (pipe2(wake_pipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
+      throw std::runtime_error(std::string("Failed to create the wake pipe: ") + std::strerror(errno));
+    }
+    for (size_t worker = 0; worker < workers; ++worker) {
+      workers_.emplace_back([this] { WorkerLoop(); });
+    }
+  }
+
+  ~Server() {
+    {
+      std::lock_guard<std::mutex> lock(ready_mutex_);
+      stopping_ = true;
+    }
+    ready_condition_.notify_all();
+    for (auto &worker: workers_) {
+      worker.join();
+    }
+    close(wake_pipe_[0]);
+    close(wake_pipe_[1]);
+  }
+
+  /**
+   * Polls the listening socket and the connections until a stop signal
+   */
+  void Run(int listen_fd) {
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::vector<pollfd> descriptors;
+    char buffer[1 << 16];
+    while (!stop_requested) {
+      descriptors.assign({pollfd{listen_fd, POLLIN, 0}, pollfd{wake_pipe_[0], POLLIN, 0}});
+      for (const auto &connection: connections) {
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        short events = connection->output.empty() ? POLLIN : POLLIN | POLLOUT;
+        descriptors.push_back(pollfd{connection->fd, events, 0});
+      }
+      if (poll(descriptors.data(), descriptors.size(), 100) <= 0) {
+        continue;
+      }
+      if (descriptors[1].revents & POLLIN) {
+        while (read(wake_pipe_[0], buffer, sizeof(buffer)) > 0) {
+        }
+      }
+      std::vector<std::shared_ptr<Connection>> alive;
+      for (size_t i = 0; i < connections.size(); ++i) {
+        auto &connection = connections[i];
+        bool open = Flush(*connection);
+        if (descriptors[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+          while (true) {
+            auto count = read(connection->fd, buffer, sizeof(buffer));
+            if (count > 0) {
+              connection->input.insert(connection->input.end(), buffer, buffer + count);
+              continue;
+            }
+            if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+              open = false;
+            }
+            break;
+          }
+          open = SplitMessages(connection) && open;
+        }
+        if (open) {
+          alive.push_back(connection);
+        }
+      }
+      connections.swap(alive);
+      if (descriptors[0].revents & POLLIN) {
+        int fd;
+        while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+          connections.push_back(std::make_shared<Connection>(fd));
+        }
+      }
+    }
+  }
+
+ private:
+  /**
+   * Sends as much of the queued output as the socket accepts without blocking
+   * @return false on a socket error
+   */
+  bool Flush(Connection &connection) {
+    std::lock_guard<std::mutex> lock(connection.mutex);
+    size_t sent = 0;
+    while (sent < connection.output.size()) {
+      auto written = send(connection.fd, connection.output.data() + sent, connection.output.size() - sent,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          break;
+        }
+        return false;
+      }
+      sent += written;
+    }
+    connection.output.erase(connection.output.begin(), connection.output.begin() + sent);
+    if (connection.output.empty() && connection.close_after_output) {
+      shutdown(connection.fd, SHUT_RDWR);
+    }
+    return true;
+  }
+
+  /**
+   * Queues a response for the poll thread
+   * @param close shut the connection down once the response is sent
+   * @return false if the client lets too much output pile up, the connection is shut down then
+   */
+  bool Send(Connection &connection, MessageType type, const void *payload, size_t size, bool close = false) {
+    MessageHeader header{static_cast<std::uint32_t>(type), static_cast<std::uint32_t>(size)};
+    {
+      std::lock_guard<std::mutex> lock(connection.mutex);
+      if (connection.output.size() + sizeof(header) + size > kMaxPendingOutput) {
+        connection.failed = true;
+        shutdown(connection.fd, SHUT_RDWR);
+        return false;
+      }
+      const auto *header_bytes = reinterpret_cast<const char *>(&header);
+      connection.output.insert(connection.output.end(), header_bytes, header_bytes + sizeof(header));
+      connection.output.insert(connection.output.end(), static_cast<const char *>(payload),
+                               static_cast<const char *>(payload) + size);
+      connection.close_after_output = close;
+    }
+    // A full pipe means the poll thread is already woken up
+    char signal = 0;
+    while (write(wake_pipe_[1], &signal, 1) < 0 && errno == EINTR) {
+    }
+    return true;
+  }
+
+  /**
+   * Moves the complete messages of the input to the requests of the connection and schedules it
+   * @return false if the input is malformed
+   */
+  bool SplitMessages(const std::shared_ptr<Connection> &connection) {
+    size_t position = 0;
+    bool added = false;
+    auto &input = connection->input;
+    while (input.size() - position >= sizeof(MessageHeader)) {
+      MessageHeader header;
+      std::memcpy(&header, input.data() + position, sizeof(header));
+      if (header.size > kMaxPayload) {
+        return false;
+      }
+      if (input.size() - position - sizeof(header) < header.size) {
+        break;
+      }
+      auto begin = input.begin() + position + sizeof(header);
+      Request request{static_cast<MessageType>(header.type), std::vector<char>(begin, begin + header.size)};
+      position += sizeof(header) + header.size;
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      connection->requests.push_back(std::move(request));
+      added = true;
+    }
+    input.erase(input.begin(), input.begin() + position);
+    if (added) {
+      Schedule(connection);
+    }
+    return true;
+  }
+
+  void Schedule(const std::shared_ptr<Connection> &connection) {
+    {
+      std::lock_guard<std::mutex> lock(connection->mutex);
+      if (connection->scheduled) {
+        return;
+      }
+      connection->scheduled = true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(ready_mutex_);
+      ready_.push_back(connection);
+    }
+    ready_condition_.notify_one();
+  }
+
+  void WorkerLoop() {
+    WorkerBatch batch;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(ready_mutex_);
+        ready_condition_.wait(lock, [this] { return stopping_ || !ready_.empty(); });
+        if (stopping_) {
+          return;
+        }
+        // Leaves the rest of the ready connections to the other workers
+        auto count = std::min((ready_.size() + worker_count_ - 1) / worker_count_, kMaxBatch);
+        batch.connections.assign(std::make_move_iterator(ready_.begin()),
+                                 std::make_move_iterator(ready_.begin() + count));
+        ready_.erase(ready_.begin(), ready_.begin() + count);
+      }
+      Decode(batch);
+    }
+  }
+
+  /**
+   * Handles all the pending requests of the batch, the chunks of a round are decoded together
+   */
+  void Decode(WorkerBatch &batch) {
+    while (true) {
+      size_t active = 0;
+      batch.decoders.clear();
+      batch.frames.clear();
+      for (size_t i = 0; i < batch.connections.size(); ++i) {
+        if (active == batch.chunks.size()) {
+          batch.chunks.emplace_back();
+        }
+        IndexType frames;
+        if (!NextChunk(*batch.connections[i], &batch.chunks[active], &frames)) {
+          continue;
+        }
+        if (active != i) {
+          batch.connections[active] = std::move(batch.connections[i]);
+        }
+        batch.decoders.push_back(batch.connections[active]->decoder.get());
+        batch.frames.push_back(frames);
+        ++active;
+      }
+      batch.connections.resize(active);
+      if (active == 0) {
+        return;
+      }
+      batch.log_probs.clear();
+      for (size_t i = 0; i < active; ++i) {
+        batch.log_probs.push_back(batch.chunks[i].data());
+      }
+      batch.stats.resize(active);
+      try {
+        batch.decoder_batch.ProcessChunks(batch.decoders.data(), batch.log_probs.data(), batch.frames.data(), active,
+                                          batch.stats.data());
+      } catch (const std::exception &error) {
+        for (auto &connection: batch.connections) {
+          Fail(*connection, error.what());
+        }
+        continue;
+      }
+      for (auto &connection: batch.connections) {
+        try {
+          auto payload = EncodeHypothesis(connection->decoder->GetBest());
+          Send(*connection, MessageType::kPartial, payload.data(), payload.size());
+        } catch (const std::exception &error) {
+          Fail(*connection, error.what());
+        }
+      }
+    }
+  }
+
+  /**
+   * Handles the pending requests of the connection up to its next chunk
+   * @param chunk output log-probabilities of the chunk
+   * @param frames output number of frames in the chunk
+   * @return false if the connection has no pending requests left, it is not scheduled then
+   */
+  bool NextChunk(Connection &connection, std::vector<float> *chunk, IndexType *frames) {
+    while (true) {
+      Request request;
+      {
+        std::lock_guard<std::mutex> lock(connection.mutex);
+        if (connection.requests.empty()) {
+          connection.scheduled = false;
+          return false;
+        }
+        request = std::move(connection.requests.front());
+        connection.requests.pop_front();
+      }
+      if (connection.failed) {
+        continue;
+      }
+      // A throwing request fails its own stream instead of terminating the server
+      try {
+        if (request.type != MessageType::kChunk) {
+          Handle(connection, request);
+        } else if (ReadChunk(connection, request, chunk, frames)) {
+          return true;
+        }
+      } catch (const std::exception &error) {
+        Fail(connection, error.what());
+      }
+    }
+  }
+
+  /**
+   * Validates the chunk request and copies its log-probabilities
+   * @return false if the request is malformed, the connection is failed then
+   */
+  bool ReadChunk(Connection &connection, const Request &request, std::vector<float> *chunk, IndexType *frames) {
+    if (!connection.decoder) {
+      Fail(connection, "Utterance is not started");
+      return false;
+    }
+    std::uint32_t count;
+    if (request.payload.size() < sizeof(count)) {
+      Fail(connection, "Malformed chunk");
+      return false;
+    }
+    std::memcpy(&count, request.payload.data(), sizeof(count));
+    // Divides instead of multiplying, a forged frame count must not wrap the expected size around
+    auto bytes = request.payload.size() - sizeof(count);
+    auto floats = bytes / sizeof(float);
+    if (bytes % sizeof(float) != 0 || floats % connection.vocabulary_size != 0 ||
+        floats / connection.vocabulary_size != count) {
+      Fail(connection, "Malformed chunk");
+      return false;
+    }
+    chunk->resize(floats);
+    std::memcpy(chunk->data(), request.payload.data() + sizeof(count), bytes);
+    *frames = count;
+    return true;
+  }
+
+  /**
+   * Handles the start, finish and unknown requests
+   */
+  void Handle(Connection &connection, const Request &request) {
+    if (request.type == MessageType::kStart) {
+      StartRequest start;
+      if (request.payload.size() != sizeof(start)) {
+        return Fail(connection, "Malformed start request");
+      }
+      std::memcpy(&start, request.payload.data(), sizeof(start));
+      if (start.vocabulary_size == 0 || start.vocabulary_size > std::numeric_limits<LabelType>::max()) {
+        return Fail(connection, "Vocabulary size is out of the label range");
+      }
+      CTCDecoderOptions options;
+      options.beam_size = start.beam_size;
+      options.top_k = start.top_k;
+      // The previous utterance of the connection does not count against the new one
+      connection.decoder.reset();
+      if (AdmitStream(&options) == Admission::kRejected) {
+        return Fail(connection, "Memory budget exceeded");
+      }
+      try {
+        connection.decoder.reset(new CTCPrefixBeamSearchDecoder(start.vocabulary_size, options));
+      } catch (const std::exception &error) {
+        return Fail(connection, error.what());
+      }
+      connection.vocabulary_size = start.vocabulary_size;
+      return;
+    }
+    if (request.type != MessageType::kFinish) {
+      return Fail(connection, "Unknown message");
+    }
+    if (!connection.decoder) {
+      return Fail(connection, "Utterance is not started");
+    }
+    auto payload = EncodeHypothesis(connection.decoder->GetBest());
+    connection.decoder->Reset();
+    Send(connection, MessageType::kFinal, payload.data(), payload.size());
+  }
+
+  void Fail(Connection &connection, const std::string &message) {
+    connection.failed = true;
+    Send(connection, MessageType::kError, message.data(), message.size(), true);
+  }
+
+  size_t worker_count_;
+  std::vector<std::thread> workers_;
+  std::mutex ready_mutex_;
+  std::condition_variable ready_condition_;
+  std::deque<std::shared_ptr<Connection>> ready_;
+  bool stopping_ = false;
+  // Workers write a byte to wake the poll thread up when they queue output
+  int wake_pipe_[2];
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "Usage: %s <socket path> [workers] [soft budget MB] [hard budget MB]\n", argv[0]);
+    return 1;
+  }
+  auto workers = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : std::max(1u, std::thread::hardware_concurrency());
+  size_t soft_budget = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 0;
+  size_t hard_budget = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 0;
+  TreeMemoryAccountant::Global().SetBudgets(soft_budget << 20, hard_budget << 20);
+  if (workers == 0) {
+    std::fprintf(stderr, "Number of workers should be positive\n");
+    return 1;
+  }
+
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (std::strlen(argv[1]) >= sizeof(address.sun_path)) {
+    std::fprintf(stderr, "Socket path is too long\n");
+    return 1;
+  }
+  std::strcpy(address.sun_path, argv[1]);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(argv[1]);
+  if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) < 0 ||
+      listen(listen_fd, 128) < 0) {
+    std::perror("Failed to listen on the socket");
+    return 1;
+  }
+  std::signal(SIGINT, RequestStop);
+  std::signal(SIGTERM, RequestStop);
+  std::fprintf(stderr, "Listening on %s with %lu workers\n", argv[1], workers);
+  try {
+    Server server(workers);
+    server.Run(listen_fd);
+  } catch (const std::exception &error) {
+    std::fprintf(stderr, "%s\n", error.what());
+    return 1;
+  }
+  close(listen_fd);
+  unlink(argv[1]);
+  return 0;
+}
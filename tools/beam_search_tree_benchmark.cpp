@@ -0,0 +1,126 @@
+// @author Nikolay Malkovsky 2022--...
+
+/**
+ * Benchmark of the bulk copy of CircularArrayCTCBeamSearchTree for trivially copyable and generic BeamEntry types.
+ * Both entry types carry the same payload as CTCBeamEntry, the generic one has a user-provided copy, so Fork copies
+ * it entry by entry instead of with memcpy. Fork is the only operation with a specialized copy, the other operations
+ * copy single entries the same way for both types and are not measured.
+ *
+ * A beam search fills the ring of both trees the same way, then both Fork timings are warmed up and measured in
+ * interleaved rounds, alternating which type goes first, so the run order does not favour either type.
+ *
+ * Usage: beam_search_tree_benchmark [capacity] [beam size] [steps] [rounds]
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "beam_search_tree.h"
+#include "tree_copy_entries.h"
+
+using namespace beam_search;
+
+namespace {
+
+double Nanoseconds(std::chrono::steady_clock::time_point begin) {
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+}
+
+/**
+ * Runs a random beam search, the result only depends on the arguments, not on the entry type
+ */
+template<class BeamEntry>
+CircularArrayCTCBeamSearchTree<BeamEntry> Search(IndexType capacity, size_t beam_size, size_t steps) {
+  CircularArrayCTCBeamSearchTree<BeamEntry> tree(capacity);
+  std::mt19937 generator(1);
+  std::vector<IndexType> beams = {tree.InitializeTree()};
+  std::vector<IndexType> candidates;
+  bool created;
+  for (size_t step = 0; step < steps; ++step) {
+    candidates.clear();
+    for (auto beam: beams) {
+      for (int i = 0; i < 4; ++i) {
+        auto child = tree.GetChild(beam, static_cast<LabelType>(generator() % 32), &created);
+        if (child == kNoIndex) {
+          std::fprintf(stderr, "Capacity is too small for the beam size\n");
+          std::exit(1);
+        }
+        auto &entry = tree.GetEntry(child);
+        entry.label = tree.GetEntry(beam).label + static_cast<float>(generator() % 8);
+        entry.frame = static_cast<IndexType>(step);
+        if (created) {
+          candidates.push_back(child);
+        }
+      }
+    }
+    std::shuffle(candidates.begin(), candidates.end(), generator);
+    auto survivors = std::min(beam_size, candidates.size());
+    for (size_t i = survivors; i < candidates.size(); ++i) {
+      tree.DeleteEntry(candidates[i]);
+    }
+    for (auto beam: beams) {
+      tree.DeleteEntry(beam);
+    }
+    beams.assign(candidates.begin(), candidates.begin() + survivors);
+  }
+  return tree;
+}
+
+/**
+ * Average Fork time in nanoseconds, checksum prevents the copies from being optimized out
+ */
+template<class BeamEntry>
+double TimeFork(CircularArrayCTCBeamSearchTree<BeamEntry> &tree, size_t repeats, double *checksum) {
+  auto begin = std::chrono::steady_clock::now();
+  for (size_t repeat = 0; repeat < repeats; ++repeat) {
+    auto fork = tree.Fork();
+    *checksum += fork.GetSize();
+  }
+  return Nanoseconds(begin) / repeats;
+}
+
+double Median(std::vector<double> values) {
+  std::sort(values.begin(), values.end());
+  return values[values.size() / 2];
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  IndexType capacity = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1 << 16;
+  size_t beam_size = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 16;
+  size_t steps = argc > 3 ? std::strtoul(argv[3], nullptr, 10) : 20000;
+  size_t rounds = argc > 4 ? std::strtoul(argv[4], nullptr, 10) : 21;
+  if (beam_size == 0 || steps == 0 || rounds == 0) {
+    std::fprintf(stderr, "Beam size, steps and rounds should be positive\n");
+    return 1;
+  }
+  auto trivial = Search<TrivialCopyEntry>(capacity, beam_size, steps);
+  auto generic = Search<GenericCopyEntry>(capacity, beam_size, steps);
+  std::printf("capacity %u, beam size %zu, steps %zu, live entries %u\n", capacity, beam_size, steps,
+              trivial.GetSize());
+
+  const size_t repeats = 20;
+  double checksum = 0.0;
+  TimeFork(trivial, repeats, &checksum);
+  TimeFork(generic, repeats, &checksum);
+  std::vector<double> trivial_ns;
+  std::vector<double> generic_ns;
+  for (size_t round = 0; round < rounds; ++round) {
+    if (round % 2 == 0) {
+      trivial_ns.push_back(TimeFork(trivial, repeats, &checksum));
+      generic_ns.push_back(TimeFork(generic, repeats, &checksum));
+    } else {
+      generic_ns.push_back(TimeFork(generic, repeats, &checksum));
+      trivial_ns.push_back(TimeFork(trivial, repeats, &checksum));
+    }
+  }
+  std::printf("fork median over %zu rounds: trivial %.1f ns, generic %.1f ns (checksum %.0f)\n", rounds,
+              Median(trivial_ns), Median(generic_ns), checksum);
+  return 0;
+}
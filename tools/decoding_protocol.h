@@ -0,0 +1,148 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ctc_decoder.h"
+
+namespace beam_search {
+namespace protocol {
+
+/**
+ * Messages of the decoding server. Every message is a MessageHeader followed by size bytes of payload in the host
+ * byte order, the socket is local.
+ *
+ * Client to server:
+ * - kStart: StartRequest, starts an utterance with the given decoder options
+ * - kChunk: uint32 frames followed by frames x vocabulary_size floats of label log-probabilities
+ * - kFinish: empty, ends the utterance
+ * Server to client:
+ * - kPartial: hypothesis after a chunk
+ * - kFinal: hypothesis after kFinish
+ * - kError: error text, the server closes the connection
+ * Hypotheses are encoded as float score, uint32 length and length uint16 labels.
+ */
+enum class MessageType : std::uint32_t {
+  kStart = 1,
+  kChunk = 2,
+  kFinish = 3,
+  kPartial = 4,
+  kFinal = 5,
+  kError = 6
+};
+
+struct MessageHeader {
+  std::uint32_t type;
+  std::uint32_t size;
+};
+
+struct StartRequest {
+  std::uint32_t vocabulary_size;
+  std::uint32_t beam_size;
+  std::uint32_t top_k;
+};
+
+// Limit of the payload size, a chunk of 1000 frames of 16k labels
+const std::uint32_t kMaxPayload = 64u << 20;
+
+/**
+ * Writes the whole buffer to a blocking socket
+ * @return false on an error or a closed socket
+ */
+inline bool WriteAll(int fd, const void *data, size_t size) {
+  const auto *bytes = static_cast<const char *>(data);
+  while (size > 0) {
+    auto written = send(fd, bytes, size, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+/**
+ * Reads exactly size bytes from a blocking socket
+ * @return false on an error or a closed socket
+ */
+inline bool ReadAll(int fd, void *data, size_t size) {
+  auto *bytes = static_cast<char *>(data);
+  while (size > 0) {
+    auto count = read(fd, bytes, size);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
+
+/**
+ * Sends a message over a blocking socket
+ * @return false on an error or a closed socket
+ */
+inline bool SendMessage(int fd, MessageType type, const void *payload, size_t size) {
+  MessageHeader header{static_cast<std::uint32_t>(type), static_cast<std::uint32_t>(size)};
+  return WriteAll(fd, &header, sizeof(header)) && WriteAll(fd, payload, size);
+}
+
+/**
+ * Receives a message from a blocking socket
+ * @return false on an error, a closed socket or a payload over the limit
+ */
+inline bool ReceiveMessage(int fd, MessageType *type, std::vector<char> *payload) {
+  MessageHeader header;
+  if (!ReadAll(fd, &header, sizeof(header)) || header.size > kMaxPayload) {
+    return false;
+  }
+  *type = static_cast<MessageType>(header.type);
+  payload->resize(header.size);
+  return ReadAll(fd, payload->data(), header.size);
+}
+
+inline std::vector<char> EncodeHypothesis(const CTCHypothesis &hypothesis) {
+  std::uint32_t length = static_cast<std::uint32_t>(hypothesis.labels.size());
+  std::vector<char> result(sizeof(float) + sizeof(length) + length * sizeof(LabelType));
+  std::memcpy(result.data(), &hypothesis.score, sizeof(float));
+  std::memcpy(result.data() + sizeof(float), &length, sizeof(length));
+  std::memcpy(result.data() + sizeof(float) + sizeof(length), hypothesis.labels.data(), length * sizeof(LabelType));
+  return result;
+}
+
+/**
+ * Decodes a hypothesis
+ * @return false if the payload is malformed
+ */
+inline bool DecodeHypothesis(const std::vector<char> &payload, CTCHypothesis *hypothesis) {
+  std::uint32_t length;
+  if (payload.size() < sizeof(float) + sizeof(length)) {
+    return false;
+  }
+  std::memcpy(&hypothesis->score, payload.data(), sizeof(float));
+  std::memcpy(&length, payload.data() + sizeof(float), sizeof(length));
+  if (payload.size() != sizeof(float) + sizeof(length) + length * sizeof(LabelType)) {
+    return false;
+  }
+  hypothesis->labels.resize(length);
+  std::memcpy(hypothesis->labels.data(), payload.data() + sizeof(float) + sizeof(length), length * sizeof(LabelType));
+  return true;
+}
+
+} // protocol
+} // beam_search
@@ -0,0 +1,39 @@
+// @author Nikolay Malkovsky 2022--...
+
+#pragma once
+
+#include "beam_search_tree.h"
+
+namespace beam_search {
+
+/**
+ * Trivially copyable BeamEntry with the payload of CTCBeamEntry, Fork copies it with memcpy
+ */
+struct TrivialCopyEntry {
+  float blank = 0.0f;
+  float label = 0.0f;
+  float next_blank = 0.0f;
+  float next_label = 0.0f;
+  IndexType frame = 0;
+  float lm = 0.0f;
+  IndexType lm_state = 0;
+};
+
+/**
+ * The same payload with a user-provided copy, so the tree copies it entry by entry
+ */
+struct GenericCopyEntry : TrivialCopyEntry {
+  GenericCopyEntry() = default;
+
+  GenericCopyEntry(const GenericCopyEntry &other) : TrivialCopyEntry(other) {}
+
+  GenericCopyEntry &operator=(const GenericCopyEntry &other) {
+    TrivialCopyEntry::operator=(other);
+    return *this;
+  }
+};
+
+static_assert(CircularArrayCTCBeamSearchTree<TrivialCopyEntry>::kTriviallyCopyableEntries, "");
+static_assert(!CircularArrayCTCBeamSearchTree<GenericCopyEntry>::kTriviallyCopyableEntries, "");
+
+} // beam_search